@@ -1,4 +1,6 @@
 #include <iostream>
+#include <winsock2.h> // before windows.h; AF_UNIX sockets for the RL server
+#include <afunix.h>
 #include <windows.h>
 #include <conio.h>
 #include <cstdlib>
@@ -6,1308 +8,4145 @@
 #include <vector>
 #include <algorithm>
 #include <utility>
-#include <unordered_set>
 #include <cmath>
 #include <string>
 #include <queue>
+#include <cstdint>
+#include <fstream>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <type_traits>
+#include <map>
+#include <array>
+#include <climits>
+#include <cstdio>
+#include <cstdarg>
+#include <new>
+#include <memory_resource>
+#include <optional>
+
+// AVX2 battle lanes (BattleBatch) on x86; other targets use the scalar path. MSVC allows the intrinsics in any
+// function, GCC/Clang need the target attribute. The CPU is checked at runtime either way.
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#include <immintrin.h>
+#define BATTLE_SIMD 1
+#define TARGET_AVX2
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define BATTLE_SIMD 1
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define BATTLE_SIMD 0
+#endif
+
+#ifdef _MSC_VER
+#pragma comment(lib, "Ws2_32.lib")
+#endif
 
 using namespace std;
 
+// Heap allocations made by this thread, for the benchmarks' allocs/op. Counting is one thread-local increment per
+// new, so it stays on in every mode. Once GCC inlines these into a caller it takes the malloc/free inside for a
+// mismatch with new/delete, so they stay out of line there.
+static thread_local uint64_t threadAllocations = 0;
+
+#if defined(__GNUC__)
+#define OUT_OF_LINE __attribute__((noinline))
+#else
+#define OUT_OF_LINE
+#endif
+
+OUT_OF_LINE void* operator new(size_t size) {
+	threadAllocations++;
+	if (void* p = malloc(size ? size : 1)) return p;
+	throw bad_alloc();
+}
+OUT_OF_LINE void operator delete(void* p) noexcept { free(p); }
+OUT_OF_LINE void operator delete(void* p, size_t) noexcept { free(p); }
+
+// Over-aligned new, which std::pmr's default resource may use for everything it hands out, is counted the same way
+OUT_OF_LINE void* operator new(size_t size, align_val_t align) {
+	threadAllocations++;
+	size_t alignment = max(static_cast<size_t>(align), sizeof(void*));
+#ifdef _MSC_VER
+	void* p = _aligned_malloc(size ? size : 1, alignment);
+#else
+	void* p = nullptr;
+	if (posix_memalign(&p, alignment, size ? size : 1) != 0) p = nullptr;
+#endif
+	if (p) return p;
+	throw bad_alloc();
+}
+OUT_OF_LINE void operator delete(void* p, align_val_t) noexcept {
+#ifdef _MSC_VER
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+OUT_OF_LINE void operator delete(void* p, size_t, align_val_t align) noexcept { operator delete(p, align); }
+
 enum Direction { STOP = 0, LEFT, RIGHT, UP, DOWN };
 
 static inline int sgn(int v) { return (v > 0) - (v < 0); }
 
-// Tile characters
-static const char TILE_BOX_WALL = '*';
-static const char TILE_FLOOR = '.';
-static const char TILE_CORRIDOR_WALL = '+'; // used for corridor boundaries (so we don't confuse with box walls)
+// Scope timers for --trace. Each thread records complete events into its own ring buffer (one writer, no locks on
+// the recording path; the ring is registered once per thread) and the rings are written out as Chrome/Perfetto
+// trace JSON when the run ends. A disabled tracer costs one relaxed load per scope; build with
+// TRACE_SCOPES=0 to compile the timers out entirely.
+#ifndef TRACE_SCOPES
+#define TRACE_SCOPES 1
+#endif
 
-class Exit {
-	int ex;
-	int ey;
+class Tracer {
 public:
-	Exit() : ex(-1), ey(-1) {}
+	struct Event {
+		const char* name; // string literal
+		uint64_t start;   // ns since the tracer's epoch
+		uint64_t duration;
+	};
 
-	// Place exit explicitly
-	void placeAt(int x, int y) {
-		ex = x; ey = y;
-	}
+	static const size_t RING_EVENTS = 1 << 16; // per thread; the oldest events are overwritten
 
-	// Place exit on any passable floor ('.'), optionally avoiding player's current position.
-	void placeRandomOnFloor(const vector<vector<char>>& grid, int avoidX = -1, int avoidY = -1) {
-		vector<pair<int, int>> candidates;
-		int h = static_cast<int>(grid.size());
-		int w = h ? static_cast<int>(grid[0].size()) : 0;
-		for (int y = 0; y < h; ++y) {
-			for (int x = 0; x < w; ++x) {
-				if (grid[y][x] == TILE_FLOOR && !(x == avoidX && y == avoidY)) {
-					candidates.emplace_back(x, y);
-				}
-			}
-		}
-		if (!candidates.empty()) {
-			auto p = candidates[rand() % candidates.size()];
-			ex = p.first;
-			ey = p.second;
-		}
-		else {
-			ex = -1;
-			ey = -1;
-		}
+	static Tracer& instance() {
+		static Tracer tracer;
+		return tracer;
 	}
 
-	bool isAt(int x, int y) const { return x == ex && y == ey; }
-};
+	static bool on() { return instance().enabled.load(memory_order_relaxed); }
 
-class Box {
-	int boxX;
-	int boxY;
-	int boxWidth;
-	int boxHeight;
-public:
-	Box(int boxWidths = 12, int boxHeights = 4)
-		: boxX(0), boxY(0), boxWidth(boxWidths), boxHeight(boxHeights) {
+	void enable() {
+		epoch = chrono::steady_clock::now();
+		enabled.store(true, memory_order_relaxed);
 	}
 
-	void placeAt(int x, int y) {
-		boxX = x;
-		boxY = y;
+	uint64_t now() const {
+		return static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - epoch).count());
 	}
 
-	void placeRandom(int areaWidth, int areaHeight) {
-		int minBoxX = 2;
-		int maxBoxX = areaWidth - boxWidth - 2;
-		int minBoxY = 1;
-		int maxBoxY = areaHeight - boxHeight - 1;
+	void record(const char* name, uint64_t start, uint64_t end) {
+		Ring& r = ring();
+		uint64_t n = r.head.load(memory_order_relaxed);
+		r.events[static_cast<size_t>(n % RING_EVENTS)] = { name, start, end - start };
+		r.head.store(n + 1, memory_order_release);
+	}
 
-		if (maxBoxX < minBoxX) {
-			boxX = (areaWidth - boxWidth) / 2;
-		}
-		else {
-			boxX = minBoxX + (rand() % (maxBoxX - minBoxX + 1));
+	// Call once the traced threads are done; events still being written by live threads may be skipped
+	bool write(const string& path) const {
+		ofstream out(path, ios::binary | ios::trunc);
+		if (!out) return false;
+		lock_guard<mutex> lock(registryMutex);
+		out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+		bool first = true;
+		char line[256];
+		for (const unique_ptr<Ring>& r : rings) {
+			snprintf(line, sizeof(line), "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+			         first ? "" : ",\n", r->tid, r->tid);
+			out << line;
+			first = false;
+			uint64_t head = r->head.load(memory_order_acquire);
+			for (uint64_t i = head > RING_EVENTS ? head - RING_EVENTS : 0; i < head; ++i) {
+				const Event& e = r->events[static_cast<size_t>(i % RING_EVENTS)];
+				snprintf(line, sizeof(line), ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+				         e.name, r->tid, e.start / 1000.0, e.duration / 1000.0);
+				out << line;
+			}
 		}
+		out << "\n]}\n";
+		return static_cast<bool>(out);
+	}
 
-		if (maxBoxY < minBoxY) {
-			boxY = (areaHeight - boxHeight) / 2;
-		}
-		else {
-			boxY = minBoxY + (rand() % (maxBoxY - minBoxY + 1));
+private:
+	struct Ring {
+		int tid = 0;
+		atomic<uint64_t> head{ 0 };
+		vector<Event> events = vector<Event>(RING_EVENTS);
+	};
+
+	atomic<bool> enabled{ false };
+	chrono::steady_clock::time_point epoch = chrono::steady_clock::now();
+	mutable mutex registryMutex;    // only taken when a thread records its first event, and by write()
+	vector<unique_ptr<Ring>> rings; // owned here so a worker's events outlive the worker
+
+	Ring& ring() {
+		static thread_local Ring* mine = nullptr;
+		if (!mine) {
+			lock_guard<mutex> lock(registryMutex);
+			rings.emplace_back(new Ring());
+			mine = rings.back().get();
+			mine->tid = static_cast<int>(rings.size()) - 1;
 		}
+		return *mine;
 	}
+};
 
-	int x() const {
-		return boxX;
-	}
-	int y() const {
-		return boxY;
-	}
-	int width() const {
-		return boxWidth;
+#if TRACE_SCOPES
+// Times the enclosing scope; next() closes the current event and opens another, for the phases of a long function
+class TraceScope {
+	const char* name;
+	uint64_t start = 0;
+
+public:
+	explicit TraceScope(const char* scopeName) : name(Tracer::on() ? scopeName : nullptr) {
+		if (name) start = Tracer::instance().now();
 	}
-	int height() const {
-		return boxHeight;
+	~TraceScope() { end(); }
+	TraceScope(const TraceScope&) = delete;
+	TraceScope& operator=(const TraceScope&) = delete;
+
+	void next(const char* scopeName) {
+		if (!name) return;
+		end();
+		name = scopeName;
+		start = Tracer::instance().now();
 	}
 
-	bool contains(int playerX, int playerY) const {
-		return playerX >= boxX && playerX < boxX + boxWidth && playerY >= boxY && playerY < boxY + boxHeight;
+private:
+	void end() {
+		if (!name) return;
+		Tracer& t = Tracer::instance();
+		t.record(name, start, t.now());
+		name = nullptr;
 	}
+};
+#else
+class TraceScope {
+public:
+	explicit TraceScope(const char*) {}
+	void next(const char*) {}
+};
+#endif
 
-	bool interiorContains(int playerX, int playerY) const {
-		return playerX > boxX && playerX < boxX + boxWidth - 1 && playerY > boxY && playerY < boxY + boxHeight - 1;
-	}
+// Enables the tracer and writes its file when main returns, whichever mode ran
+class TraceFile {
+	string path;
 
-	void drawBox(vector<vector<char>>& grid) const {
-		int height = static_cast<int>(grid.size());
-		int width = height ? static_cast<int>(grid[0].size()) : 0;
-		for (int i = 0; i < boxHeight; ++i) {
-			for (int j = 0; j < boxWidth; ++j) {
-				int gridY = boxY + i;
-				int gridX = boxX + j;
-				if (gridY < 0 || gridY >= height || gridX < 0 || gridX >= width)
-					continue;
-				if (i == 0 || i == boxHeight - 1 || j == 0 || j == boxWidth - 1) {
-					grid[gridY][gridX] = TILE_BOX_WALL;
-				}
-				else {
-					grid[gridY][gridX] = TILE_FLOOR;
-				}
-			}
-		}
+public:
+	explicit TraceFile(const string& tracePath) : path(tracePath) {
+		if (!path.empty()) Tracer::instance().enable();
 	}
+	~TraceFile() {
+		if (!path.empty() && !Tracer::instance().write(path)) cerr << "Could not write the trace to " << path << "\n";
+	}
+};
 
-	bool intersects(const Box& otherBox, int gap = 1) const {
-		int firstBoxLeftX = boxX - gap;
-		int firstBoxLeftY = boxY - gap;
-		int firstBoxRightX = boxX + boxWidth + gap;
-		int firstBoxRightY = boxY + boxHeight + gap;
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
 
-		int secondBoxLeftX = otherBox.boxX - gap;
-		int secondBoxLeftY = otherBox.boxY - gap;
-		int secondBoxRightX = otherBox.boxX + otherBox.boxWidth + gap - 1;
-		int secondBoxRightY = otherBox.boxY + otherBox.boxHeight + gap - 1;
+// Tile characters
+static const char TILE_BOX_WALL = '*';
+static const char TILE_FLOOR = '.';
+static const char TILE_CORRIDOR_WALL = '+'; // used for corridor boundaries (so we don't confuse with box walls)
 
-		bool xOverlap = firstBoxLeftX <= secondBoxRightX && firstBoxRightX >= secondBoxLeftX;
-		bool yOverlap = firstBoxLeftY <= secondBoxRightY && firstBoxRightY >= secondBoxLeftY;
-		return xOverlap && yOverlap;
-	}
+// Room-id layer kinds: each tile stores its kind in the top 2 bits and its box index in the low 14
+enum RoomKind : uint16_t { ROOM_NONE = 0, ROOM_INTERIOR = 1, ROOM_WALL = 2, ROOM_CORRIDOR = 3 };
+static const int ROOM_KIND_SHIFT = 14;
+static const uint16_t ROOM_INDEX_MASK = (1u << ROOM_KIND_SHIFT) - 1;
 
-	vector<pair<int, int>> closestEdge(int x, int y) const {
-		vector<pair<int, int>> edges;
-		int centerX = boxX + boxWidth / 2;
-		int centerY = boxY + boxHeight / 2;
-		int determineX = x - centerX;
-		int determineY = y - centerY;
+// Small, fast PRNG (xoshiro128++). Each game owns one so a session can be seeded, recorded and replayed,
+// and several games can run side by side without sharing rand()'s global state.
+class Rng {
+	uint32_t s[4];
 
-		if (abs(determineX) >= abs(determineY)) {
-			int edgeX = (determineX > 0) ? (boxX + boxWidth - 1) : boxX;
-			int midY = centerY;
-			int minY = boxY + 1;
-			int maxY = boxY + boxHeight - 2;
-			for (int determiner = -1; determiner <= 1; ++determiner) {
-				int edgeY = midY + determiner;
-				if (edgeY < minY) {
-					edgeY = minY;
-				}
-				if (edgeY > maxY) {
-					edgeY = maxY;
-				}
-				edges.emplace_back(edgeX, edgeY);
-			}
-		}
-		else {
-			int edgeY = (determineY > 0) ? (boxY + boxHeight - 1) : boxY;
-			int midX = centerX;
-			int minX = boxX + 1;
-			int maxX = boxX + boxWidth - 2;
-			for (int determiner = -1; determiner <= 1; ++determiner) {
-				int edgeX = midX + determiner;
-				if (edgeX < minX) {
-				edgeX = minX;
-				}
-				if (edgeX > maxX) {
-				edgeX = maxX;
-				}
-				edges.emplace_back(edgeX, edgeY);
-			}
+	static uint32_t rotl(uint32_t v, int k) { return (v << k) | (v >> (32 - k)); }
+
+public:
+	explicit Rng(uint64_t seed = 1) { reseed(seed); }
+
+	// Expand a 64-bit seed into the full state with splitmix64 so nearby seeds give unrelated streams.
+	void reseed(uint64_t seed) {
+		for (int i = 0; i < 4; i += 2) {
+			uint64_t z = (seed += 0x9E3779B97F4A7C15ull);
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+			z ^= z >> 31;
+			s[i] = static_cast<uint32_t>(z);
+			s[i + 1] = static_cast<uint32_t>(z >> 32);
 		}
+	}
 
-		sort(edges.begin(), edges.end());
-		edges.erase(unique(edges.begin(), edges.end()), edges.end());
-		return edges;
+	uint32_t next() {
+		uint32_t result = rotl(s[0] + s[3], 7) + s[0];
+		uint32_t t = s[1] << 9;
+		s[2] ^= s[0];
+		s[3] ^= s[1];
+		s[1] ^= s[2];
+		s[0] ^= s[3];
+		s[2] ^= t;
+		s[3] = rotl(s[3], 11);
+		return result;
 	}
-};
 
-class Enemy {
-	int ax;
-	int ay;
+	// Uniform integer in [0, n) using multiply-shift (no division)
+	int below(int n) {
+		if (n <= 0) return 0;
+		return static_cast<int>((static_cast<uint64_t>(next()) * static_cast<uint32_t>(n)) >> 32);
+	}
 
-	// Stats
-	int maxHealth;
-	int currentHealth;
-	int defense;
-	int strength;
+	// True with the given percent chance
+	bool chance(int percent) { return below(100) < percent; }
 
-	// Track last upgrade deltas to display messages after scaling
-	int lastUpHealth;
-	int lastUpDefense;
-	int lastUpStrength;
+	// Uniform double in [0, 1)
+	double unit() { return next() * (1.0 / 4294967296.0); }
+
+	void getState(uint32_t out[4]) const { memcpy(out, s, sizeof(s)); }
+	void setState(const uint32_t in[4]) { memcpy(s, in, sizeof(s)); }
+};
 
+// Flat byte buffers for game snapshots. Trivially copyable values and vectors of them are copied with memcpy, so a
+// snapshot is written and read back without any per-tile parsing; the reader bounds-checks every copy.
+class SaveWriter {
 public:
-	// Default health to 10 an other stats to 5; health starts full
-	Enemy(int h = 10, int d = 5, int s = 5)
-		: ax(-1), ay(-1),
-		  maxHealth(h), currentHealth(h), defense(d), strength(s),
-		  lastUpHealth(0), lastUpDefense(0), lastUpStrength(0) {
+	vector<char> bytes;
+
+	void putRaw(const void* p, size_t n) {
+		const char* c = static_cast<const char*>(p);
+		bytes.insert(bytes.end(), c, c + n);
 	}
 
-	void reset() { ax = -1; ay = -1; }
+	template <class T>
+	void put(const T& v) {
+		static_assert(is_trivially_copyable<T>::value, "snapshot fields must be plain data");
+		putRaw(&v, sizeof(T));
+	}
 
-	void placeAt(int x, int y) { ax = x; ay = y; }
+	template <class T, class A>
+	void putVec(const vector<T, A>& v) {
+		static_assert(is_trivially_copyable<T>::value, "snapshot fields must be plain data");
+		put(static_cast<uint32_t>(v.size()));
+		if (!v.empty()) putRaw(v.data(), v.size() * sizeof(T));
+	}
+};
 
-	// Accessors - position
-	int x() const { return ax; }
-	int y() const { return ay; }
-	bool isPlaced() const { return ax >= 0 && ay >= 0; }
+class SaveReader {
+	const char* p;
+	const char* end;
+	bool ok = true;
 
-	// Accessors - stats
-	int getMaxHealth() const { return maxHealth; }
-	int getCurrentHealth() const { return currentHealth; }
-	int getDefense() const { return defense; }
-	int getStrength() const { return strength; }
+public:
+	SaveReader(const char* data, size_t n) : p(data), end(data + n) {}
 
-	// Optional setters
-	void setMaxHealth(int mh) {
-		maxHealth = max(0, mh);
-		currentHealth = min(currentHealth, maxHealth);
+	bool good() const { return ok; }
+	bool atEnd() const { return p == end; }
+
+	bool getRaw(void* dst, size_t n) {
+		if (!ok || static_cast<size_t>(end - p) < n) return ok = false;
+		memcpy(dst, p, n);
+		p += n;
+		return true;
 	}
-	void setCurrentHealth(int ch) { currentHealth = max(0, min(ch, maxHealth)); }
-	void setDefense(int d) { defense = d; }
-	void setStrength(int s) { strength = s; }
 
-	// Healing helpers
-	void heal(int amount) { setCurrentHealth(currentHealth + max(0, amount)); }
-	void healToFull() { currentHealth = maxHealth; }
+	template <class T>
+	bool get(T& v) { return getRaw(&v, sizeof(T)); }
 
-	// Apply damage reduced by defense; returns damage actually taken
-	int applyDamage(int rawDamage) {
-		int dmg = max(0, rawDamage - defense);
-		currentHealth = max(0, currentHealth - dmg);
-		return dmg;
+	template <class T, class A>
+	bool getVec(vector<T, A>& v) {
+		uint32_t n = 0;
+		if (!get(n) || static_cast<size_t>(end - p) / sizeof(T) < n) return ok = false;
+		v.resize(n);
+		return n == 0 || getRaw(v.data(), n * sizeof(T));
 	}
-	bool isDead() const { return currentHealth <= 0; }
+};
 
-	// Move one step toward target (tx,ty) on floor; optionally avoid landing on a forbidden tile (e.g., player's current).
-	void stepToward(int tx, int ty, const vector<vector<char>>& grid, int forbidX = -1, int forbidY = -1) {
-		if (!isPlaced()) return;
-		int h = static_cast<int>(grid.size());
-		int w = h ? static_cast<int>(grid[0].size()) : 0;
-		auto canMove = [&](int nx, int ny) -> bool {
-			return nx >= 0 && ny >= 0 && nx < w && ny < h && grid[ny][nx] == TILE_FLOOR;
-			};
+// Copy-on-write value. Copies share one T until a holder asks to write, which first gives it a private copy, so
+// cloning a game only bumps reference counts for the parts the clone never changes. Reads go through the const
+// accessors; writes through edit(). Holders that share a T may live on different threads as long as only reads
+// happen there (the reference count is atomic and a writer only ever touches its own copy).
+template <class T>
+class CowPtr {
+	shared_ptr<T> p;
 
-		int dx = tx - ax;
-		int dy = ty - ay;
-		int stepx = (dx == 0) ? 0 : (dx > 0 ? 1 : -1);
-		int stepy = (dy == 0) ? 0 : (dy > 0 ? 1 : -1);
+public:
+	CowPtr() : p(make_shared<T>()) {}
+
+	const T& operator*() const { return *p; }
+	const T* operator->() const { return p.get(); }
+	operator const T&() const { return *p; }
+
+	// Container-style reads, so a shared vector reads like a plain one
+	template <class U = T>
+	auto operator[](size_t i) const -> decltype(declval<const U&>()[i]) { return (*p)[i]; }
+	size_t size() const { return p->size(); }
+	bool empty() const { return p->empty(); }
+	template <class U = T>
+	auto begin() const -> decltype(declval<const U&>().begin()) { return p->begin(); }
+	template <class U = T>
+	auto end() const -> decltype(declval<const U&>().end()) { return p->end(); }
+
+	T& edit() {
+		if (p.use_count() > 1) p = make_shared<T>(*p);
+		return *p;
+	}
 
-		auto tryMove = [&](int nx, int ny) -> bool {
-			if (!canMove(nx, ny)) return false;
-			if (forbidX >= 0 && forbidY >= 0 && nx == forbidX && ny == forbidY) return false;
-			ax = nx; ay = ny;
-			return true;
-			};
+	bool shared() const { return p.use_count() > 1; }
 
-		if (abs(dx) >= abs(dy)) {
-			if (stepx != 0 && tryMove(ax + stepx, ay)) return;
-			if (stepy != 0) tryMove(ax, ay + stepy);
+	// Replace the value outright (no copy of the old one, even when it is shared)
+	void assign(T v) { p = make_shared<T>(move(v)); }
+};
+
+// Bump allocator for containers that are built, used and thrown away together; standard containers reach it through
+// std::pmr. Allocating advances a pointer through one buffer, freeing does nothing, and reset() rewinds to the start.
+// Whatever spilled past the end of the buffer since the last reset is folded into a bigger buffer there, so once an
+// arena has seen its largest job it stops calling malloc. Everything allocated from it must be gone before reset().
+class Arena {
+	// Overflow goes to the heap, counted
+	class Spill : public pmr::memory_resource {
+	public:
+		size_t bytes = 0;
+	private:
+		void* do_allocate(size_t n, size_t align) override {
+			bytes += n;
+			return pmr::new_delete_resource()->allocate(n, align);
 		}
-		else {
-			if (stepy != 0 && tryMove(ax, ay + stepy)) return;
-			if (stepx != 0) tryMove(ax + stepx, ay);
+		void do_deallocate(void* p, size_t n, size_t align) override { pmr::new_delete_resource()->deallocate(p, n, align); }
+		bool do_is_equal(const pmr::memory_resource& o) const noexcept override { return this == &o; }
+	};
+
+	vector<unsigned char> buffer;
+	Spill spill;
+	optional<pmr::monotonic_buffer_resource> bump;
+
+public:
+	explicit Arena(size_t bytes) : buffer(bytes) { bump.emplace(buffer.data(), buffer.size(), &spill); }
+	Arena(const Arena&) = delete;
+	Arena& operator=(const Arena&) = delete;
+
+	pmr::memory_resource* get() { return &*bump; }
+	size_t capacity() const { return buffer.size(); }
+
+	void reset() {
+		bump.reset(); // hands the spilled blocks back
+		if (spill.bytes > 0) {
+			buffer.assign(buffer.size() + spill.bytes, 0);
+			spill.bytes = 0;
 		}
+		bump.emplace(buffer.data(), buffer.size(), &spill);
 	}
+};
 
-	// Place at the center of a random box that does NOT contain the player and is NOT the exit box (exit is centered).
-	void placeInRandomBoxCenter(const vector<Box>& boxes, int playerX, int playerY, const Exit& exitTile, const vector<vector<char>>& grid)
-	{
-		vector<int> candidates;
-		int h = static_cast<int>(grid.size());
-		int w = h ? static_cast<int>(grid[0].size()) : 0;
+// Vector with its N slots inline, for short lists whose bound is known up front; it never touches the heap. A push
+// past N is refused: push_back/emplace_back return false and leave the contents as they were.
+template <class T, size_t N>
+class FixedVector {
+	T items[N];
+	size_t count = 0;
 
-		for (size_t i = 0; i < boxes.size(); ++i) {
-			const Box& b = boxes[i];
-			int cx = b.x() + b.width() / 2;
-			int cy = b.y() + b.height() / 2;
+public:
+	void clear() { count = 0; }
+	void resize(size_t n) { count = min(n, N); }
+	bool push_back(const T& v) {
+		if (count == N) return false;
+		items[count++] = v;
+		return true;
+	}
+	template <class... Args>
+	bool emplace_back(Args&&... args) {
+		if (count == N) return false;
+		items[count++] = T(forward<Args>(args)...);
+		return true;
+	}
 
-			// inside bounds and on a floor tile
-			if (cx < 0 || cy < 0 || cx >= w || cy >= h) continue;
-			if (grid[cy][cx] != TILE_FLOOR) continue;
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	static size_t capacity() { return N; }
+	T& operator[](size_t i) { return items[i]; }
+	const T& operator[](size_t i) const { return items[i]; }
+	const T& front() const { return items[0]; }
+	const T& back() const { return items[count - 1]; }
+	T* begin() { return items; }
+	T* end() { return items + count; }
+	const T* begin() const { return items; }
+	const T* end() const { return items + count; }
+};
 
-			// exclude any box containing the player
-			if (b.contains(playerX, playerY)) continue;
+// Packed map: 4 bits per tile, 16 tiles to a 64-bit word, each row padded to whole words. The low two bits are the
+// tile kind, bit 2 marks room interiors and bit 3 is the fog (revealed) bit, so the map, its fog and its room mask
+// share one array at half a byte per tile. Reads decode through a shift, a mask and a table lookup with no branches;
+// fog and floor queries over a span work a word (16 tiles) at a time.
+enum TileKind : uint8_t { KIND_ROCK = 0, KIND_FLOOR = 1, KIND_BOX_WALL = 2, KIND_CORRIDOR_WALL = 3 };
+
+class TileGrid {
+	static const uint64_t KIND_BITS = 0x3;
+	static const uint64_t INTERIOR_BIT = 0x4;
+	static const uint64_t FOG_BIT = 0x8;
+	static const uint64_t LANES = 0x1111111111111111ull; // bit 0 of every nibble
+
+	int w = 0;
+	int h = 0;
+	int wordsPerRow = 0;
+	vector<uint64_t> words;
+
+	uint64_t word(int x, int y) const { return words[static_cast<size_t>(y * wordsPerRow + (x >> 4))]; }
+	uint64_t& word(int x, int y) { return words[static_cast<size_t>(y * wordsPerRow + (x >> 4))]; }
+	static int shift(int x) { return (x & 15) << 2; }
+
+	// Nibbles for columns x0..x1 (inclusive) of the word that starts at column base, as a mask of their bit 0
+	static uint64_t spanLanes(int base, int x0, int x1) {
+		int lo = max(x0, base) - base;
+		int hi = min(x1, base + 15) - base;
+		return (LANES >> ((15 - hi) << 2)) & (LANES << (lo << 2));
+	}
 
-			// exclude the exit box (exit is always placed at a box center)
-			if (exitTile.isAt(cx, cy)) continue;
+	// Bit 0 of each nibble whose kind is floor (kind bits 01)
+	static uint64_t floorLanes(uint64_t v) { return v & ~(v >> 1) & LANES; }
 
-			candidates.push_back(static_cast<int>(i));
-		}
+	// Gather the lanes of a lane mask into 16 contiguous bits (lane i -> bit i)
+	static uint64_t packLanes(uint64_t m) {
+		m = (m | (m >> 3)) & 0x0303030303030303ull;
+		m = (m | (m >> 6)) & 0x000F000F000F000Full;
+		m = (m | (m >> 12)) & 0x000000FF000000FFull;
+		return (m | (m >> 24)) & 0xFFFFull;
+	}
 
-		if (!candidates.empty()) {
-			int idx = candidates[rand() % candidates.size()];
-			const Box& b = boxes[static_cast<size_t>(idx)];
-			ax = b.x() + b.width() / 2;
-			ay = b.y() + b.height() / 2;
-		}
-		else {
-			reset();
-		}
+	// Number of set lanes in a lane mask (at most 16)
+	static int countLanes(uint64_t m) {
+		m = (m + (m >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+		return static_cast<int>((m * 0x0101010101010101ull) >> 56);
 	}
 
-	bool isAt(int x, int y) const { return x == ax && y == ay; }
-
-	// Expose last per-stat deltas applied during the most recent difficulty increase
-	void getLastUpgradeDelta(int& h, int& d, int& s) const {
-		h = lastUpHealth;
-		d = lastUpDefense;
-		s = lastUpStrength;
+	static uint64_t kindOf(char c) {
+		return c == TILE_FLOOR ? KIND_FLOOR : c == TILE_BOX_WALL ? KIND_BOX_WALL : c == TILE_CORRIDOR_WALL ? KIND_CORRIDOR_WALL : KIND_ROCK;
 	}
 
-	// New behavior: spend 3 upgrade points across MaxHealth/Defense/Strength in any combination.
-	void enemyDifficultyIncrease() {
-		// reset last-deltas
-		lastUpHealth = lastUpDefense = lastUpStrength = 0;
-
-		int points = 3;
-		while (points-- > 0) {
-			switch (rand() % 3) {
-				case 0: lastUpHealth++;   break;
-				case 1: lastUpDefense++;  break;
-				default:lastUpStrength++; break;
-			}
+	void orRect(int x0, int y0, int x1, int y1, uint64_t bit) {
+		x0 = max(0, x0); y0 = max(0, y0); x1 = min(w - 1, x1); y1 = min(h - 1, y1);
+		for (int y = y0; y <= y1; ++y) {
+			for (int k = x0 >> 4; k <= x1 >> 4; ++k) words[static_cast<size_t>(y * wordsPerRow + k)] |= spanLanes(k << 4, x0, x1) * bit;
 		}
-
-		// apply upgrades
-		maxHealth += lastUpHealth;
-		defense   += lastUpDefense;
-		strength  += lastUpStrength;
-
-		// keep health full after scaling
-		currentHealth = maxHealth;
-	}
-
-	// NEW: Apply explicit upgrades (used by Levelling to apply biased point distribution)
-	void applyUpgrades(int upH, int upD, int upS) {
-		lastUpHealth  = upH;
-		lastUpDefense = upD;
-		lastUpStrength= upS;
-		maxHealth += upH;
-		defense   += upD;
-		strength  += upS;
-		currentHealth = maxHealth;
 	}
-};
-
-class Player {
-	int x;
-	int y;
-
-	int maxHealth;
-	int currentHealth;
-	int defense;
-	int strength;
-	int potions; // healing potion inventory
 
 public:
-	Player(int h = 20, int d = 2, int s = 6)
-		: x(0), y(0), maxHealth(h), currentHealth(h), defense(d), strength(s), potions(0) {
+	// Glyph per tile kind; TileGrid[y][x] reads like the old char grid
+	class Row {
+		const TileGrid* g;
+		int y;
+	public:
+		Row(const TileGrid* g, int y) : g(g), y(y) {}
+		char operator[](int x) const { return g->glyph(x, y); }
+	};
+
+	TileGrid() = default;
+	TileGrid(int width, int height) { reset(width, height); }
+
+	// All rock, nothing revealed
+	void reset(int width, int height) {
+		w = width;
+		h = height;
+		wordsPerRow = (width + 15) >> 4;
+		words.assign(static_cast<size_t>(wordsPerRow) * static_cast<size_t>(max(0, height)), 0);
 	}
 
-	// Position
-	int getX() const { 
-		return x; 
-	}
-	int getY() const { 
-		return y; 
-	}
-	void setX(int nx) { 
-		x = nx; 
-	}
-	void setY(int ny) {
-		y = ny; 
-	}
-	void setPosition(int nx, int ny) {
-		x = nx; 
-		y = ny; 
-	}
+	int width() const { return w; }
+	int height() const { return h; }
+	bool inBounds(int x, int y) const { return x >= 0 && y >= 0 && x < w && y < h; }
+	size_t bytes() const { return words.size() * sizeof(uint64_t); }
 
-	// Stats
-	int getMaxHealth() const {
-		return maxHealth; 
-	}
-	int getCurrentHealth() const { 
-		return currentHealth; 
+	// Unchecked reads; callers keep (x,y) in bounds
+	TileKind kind(int x, int y) const { return static_cast<TileKind>((word(x, y) >> shift(x)) & KIND_BITS); }
+	char glyph(int x, int y) const {
+		static const char glyphs[4] = { ' ', TILE_FLOOR, TILE_BOX_WALL, TILE_CORRIDOR_WALL };
+		return glyphs[kind(x, y)];
 	}
-	int getDefense() const { 
-		return defense; 
+	bool isFloor(int x, int y) const { return kind(x, y) == KIND_FLOOR; }
+	bool interior(int x, int y) const { return (word(x, y) >> shift(x)) & INTERIOR_BIT; }
+	bool revealed(int x, int y) const { return (word(x, y) >> shift(x)) & FOG_BIT; }
+	Row operator[](int y) const { return Row(this, y); }
+
+	// Writes keep the tile's other bits
+	void setKind(int x, int y, TileKind k) {
+		uint64_t& v = word(x, y);
+		v = (v & ~(KIND_BITS << shift(x))) | (static_cast<uint64_t>(k) << shift(x));
 	}
-	int getStrength() const { 
-		return strength; 
+	void set(int x, int y, char glyph) { setKind(x, y, static_cast<TileKind>(kindOf(glyph))); }
+	void reveal(int x, int y) { word(x, y) |= FOG_BIT << shift(x); }
+
+	// Rectangles (inclusive, clipped to the map), a word at a time
+	void revealRect(int x0, int y0, int x1, int y1) { orRect(x0, y0, x1, y1, FOG_BIT); }
+	void markInterior(int x0, int y0, int x1, int y1) { orRect(x0, y0, x1, y1, INTERIOR_BIT); }
+
+	bool anyRevealedInRect(int x0, int y0, int x1, int y1) const {
+		x0 = max(0, x0); y0 = max(0, y0); x1 = min(w - 1, x1); y1 = min(h - 1, y1);
+		for (int y = y0; y <= y1; ++y) {
+			for (int k = x0 >> 4; k <= x1 >> 4; ++k) {
+				if (words[static_cast<size_t>(y * wordsPerRow + k)] & spanLanes(k << 4, x0, x1) * FOG_BIT) return true;
+			}
+		}
+		return false;
 	}
 
-	void setMaxHealth(int mh) {
-		maxHealth = max(0, mh);
-		currentHealth = min(currentHealth, maxHealth);
-	}
-	void setCurrentHealth(int ch) { 
-		currentHealth = max(0, min(ch, maxHealth)); 
-	}
-	void setDefense(int d) { 
-		defense = d; 
+	// Tiles x0..x0+15 of row y (x0 a multiple of 16, in bounds) as one bit each: those of kind k / inside a room
+	uint64_t kindBits(int x0, int y, TileKind k) const {
+		uint64_t same = ~(word(x0, y) ^ (LANES * static_cast<uint64_t>(k)));
+		return packLanes(same & (same >> 1) & LANES & spanLanes(x0, x0, w - 1));
 	}
-	void setStrength(int s) { 
-		strength = s; 
+	uint64_t interiorBits(int x0, int y) const { return packLanes((word(x0, y) >> 2) & LANES & spanLanes(x0, x0, w - 1)); }
+
+	// Floor tiles in row y between x0 and x1 (inclusive)
+	int countFloor(int y, int x0, int x1) const {
+		if (y < 0 || y >= h) return 0;
+		x0 = max(0, x0); x1 = min(w - 1, x1);
+		int n = 0;
+		for (int k = x0 >> 4; k <= x1 >> 4 && x0 <= x1; ++k) {
+			n += countLanes(floorLanes(words[static_cast<size_t>(y * wordsPerRow + k)]) & spanLanes(k << 4, x0, x1));
+		}
+		return n;
 	}
 
-	// Healing helpers
-	void heal(int amount) { 
-		setCurrentHealth(currentHealth + max(0, amount)); 
-	}
-	void healToFull() { 
-		currentHealth = maxHealth; 
+	// The n-th floor tile in row-major order (0-based); false if there are not that many
+	bool nthFloor(int n, int& outX, int& outY) const {
+		for (int y = 0; y < h; ++y) {
+			for (int k = 0; k < wordsPerRow; ++k) {
+				uint64_t lanes = floorLanes(words[static_cast<size_t>(y * wordsPerRow + k)]) & spanLanes(k << 4, 0, w - 1);
+				int c = countLanes(lanes);
+				if (n >= c) {
+					n -= c;
+					continue;
+				}
+				for (int lane = 0; lane < 16; ++lane) {
+					if (((lanes >> (lane << 2)) & 1) && n-- == 0) {
+						outX = (k << 4) + lane;
+						outY = y;
+						return true;
+					}
+				}
+			}
+		}
+		return false;
 	}
 
-	// Damage helper
-	int applyDamage(int rawDamage) {
-		int dmg = max(0, rawDamage - defense);
-		currentHealth = max(0, currentHealth - dmg);
-		return dmg;
+	void save(SaveWriter& out) const {
+		out.put(w);
+		out.put(h);
+		out.putVec(words);
 	}
 
-	bool isDead() const { 
-		return currentHealth <= 0; 
+	// Run-length form for archived floors: the tiles' nibbles (kind, interior and fog bits) in row-major order as
+	// (nibble << 4 | run) bytes; a run field of 0 means the length follows as two more bytes
+	void saveRuns(SaveWriter& out) const {
+		vector<uint8_t> runs;
+		int total = w * h;
+		auto nibble = [&](int i) { return static_cast<uint8_t>((word(i % w, i / w) >> shift(i % w)) & 0xF); };
+		for (int i = 0; i < total;) {
+			uint8_t v = nibble(i);
+			int j = i + 1;
+			while (j < total && j - i < 0xFFFF && nibble(j) == v) ++j;
+			int run = j - i;
+			if (run <= 15) runs.push_back(static_cast<uint8_t>(v << 4 | run));
+			else {
+				runs.push_back(static_cast<uint8_t>(v << 4));
+				runs.push_back(static_cast<uint8_t>(run & 0xFF));
+				runs.push_back(static_cast<uint8_t>(run >> 8));
+			}
+			i = j;
+		}
+		out.put(w);
+		out.put(h);
+		out.putVec(runs);
 	}
 
-	// Potions inventory
-	int getPotions() const { 
-		return potions; 
-	}
-	void addPotions(int n) { 
-		potions = max(0, potions + n); 
-	}
-	bool canUsePotion() const { 
-		return potions > 0 && currentHealth < maxHealth; 
+	// The loaders take the size the caller already checked, so a corrupt header can't ask reset() for a huge grid
+	bool loadRuns(SaveReader& in, int expectWidth, int expectHeight) {
+		int nw = 0, nh = 0;
+		vector<uint8_t> runs;
+		if (!in.get(nw) || !in.get(nh) || nw != expectWidth || nh != expectHeight || !in.getVec(runs)) return false;
+		reset(nw, nh);
+		int total = w * h, i = 0;
+		for (size_t r = 0; r < runs.size(); ++r) {
+			uint64_t v = runs[r] >> 4;
+			int run = runs[r] & 0xF;
+			if (run == 0) {
+				if (r + 2 >= runs.size()) return false;
+				run = runs[r + 1] | runs[r + 2] << 8;
+				r += 2;
+			}
+			if (run > total - i) return false;
+			for (int end = i + run; i < end; ++i) word(i % w, i / w) |= v << shift(i % w);
+		}
+		return i == total;
 	}
-	bool usePotion() {
-		if (!canUsePotion()) 
-			return false;
-		potions--;
-		heal(maxHealth / 2);
-		return true;
+
+	bool load(SaveReader& in, int expectWidth, int expectHeight) {
+		int nw = 0, nh = 0;
+		if (!in.get(nw) || !in.get(nh) || nw != expectWidth || nh != expectHeight) return false;
+		reset(nw, nh);
+		size_t expected = words.size();
+		return in.getVec(words) && words.size() == expected;
 	}
 };
 
-class Combat {
-public:
-	// Shows a modal "combat screen" in the SAME console window, then returns.
-	void OpenModal(const wchar_t* title = L"Combat",
-	               const wchar_t* message = L"You made contact with an enemy!\nPress Esc/Enter/Space to continue.")
-	{
-		// Clear current console frame
-		system("cls");
+// The console as the text screens see it. The window size is asked for once and cached; a resize event in the input
+// queue (ConsoleKeys watches for them) marks it stale so the next screen asks again. Output is UTF-8 and goes out in
+// one write per frame: present() blanks the window in place first (what cls did, minus the process), write() doesn't.
+class Terminal {
+	int cols = 80;
+	int rows = 25;
+	int bufferCols = 80; // buffer rows can be wider than the window
+	bool stale = true;
+
+	Terminal() {
+		// Resize events only reach the input queue when asked for
+		HANDLE in = GetStdHandle(STD_INPUT_HANDLE);
+		DWORD mode = 0;
+		if (GetConsoleMode(in, &mode)) SetConsoleMode(in, mode | ENABLE_WINDOW_INPUT);
+		SetConsoleOutputCP(CP_UTF8);
+	}
 
-		// Query console size to format a bordered screen
-		HANDLE hOut = GetStdHandle(STD_OUTPUT_HANDLE);
+	void refresh() {
+		if (!stale) return;
 		CONSOLE_SCREEN_BUFFER_INFO csbi{};
-		int cols = 80, rows = 25;
-		if (GetConsoleScreenBufferInfo(hOut, &csbi)) {
+		if (GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &csbi)) {
 			cols = csbi.srWindow.Right - csbi.srWindow.Left + 1;
 			rows = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
+			bufferCols = max<int>(cols, csbi.dwSize.X);
 		}
+		stale = false;
+	}
 
-		auto border = std::wstring(static_cast<size_t>(cols), L'#');
-		auto printCentered = [&](const std::wstring& s) {
-			int pad = max(0, (cols - static_cast<int>(s.size())) / 2);
-			std::wcout << std::wstring(static_cast<size_t>(pad), L' ') << s << L"\n";
-		};
-
-		std::wcout << border << L"\n";
-		printCentered(title ? title : L"Combat");
-		std::wcout << L"\n";
+public:
+	static Terminal& instance() {
+		static Terminal t;
+		return t;
+	}
 
-		// Split message on '\n' and center each line
-		std::wstring msg = message ? message : L"";
-		size_t start = 0;
-		while (start <= msg.size()) {
-			size_t pos = msg.find(L'\n', start);
-			std::wstring line = msg.substr(start, (pos == std::wstring::npos) ? std::wstring::npos : pos - start);
-			printCentered(line);
-			if (pos == std::wstring::npos) break;
-			start = pos + 1;
+	int width() { refresh(); return cols; }
+	int height() { refresh(); return rows; }
+	void invalidate() { stale = true; }
+
+	// Flags a resize among the pending input records without taking any out; returns how many it looked at
+	DWORD watchResize() {
+		HANDLE in = GetStdHandle(STD_INPUT_HANDLE);
+		DWORD pending = 0, seen = 0;
+		if (!GetNumberOfConsoleInputEvents(in, &pending) || pending == 0) return 0;
+		INPUT_RECORD records[32];
+		if (!PeekConsoleInput(in, records, min<DWORD>(pending, 32), &seen)) return 0;
+		for (DWORD i = 0; i < seen; ++i) {
+			if (records[i].EventType == WINDOW_BUFFER_SIZE_EVENT) stale = true;
 		}
+		return seen;
+	}
 
-		std::wcout << L"\n";
-		printCentered(L"[Esc]  [Enter]  [Space] to continue");
-		std::wcout << border << L"\n";
-		std::wcout.flush();
+	// Drops the first n input records (already looked at, none a key press); with none to drop, blocks until input
+	// arrives
+	void waitForInput(DWORD n) {
+		HANDLE in = GetStdHandle(STD_INPUT_HANDLE);
+		INPUT_RECORD records[32];
+		DWORD got = 0;
+		if (n > 0) ReadConsoleInput(in, records, min<DWORD>(n, 32), &got);
+		else WaitForSingleObject(in, INFINITE);
+	}
 
-		// Wait for a key without echoing
-		for (;;) {
-			int ch = _getch();
-			if (ch == 27 || ch == 13 || ch == ' ') break; // ESC / ENTER / SPACE
-		}
+	void write(const string& frame) {
+		HANDLE out = GetStdHandle(STD_OUTPUT_HANDLE);
+		COORD origin{};
+		SetConsoleCursorPosition(out, origin);
+		DWORD written = 0;
+		WriteConsoleA(out, frame.data(), static_cast<DWORD>(frame.size()), &written, nullptr);
+	}
 
-		// Drain any extra buffered keystrokes to avoid affecting the game loop
-		while (_kbhit()) { (void)_getch(); }
+	void present(const string& frame) {
+		refresh();
+		DWORD blanked = 0;
+		FillConsoleOutputCharacterA(GetStdHandle(STD_OUTPUT_HANDLE), ' ', static_cast<DWORD>(bufferCols * rows), COORD{}, &blanked);
+		write(frame);
+	}
+};
 
-		// Let the game redraw its next frame
+// vsnprintf into a fixed buffer; returns the length written, cut to what fit
+static size_t formatArgs(char* buf, size_t size, const char* fmt, va_list args) {
+	int n = vsnprintf(buf, size, fmt, args);
+	return static_cast<size_t>(max(0, min(n, static_cast<int>(size) - 1)));
+}
+
+// printf into a string
+static string formatText(const char* fmt, ...) {
+	char buf[256];
+	va_list args;
+	va_start(args, fmt);
+	size_t n = formatArgs(buf, sizeof(buf), fmt, args);
+	va_end(args);
+	return string(buf, n);
+}
+
+// Layout for the text screens (battle, shop, modals). Widgets stack from the top of the window into one reused UTF-8
+// buffer, and present() hands it to the Terminal. Widths count code points, so centring holds for non-ASCII text.
+class TextScreen {
+	string out;
+	int cols = 80;
+	int rows = 25;
+
+	static int columns(const char* s, size_t n) {
+		int c = 0;
+		for (size_t i = 0; i < n; ++i) c += (static_cast<unsigned char>(s[i]) & 0xC0) != 0x80;
+		return c;
 	}
 
-	// Interactive battle with explicit starter: playerStarts = true if player walked into the enemy.
-	// Defend action expires at the start of the defender's next turn if unused.
-	// Parry: If a defending character is dealt damage, they counter for scaled true damage.
-	// Returns true if the player successfully ran away (escaped).
-	bool OpenBattle(Player& player, Enemy& enemy, bool playerStarts, int prevPlayerX, int prevPlayerY) {
-		auto getConsoleSize = []() {
-			HANDLE hOut = GetStdHandle(STD_OUTPUT_HANDLE);
-			CONSOLE_SCREEN_BUFFER_INFO csbi{};
-			int cols = 80, rows = 25;
-			if (GetConsoleScreenBufferInfo(hOut, &csbi)) {
-				cols = csbi.srWindow.Right - csbi.srWindow.Left + 1;
-				rows = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
-			}
-			return pair<int,int>(cols, rows);
-		};
+	void line(const char* s, size_t n, int pad) {
+		out.append(static_cast<size_t>(pad), ' ');
+		out.append(s, n);
+		out += '\n';
+	}
 
-		// Defend buffers: when true, the next incoming damage is reduced by that defender's Defense.
-		bool playerDefendReady = false;
-		bool enemyDefendReady  = false;
+public:
+	// The screen being built on this thread
+	static TextScreen& frame() {
+		static thread_local TextScreen screen;
+		return screen;
+	}
 
-		auto render = [&](const vector<wstring>& lines, bool showMenu, const Player& p) {
-			auto cols = getConsoleSize().first, rows = getConsoleSize().second;
-			system("cls");
+	void begin() {
+		Terminal& t = Terminal::instance();
+		cols = t.width();
+		rows = t.height();
+		out.clear();
+	}
 
-			auto border = std::wstring(static_cast<size_t>(cols), L'#');
-			auto printCentered = [&](const std::wstring& s) {
-				int pad = max(0, (cols - static_cast<int>(s.size())) / 2);
-				std::wcout << std::wstring(static_cast<size_t>(pad), L' ') << s << L"\n";
-			};
+	int height() const { return rows; }
 
-			std::wcout << border << L"\n";
-			printCentered(L"Combat");
-			std::wcout << L"\n";
+	void blank() { line("", 0, 0); }
+	void rule() {
+		out.append(static_cast<size_t>(cols), '#');
+		out += '\n';
+	}
 
-			// Keep within the console height: leave 4 lines for title/menu/borders
-			int maxLines = max(0, rows - 4);
-			int start = 0;
-			if ((int)lines.size() > maxLines) start = (int)lines.size() - maxLines;
-			for (size_t i = static_cast<size_t>(start); i < lines.size(); ++i) {
-				printCentered(lines[i]);
-			}
+	void centered(const char* s, size_t n) { line(s, n, max(0, (cols - columns(s, n)) / 2)); }
+	void centered(const char* s) { centered(s, strlen(s)); }
+	void centered(const string& s) { centered(s.data(), s.size()); }
+	void centeredf(const char* fmt, ...) {
+		char buf[256];
+		va_list args;
+		va_start(args, fmt);
+		size_t n = formatArgs(buf, sizeof(buf), fmt, args);
+		va_end(args);
+		centered(buf, n);
+	}
 
-			std::wcout << L"\n";
-			if (showMenu) {
-				std::wstring defendStatus = playerDefendReady ? L" (Defend active)" : L"";
-				printCentered(L"Your turn: [1] Attack   [2] Defend   [3] Item (Potions: " +
-				              std::to_wstring(p.getPotions()) + L")   [4] Run (40%)" + defendStatus);
-			} else {
-				printCentered(L"[Esc]/[Enter]/[Space] to continue");
+	// One centred line per line of text
+	void paragraph(const char* text) {
+		for (;;) {
+			const char* end = strchr(text, '\n');
+			if (!end) {
+				centered(text);
+				return;
 			}
-			std::wcout << border << L"\n";
-			std::wcout.flush();
-		};
+			centered(text, static_cast<size_t>(end - text));
+			text = end + 1;
+		}
+	}
 
-		vector<wstring> log;
-		bool playerTurn = playerStarts;
+	// Scrolling log: the newest entries that fit in the given number of lines
+	void log(const vector<string>& entries, int lines) {
+		size_t first = entries.size() > static_cast<size_t>(max(0, lines)) ? entries.size() - static_cast<size_t>(max(0, lines)) : 0;
+		for (size_t i = first; i < entries.size(); ++i) centered(entries[i]);
+	}
 
-		while (!player.isDead() && !enemy.isDead()) {
-			// Expire defend at the start of the defender's own turn if it wasn't used.
-			if (playerTurn) {
-				// Player's turn begins: player's previous defend (if unused) wears off now.
-				if (playerDefendReady) {
-					playerDefendReady = false;
-				}
-			} else {
-				// Enemy's turn begins: enemy's previous defend (if unused) wears off now.
-				if (enemyDefendReady) {
-					enemyDefendReady = false;
-				}
-			}
+	// Menu entry: "[key] label"
+	void option(char key, const char* fmt, ...) {
+		char buf[256] = { '[', key, ']', ' ' };
+		va_list args;
+		va_start(args, fmt);
+		size_t n = 4 + formatArgs(buf + 4, sizeof(buf) - 4, fmt, args);
+		va_end(args);
+		centered(buf, n);
+	}
 
-			// Enemy turn
-			if (!playerTurn) {
-				// 20% chance to defend instead of attacking
-				if ((rand() % 100) < 20) {
-					enemyDefendReady = true;
-					log.push_back(L"Enemy braces to defend. Next damage taken reduced by " +
-					              std::to_wstring(enemy.getDefense()) + L".");
-					log.push_back(L" ");
-					playerTurn = true;
-					continue;
-				}
+	// Bordered panel: a rule, the centred title and a gap; closePanel() draws the bottom rule
+	void openPanel(const char* title) {
+		rule();
+		centered(title);
+		blank();
+	}
+	void closePanel() { rule(); }
 
-				// Enemy attacks
-				int raw = max(0, enemy.getStrength());
-				if (rand() % 100 < 10) {
-					// 10% chance for critical hit (1.5x damage)
-					raw = static_cast<int>(static_cast<double>(raw) * 1.5);
-					log.push_back(L"Enemy lands a critical hit!");
-				}
-				int reducedBy = 0;
-				bool playerConsumedDefend = false;
-				if (playerDefendReady) {
-					reducedBy = player.getDefense();
-					playerDefendReady = false; // consume the defend
-					playerConsumedDefend = true;
-				}
-				int dmg = max(1, raw - reducedBy);
-				int newHP = max(0, player.getCurrentHealth() - dmg);
-				player.setCurrentHealth(newHP);
-
-				std::wstring line = L"Enemy hits you for " + std::to_wstring(dmg);
-				if (reducedBy > 0) line += L" (reduced by " + std::to_wstring(reducedBy) + L")";
-				line += L". Health: " + std::to_wstring(newHP) +
-				        L"/" + std::to_wstring(player.getMaxHealth());
-				log.push_back(line);
-
-				// Parry: if defending and actually took damage, deal true damage back
-				if (playerConsumedDefend && dmg > 0) {
-					int parry = ((dmg + player.getStrength()) / player.getDefense());
-					parry = max(1, parry); // ensure parry has effect
-					int eHP = max(0, enemy.getCurrentHealth() - parry);
-					enemy.setCurrentHealth(eHP);
-					log.push_back(L"You parry and deals " + std::to_wstring(parry) + L" damage back. Enemy health: " +
-					              std::to_wstring(eHP) + L"/" + std::to_wstring(enemy.getMaxHealth()));
-				}
+	void present() { Terminal::instance().present(out); }
+};
 
-				log.push_back(L" ");
-				playerTurn = true;
-				continue;
-			}
+// Which screen consumed a key; stored in the replay log so playback can detect a diverged session.
+enum KeyContext : uint8_t { KEY_MOVE = 0, KEY_BATTLE, KEY_SHOP, KEY_MODAL };
 
-			// Player turn
-			for (;;) {
-				render(log, true, player);
-				int ch = _getch();
-				if (ch == '1') {
-					// Attack
-					int raw = max(0, player.getStrength());
-					if (rand() % 100 < 10) {
-						// 10% chance for critical hit (1.5x damage)
-						raw = static_cast<int>(static_cast<double>(raw) * 1.5);
-						log.push_back(L"You land a critical hit!");
-					}
-					int reducedBy = 0;
-					bool enemyConsumedDefend = false;
-					if (enemyDefendReady) {
-						reducedBy = enemy.getDefense();
-						enemyDefendReady = false; // consume the defend
-						enemyConsumedDefend = true;
-					}
-					int dmg = max(1, raw - reducedBy);
-					int newHP = max(0, enemy.getCurrentHealth() - dmg);
-					enemy.setCurrentHealth(newHP);
-
-					std::wstring line = L"You hit Enemy for " + std::to_wstring(dmg);
-					if (reducedBy > 0) line += L" (reduced by " + std::to_wstring(reducedBy) + L")";
-					line += L". Enemy health: " + std::to_wstring(newHP) +
-					        L"/" + std::to_wstring(enemy.getMaxHealth());
-					log.push_back(line);
-
-					// Parry: if defending and actually took damage, deal true damage back
-					if (enemyConsumedDefend && dmg > 0) {
-						int parry = ((dmg + enemy.getStrength()) / enemy.getDefense());
-						parry = max(1, parry);
-						int pHP = max(0, player.getCurrentHealth() - parry);
-						player.setCurrentHealth(pHP);
-						log.push_back(L"Enemy parries and deals " + std::to_wstring(parry) + L" damage back. Health: " +
-						              std::to_wstring(pHP) + L"/" + std::to_wstring(player.getMaxHealth()));
-						enemyConsumedDefend = false;
-					}
+// Where key presses come from. The console source reads the keyboard; replays (and tools) feed keys without a human.
+class KeySource {
+public:
+	virtual ~KeySource() {}
 
-					break; // end player's turn
-				}
-				if (ch == '2') {
-					// Defend
-					playerDefendReady = true;
-					log.push_back(L"You defend. Next damage taken reduced by " +
-					              std::to_wstring(player.getDefense()) + L".");
-					break; // defending consumes the turn
-				}
-				if (ch == '3') {
-					// Item (healing potion)
-					if (player.usePotion()) {
-						log.push_back(L"You used a Healing Potion. Health: " +
-						              std::to_wstring(player.getCurrentHealth()) + L"/" +
-						              std::to_wstring(player.getMaxHealth()) + L" (Potions left: " +
-						              std::to_wstring(player.getPotions()) + L")");
-						break; // using item consumes the turn
-					} else {
-						log.push_back(L"No usable potion (none owned or already at full health).");
-						// keep waiting on the same turn for a valid action
-					}
-				}
-				if (ch == '4') {
-					// Run: 40% chance to escape; on success, move back to previous position
-					log.push_back(L"You try to run...");
-					if ((rand() % 100) < 40) {
-						log.push_back(L"You successfully ran away!");
-						// Render outcome and wait for dismiss before leaving combat
-						render(log, false, player);
-						for (;;) {
-							int k = _getch();
-							if (k == 27 || k == 13 || k == ' ') break;
-						}
-						while (_kbhit()) { (void)_getch(); }
-						system("cls");
-
-						// Move player back to previous position
-						player.setPosition(prevPlayerX, prevPlayerY);
-						return true; // escaped
-					} else {
-						log.push_back(L"Failed to run!");
-						// Running attempt consumes the turn; enemy acts next
-						break;
-					}
-				}
-				// ignore other keys
-			}
-			playerTurn = false;
-		}
+	// Non-blocking poll used by the main loop; returns false when no key is waiting.
+	virtual bool poll(KeyContext ctx, int& ch) = 0;
 
-		// Outcome screen
-		if (enemy.isDead()) {
-			log.push_back(L"Enemy defeated!");
-			log.push_back(L"You gained some gold!");
-		} 
-		if (player.isDead()) {
-			log.push_back(L"You were defeated!");
-		}
+	// Blocking read used by the combat, levelling and modal screens.
+	virtual int read(KeyContext ctx) = 0;
 
-		render(log, false, player);
+	// Discard buffered keystrokes so they don't leak into the next screen.
+	virtual void drain() {}
+};
+
+class ConsoleKeys : public KeySource {
+public:
+	bool poll(KeyContext, int& ch) override {
+		Terminal::instance().watchResize();
+		if (!_kbhit()) return false;
+		ch = _getch();
+		return true;
+	}
+	// Waits on the input queue instead of inside _getch, which would swallow the resize events the screens rely on
+	int read(KeyContext) override {
+		Terminal& terminal = Terminal::instance();
 		for (;;) {
-			int ch = _getch();
-			if (ch == 27 || ch == 13 || ch == ' ') break;
+			DWORD seen = terminal.watchResize();
+			if (_kbhit()) return _getch();
+			terminal.waitForInput(seen);
 		}
-		while (_kbhit()) { (void)_getch(); }
-
-		// Clear the combat UI so the game frame doesn't overlap with leftover lines
-		system("cls");
-		return false; // did not escape
 	}
+	void drain() override { while (_kbhit()) { (void)_getch(); } }
 };
 
+// Compact session recording: the RNG seed plus every key the game consumed, stamped with the game tick and wall time.
+// File layout (little-endian): "C3RP", u32 version, u64 seed, u32 count, then count x {u32 tick, u32 ms, u8 key, u8 context}.
+class ReplayLog {
+	static const uint32_t VERSION = 1;
+	static const size_t EVENT_BYTES = 10;
 
-// Levelling system: upgrade screen + per-stat cost escalation + enemy difficulty wrapper
-class Levelling {
-	int upHealth = 0;
-	int upDefense = 0;
-	int upStrength = 0;
+public:
+	struct Event {
+		uint32_t tick;   // main loop iteration the key was consumed on
+		uint32_t ms;     // milliseconds since the session started
+		uint8_t key;
+		uint8_t context; // KeyContext
+	};
+
+	uint64_t seed = 0;
+	vector<Event> events;
+
+	bool save(const string& path) const {
+		vector<char> buf;
+		buf.reserve(20 + events.size() * EVENT_BYTES);
+		auto put = [&](const void* p, size_t n) {
+			const char* c = static_cast<const char*>(p);
+			buf.insert(buf.end(), c, c + n);
+		};
+		uint32_t version = VERSION;
+		uint32_t count = static_cast<uint32_t>(events.size());
+		put("C3RP", 4);
+		put(&version, 4);
+		put(&seed, 8);
+		put(&count, 4);
+		for (const Event& e : events) {
+			put(&e.tick, 4);
+			put(&e.ms, 4);
+			put(&e.key, 1);
+			put(&e.context, 1);
+		}
 
-	// NEW: track per-session purchases to bias enemy upgrades
-	int boughtHealthThis = 0;
-	int boughtDefenseThis = 0;
-	int boughtStrengthThis = 0;
+		ofstream out(path, ios::binary | ios::trunc);
+		if (!out) return false;
+		out.write(buf.data(), static_cast<streamsize>(buf.size())); // single buffered write
+		return static_cast<bool>(out);
+	}
+
+	bool load(const string& path) {
+		ifstream in(path, ios::binary);
+		if (!in) return false;
+		vector<char> buf((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+		if (buf.size() < 20 || string(buf.data(), 4) != "C3RP") return false;
+
+		uint32_t version = 0, count = 0;
+		memcpy(&version, buf.data() + 4, 4);
+		memcpy(&seed, buf.data() + 8, 8);
+		memcpy(&count, buf.data() + 16, 4);
+		if (version != VERSION || buf.size() < 20 + static_cast<size_t>(count) * EVENT_BYTES) return false;
+
+		events.resize(count);
+		const char* p = buf.data() + 20;
+		for (Event& e : events) {
+			memcpy(&e.tick, p, 4);
+			memcpy(&e.ms, p + 4, 4);
+			e.key = static_cast<uint8_t>(p[8]);
+			e.context = static_cast<uint8_t>(p[9]);
+			p += EVENT_BYTES;
+		}
+		return true;
+	}
+};
 
-	static void ClearKeys() {
-		while (_kbhit()) { (void)_getch(); }
+// Plays a recorded log back as fast as the game asks for keys.
+// Ticks without input are no-ops in this game, so keys are handed out in order without waiting for their tick.
+// Once the log runs out every screen gets a key that lets the session finish (Esc/Enter, or Attack in combat).
+class ReplayKeys : public KeySource {
+	const ReplayLog& log;
+	size_t nextEvent = 0;
+	int mismatches = 0;
+
+	int take(KeyContext ctx) {
+		const ReplayLog::Event& e = log.events[nextEvent++];
+		if (e.context != ctx) mismatches++;
+		return e.key;
 	}
 
 public:
-	Levelling() = default;
+	explicit ReplayKeys(const ReplayLog& replayLog) : log(replayLog) {}
 
-	// Wrapper to centralize difficulty increase as requested.
-	template<typename TEnemy>
-	void enemyDifficultyIncrease(TEnemy& enemy) {
-		// Bias weights based on this session's player purchases:
-		// - Player Strength -> Enemy Defense gets +5% per purchase
-		// - Player Defense  -> Enemy Health  gets +5% per purchase
-		// - Player Health   -> Enemy Strength gets +5% per purchase
-		double wH = 1.0 + 0.25 * static_cast<double>(boughtDefenseThis);
-		double wD = 1.0 + 0.25 * static_cast<double>(boughtStrengthThis);
-		double wS = 1.0 + 0.25 * static_cast<double>(boughtHealthThis);
+	bool poll(KeyContext ctx, int& ch) override {
+		ch = finished() ? 27 : take(ctx);
+		return true;
+	}
+	int read(KeyContext ctx) override {
+		if (!finished()) return take(ctx);
+		if (ctx == KEY_BATTLE) return '1';
+		return 13;
+	}
 
-		auto chooseStat = [&](double wh, double wd, double ws) -> int {
-			double sum = wh + wd + ws;
-			if (sum <= 0.0) { return rand() % 3; }
-			double r = (static_cast<double>(rand()) / static_cast<double>(RAND_MAX)) * sum;
-			if (r < wh) return 0; r -= wh;
-			if (r < wd) return 1;
-			return 2;
-		};
+	bool finished() const { return nextEvent >= log.events.size(); }
+	size_t consumed() const { return nextEvent; }
+	int contextMismatches() const { return mismatches; }
+};
 
-		// Spend 3 points using the biased distribution
-		int dH = 0, dD = 0, dS = 0;
-		for (int i = 0; i < 3; ++i) {
-			switch (chooseStat(wH, wD, wS)) {
-				case 0: ++dH; break;
-				case 1: ++dD; break;
-				default: ++dS; break;
-			}
+// Per-session state shared by the game and its modal screens: RNG, key routing, optional recording,
+// and the headless switch used by replays (no console output, no frame delay).
+class Session {
+	KeySource* keys;
+	ReplayLog* recorder;
+	chrono::steady_clock::time_point started;
+
+	void record(KeyContext ctx, int ch) {
+		if (!recorder) return;
+		uint32_t ms = static_cast<uint32_t>(chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started).count());
+		recorder->events.push_back({ tick, ms, static_cast<uint8_t>(ch), static_cast<uint8_t>(ctx) });
+	}
+
+public:
+	Rng rng;
+	bool headless = false;
+	uint32_t tick = 0;
+
+	Session(KeySource& keySource, uint64_t seed, ReplayLog* recordTo = nullptr)
+		: keys(&keySource), recorder(recordTo), started(chrono::steady_clock::now()), rng(seed) {
+		if (recorder) {
+			recorder->seed = seed;
+			recorder->events.clear();
 		}
+	}
 
-		// Apply to enemy and keep "last delta" for messaging
-		enemy.applyUpgrades(dH, dD, dS);
+	bool pollKey(KeyContext ctx, int& ch) {
+		if (!keys->poll(ctx, ch)) return false;
+		record(ctx, ch);
+		return true;
+	}
 
-		// Build a message listing only the stats that actually increased
-		std::wstring msg;
-		if (dH > 0) msg += L"- The enemies are looking healthier! \n";
-		if (dD > 0) msg += L"- The enemies are looking tougher! \n";
-		if (dS > 0) msg += L"- The enemies are looking stronger! \n";
+	int readKey(KeyContext ctx) {
+		int ch = keys->read(ctx);
+		record(ctx, ch);
+		return ch;
+	}
 
-		Combat modal;
-		modal.OpenModal(L"Enemy Difficulty Increased", msg.c_str());
+	void drainKeys() { keys->drain(); }
 
-		// Reset session counts after use (safety; next Open() will reset them too)
-		boughtHealthThis = boughtDefenseThis = boughtStrengthThis = 0;
+	void clearScreen() const {
+		if (!headless) system("cls");
 	}
+};
 
-	// Modal upgrade screen. Appears at the start of each level after gold is awarded.
-	void Open(Player& player, int& gold) {
-		// Reset per-session purchase tracking
-		boughtHealthThis = boughtDefenseThis = boughtStrengthThis = 0;
+class Exit {
+	int ex;
+	int ey;
+public:
+	Exit() : ex(-1), ey(-1) {}
 
-		bool done = false;
-		std::wstring lastMsg;
+	// Place exit explicitly
+	void placeAt(int x, int y) {
+		ex = x; ey = y;
+	}
 
-		auto render = [&](int cols, int /*rows*/) {
-			auto border = std::wstring(static_cast<size_t>(cols), L'#');
-			auto printCentered = [&](const std::wstring& s) {
-				int pad = max(0, (cols - static_cast<int>(s.size())) / 2);
-				std::wcout << std::wstring(static_cast<size_t>(pad), L' ') << s << L"\n";
-			};
+	// Place exit on any passable floor ('.'), optionally avoiding player's current position.
+	// Picks uniformly among floor tiles in row-major order, counting them a word at a time instead of listing them.
+	void placeRandomOnFloor(const TileGrid& grid, Rng& rng, int avoidX = -1, int avoidY = -1) {
+		int floors = 0;
+		for (int y = 0; y < grid.height(); ++y) floors += grid.countFloor(y, 0, grid.width() - 1);
+		bool skipAvoid = grid.inBounds(avoidX, avoidY) && grid.isFloor(avoidX, avoidY);
+		int candidates = floors - (skipAvoid ? 1 : 0);
+		if (candidates > 0) {
+			int pick = rng.below(candidates);
+			grid.nthFloor(pick, ex, ey);
+			if (skipAvoid && (ey > avoidY || (ey == avoidY && ex >= avoidX))) grid.nthFloor(pick + 1, ex, ey);
+		}
+		else {
+			ex = -1;
+			ey = -1;
+		}
+	}
 
-			std::wcout << border << L"\n";
-			printCentered(L"Leveling");
-			std::wcout << L"\n";
+	bool isAt(int x, int y) const { return x == ex && y == ey; }
+	int x() const { return ex; }
+	int y() const { return ey; }
+};
 
-			// Current gold
-			printCentered(L"Gold: " + std::to_wstring(gold));
-			std::wcout << L"\n";
+class Box {
+	int boxX;
+	int boxY;
+	int boxWidth;
+	int boxHeight;
+public:
+	Box(int boxWidths = 12, int boxHeights = 4)
+		: boxX(0), boxY(0), boxWidth(boxWidths), boxHeight(boxHeights) {
+	}
 
-			// Current stats
-			printCentered(L"Current Stats:");
-			printCentered(L"- Current Health: " + std::to_wstring(player.getCurrentHealth()) + L"/" + std::to_wstring(player.getMaxHealth()));
-			printCentered(L"- Defense:    " + std::to_wstring(player.getDefense()));
-			printCentered(L"- Strength:   " + std::to_wstring(player.getStrength()));
-			printCentered(L"- Potions:    " + std::to_wstring(player.getPotions()));
-			std::wcout << L"\n";
+	void placeAt(int x, int y) {
+		boxX = x;
+		boxY = y;
+	}
 
-			// Costs: cost = 1 + number of prior upgrades for that stat
-			int cH = 1 + upHealth;
-			int cD = 1 + upDefense;
-			int cS = 1 + upStrength;
+	void placeRandom(int areaWidth, int areaHeight, Rng& rng) {
+		int minBoxX = 2;
+		int maxBoxX = areaWidth - boxWidth - 2;
+		int minBoxY = 1;
+		int maxBoxY = areaHeight - boxHeight - 1;
 
-			printCentered(L"[1] +2 Max Health  (Cost: " + std::to_wstring(cH) + L")");
-			printCentered(L"[2] +1 Defense     (Cost: " + std::to_wstring(cD) + L")");
-			printCentered(L"[3] +1 Strength    (Cost: " + std::to_wstring(cS) + L")");
-			printCentered(L"[4] Healing Potion (Cost: 2)");
-			std::wcout << L"\n";
+		if (maxBoxX < minBoxX) {
+			boxX = (areaWidth - boxWidth) / 2;
+		}
+		else {
+			boxX = minBoxX + rng.below(maxBoxX - minBoxX + 1);
+		}
 
-			if (!lastMsg.empty()) {
-				printCentered(lastMsg);
-				std::wcout << L"\n";
-			}
+		if (maxBoxY < minBoxY) {
+			boxY = (areaHeight - boxHeight) / 2;
+		}
+		else {
+			boxY = minBoxY + rng.below(maxBoxY - minBoxY + 1);
+		}
+	}
 
-			printCentered(L"[Enter]/[Esc]/[Space] to start the next level");
-			std::wcout << border << L"\n";
-			std::wcout.flush();
-		};
+	int x() const {
+		return boxX;
+	}
+	int y() const {
+		return boxY;
+	}
+	int width() const {
+		return boxWidth;
+	}
+	int height() const {
+		return boxHeight;
+	}
 
-		while (!done) {
-			// Clear
-			system("cls");
+	bool contains(int playerX, int playerY) const {
+		return playerX >= boxX && playerX < boxX + boxWidth && playerY >= boxY && playerY < boxY + boxHeight;
+	}
+
+	bool interiorContains(int playerX, int playerY) const {
+		return playerX > boxX && playerX < boxX + boxWidth - 1 && playerY > boxY && playerY < boxY + boxHeight - 1;
+	}
 
-			// Console size
-			HANDLE hOut = GetStdHandle(STD_OUTPUT_HANDLE);
-			CONSOLE_SCREEN_BUFFER_INFO csbi{};
-			int cols = 80, rows = 25;
-			if (GetConsoleScreenBufferInfo(hOut, &csbi)) {
-				cols = csbi.srWindow.Right - csbi.srWindow.Left + 1;
-				rows = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
+	void drawBox(TileGrid& grid) const {
+		for (int i = 0; i < boxHeight; ++i) {
+			for (int j = 0; j < boxWidth; ++j) {
+				int gridY = boxY + i;
+				int gridX = boxX + j;
+				if (!grid.inBounds(gridX, gridY))
+					continue;
+				if (i == 0 || i == boxHeight - 1 || j == 0 || j == boxWidth - 1) {
+					grid.setKind(gridX, gridY, KIND_BOX_WALL);
+				}
+				else {
+					grid.setKind(gridX, gridY, KIND_FLOOR);
+				}
 			}
+		}
+		grid.markInterior(boxX + 1, boxY + 1, boxX + boxWidth - 2, boxY + boxHeight - 2);
+	}
 
-			render(cols, rows);
+	bool intersects(const Box& otherBox, int gap = 1) const {
+		int firstBoxLeftX = boxX - gap;
+		int firstBoxLeftY = boxY - gap;
+		int firstBoxRightX = boxX + boxWidth + gap;
+		int firstBoxRightY = boxY + boxHeight + gap;
 
-			// Input
-			int ch = _getch();
-			if (ch == 27 || ch == 13 || ch == ' ') {
-				done = true;
-				break;
-			}
+		int secondBoxLeftX = otherBox.boxX - gap;
+		int secondBoxLeftY = otherBox.boxY - gap;
+		int secondBoxRightX = otherBox.boxX + otherBox.boxWidth + gap - 1;
+		int secondBoxRightY = otherBox.boxY + otherBox.boxHeight + gap - 1;
 
-			// Compute costs each time
-		 int cH = 1 + upHealth;
-		 int cD = 1 + upDefense;
-		 int cS = 1 + upStrength;
-
-		 bool purchased = false;
-		 switch (ch) {
-			 case '1':
-				 if (gold >= cH) {
-					 gold -= cH;
-					 upHealth += 1;
-					 boughtHealthThis += 1; // track this session
-					 player.setMaxHealth(player.getMaxHealth() + 2);
-					 player.setCurrentHealth(player.getCurrentHealth() + 2);
-					 lastMsg = L"Purchased +2 Max Health.";
-					 purchased = true;
-				 } else lastMsg = L"Not enough gold for +2 Max Health.";
-				 break;
-			 case '2':
-				 if (gold >= cD) {
-					 gold -= cD;
-					 upDefense++;
-					 boughtDefenseThis += 1; // track this session
-					 player.setDefense(player.getDefense() + 1);
-					 lastMsg = L"Purchased +1 Defense.";
-					 purchased = true;
-				 } else lastMsg = L"Not enough gold for +1 Defense.";
-				 break;
-			 case '3':
-				 if (gold >= cS) {
-					 gold -= cS;
-					 upStrength++;
-					 boughtStrengthThis += 1; // track this session
-					 player.setStrength(player.getStrength() + 1);
-					 lastMsg = L"Purchased +1 Strength.";
-					 purchased = true;
-				 } else lastMsg = L"Not enough gold for +1 Strength.";
-				 break;
-			 case '4':
-				 if (gold >= 2) {
-					 gold -= 2;
-					 player.addPotions(1);
-					 lastMsg = L"You gained a health potion!";
-					 purchased = true;
-				 }
-				 else {
-					 lastMsg = L"Not enough gold for Healing Potion.";
-				 }
-				 break;
-			 default:
-				 lastMsg = L"Press [1]-[4] to buy, or [Enter]/[Esc]/[Space] to start.";
-				 break;
-		 }
-
-		 if (purchased) {
-			 // brief feedback can be provided by immediate re-render; loop continues
-		 }
-		 ClearKeys();
-		}
-
-		ClearKeys();
+		bool xOverlap = firstBoxLeftX <= secondBoxRightX && firstBoxRightX >= secondBoxLeftX;
+		bool yOverlap = firstBoxLeftY <= secondBoxRightY && firstBoxRightY >= secondBoxLeftY;
+		return xOverlap && yOverlap;
 	}
-};
-
-// NEW: Gold class to place 'G' at centers of boxes with exactly one corridor
-class Gold {
-	vector<pair<int,int>> positions;
 
-	static int countCorridorOpenings(const Box& b, const vector<vector<char>>& grid) {
-		int x0 = b.x();
-		int y0 = b.y();
-		int x1 = x0 + b.width() - 1;
-		int y1 = y0 + b.height() - 1;
-		int count = 0;
+	// Up to three wall tiles facing (x, y), sorted and without repeats
+	FixedVector<pair<int, int>, 3> closestEdge(int x, int y) const {
+		FixedVector<pair<int, int>, 3> edges;
+		int centerX = boxX + boxWidth / 2;
+		int centerY = boxY + boxHeight / 2;
+		int determineX = x - centerX;
+		int determineY = y - centerY;
 
-		// Top and bottom edges
-		for (int x = x0; x <= x1; ++x) {
-			if (y0 >= 0 && y0 < (int)grid.size() && x >= 0 && x < (int)grid[0].size()) {
-				if (grid[y0][x] == TILE_FLOOR) count++;
-			}
-			if (y1 >= 0 && y1 < (int)grid.size() && x >= 0 && x < (int)grid[0].size()) {
-				if (grid[y1][x] == TILE_FLOOR) count++;
+		if (abs(determineX) >= abs(determineY)) {
+			int edgeX = (determineX > 0) ? (boxX + boxWidth - 1) : boxX;
+			int midY = centerY;
+			int minY = boxY + 1;
+			int maxY = boxY + boxHeight - 2;
+			for (int determiner = -1; determiner <= 1; ++determiner) {
+				int edgeY = midY + determiner;
+				if (edgeY < minY) {
+					edgeY = minY;
+				}
+				if (edgeY > maxY) {
+					edgeY = maxY;
+				}
+				edges.emplace_back(edgeX, edgeY);
 			}
 		}
-		// Left and right edges (exclude corners to avoid double counting)
-		for (int y = y0 + 1; y <= y1 - 1; ++y) {
-			if (y >= 0 && y < (int)grid.size()) {
-				if (x0 >= 0 && x0 < (int)grid[0].size()) {
-					if (grid[y][x0] == TILE_FLOOR) count++;
+		else {
+			int edgeY = (determineY > 0) ? (boxY + boxHeight - 1) : boxY;
+			int midX = centerX;
+			int minX = boxX + 1;
+			int maxX = boxX + boxWidth - 2;
+			for (int determiner = -1; determiner <= 1; ++determiner) {
+				int edgeX = midX + determiner;
+				if (edgeX < minX) {
+				edgeX = minX;
 				}
-				if (x1 >= 0 && x1 < (int)grid[0].size()) {
-					if (grid[y][x1] == TILE_FLOOR) count++;
+				if (edgeX > maxX) {
+				edgeX = maxX;
 				}
+				edges.emplace_back(edgeX, edgeY);
 			}
 		}
-		return count;
+
+		// Clamping keeps the tiles in order, so only repeats need dropping
+		edges.resize(static_cast<size_t>(unique(edges.begin(), edges.end()) - edges.begin()));
+		return edges;
 	}
+};
 
-public:
-	void clear() { positions.clear(); }
+class Enemy {
+	int ax;
+	int ay;
 
-	// Place 'G' at centers of boxes that have exactly one corridor opening.
-	// Avoid placing on the player's current tile or the exit tile.
-	void placeForDeadEnds(const vector<Box>& boxes,
-	                      const vector<vector<char>>& grid,
-	                      const Exit& exitTile,
-	                      int avoidX, int avoidY)
-	{
-		positions.clear();
-		int h = static_cast<int>(grid.size());
-		int w = h ? static_cast<int>(grid[0].size()) : 0;
+	// Stats
+	int maxHealth;
+	int currentHealth;
+	int defense;
+	int strength;
 
-		for (const auto& b : boxes) {
-			int openings = countCorridorOpenings(b, grid);
-			if (openings == 1) {
-				int cx = b.x() + b.width() / 2;
-				int cy = b.y() + b.height() / 2;
-				if (cx < 0 || cy < 0 || cx >= w || cy >= h) continue;
-				if (grid[cy][cx] != TILE_FLOOR) continue; // center should be floor
-				if (exitTile.isAt(cx, cy)) continue;
-				if (cx == avoidX && cy == avoidY) continue;
-				positions.emplace_back(cx, cy);
-			}
-		}
-	}
+	// Track last upgrade deltas to display messages after scaling
+	int lastUpHealth;
+	int lastUpDefense;
+	int lastUpStrength;
 
-	bool isAt(int x, int y) const {
-		for (const auto& p : positions) {
-			if (p.first == x && p.second == y) return true;
-		}
-		return false;
+public:
+	// Default health to 10 an other stats to 5; health starts full
+	Enemy(int h = 10, int d = 5, int s = 5)
+		: ax(-1), ay(-1),
+		  maxHealth(h), currentHealth(h), defense(d), strength(s),
+		  lastUpHealth(0), lastUpDefense(0), lastUpStrength(0) {
 	}
 
-	// NEW: Try to pick up gold at a position. Returns true if there was gold and it was removed.
-	bool tryPickup(int x, int y) {
-		for (size_t i = 0; i < positions.size(); ++i) {
-			if (positions[i].first == x && positions[i].second == y) {
-				positions.erase(positions.begin() + static_cast<long long>(i));
-				return true;
-			}
-		}
-		return false;
-	}
-};
+	void reset() { ax = -1; ay = -1; }
 
-class Game {
-	bool gameOver;
-	int width;
-	int height;
-	int boxNumber;
-	int playerX, playerY;
-	Direction dir;
-	vector<Box> boxes;
-	vector<vector<char>> grid;
+	void placeAt(int x, int y) { ax = x; ay = y; }
 
-	const int minBoxWidth = 7;
-	const int maxBoxWidth = 12;
-	const int minBoxHeight = 5;
-	const int maxBoxHeight = 8;
+	// Accessors - position
+	int x() const { return ax; }
+	int y() const { return ay; }
+	bool isPlaced() const { return ax >= 0 && ay >= 0; }
 
-	// corridor parameters
-	const int gapFromBox = 1;      // buffer between box wall and corridor boundary (kept moderate)
+	// Accessors - stats
+	int getMaxHealth() const { return maxHealth; }
+	int getCurrentHealth() const { return currentHealth; }
+	int getDefense() const { return defense; }
+	int getStrength() const { return strength; }
 
-	Exit exitTile;
+	// Optional setters
+	void setMaxHealth(int mh) {
+		maxHealth = max(0, mh);
+		currentHealth = min(currentHealth, maxHealth);
+	}
+	void setCurrentHealth(int ch) { currentHealth = max(0, min(ch, maxHealth)); }
+	void setDefense(int d) { defense = d; }
+	void setStrength(int s) { strength = s; }
 
-	// CHANGED: multiple enemies
-	vector<Enemy> enemies;
+	// Healing helpers
+	void heal(int amount) { setCurrentHealth(currentHealth + max(0, amount)); }
+	void healToFull() { currentHealth = maxHealth; }
 
-	// Gold placer
-	Gold goldItems;
+	// Apply damage reduced by defense; returns damage actually taken
+	int applyDamage(int rawDamage) {
+		int dmg = max(0, rawDamage - defense);
+		currentHealth = max(0, currentHealth - dmg);
+		return dmg;
+	}
+	bool isDead() const { return currentHealth <= 0; }
 
-	// Leveling
-	int level;
-	int gold;
+	// Move one step toward target (tx,ty) on floor; optionally avoid landing on a forbidden tile (e.g., player's current).
+	void stepToward(int tx, int ty, const TileGrid& grid, int forbidX = -1, int forbidY = -1) {
+		if (!isPlaced()) return;
+		greedyStep(ax, ay, tx, ty, grid, forbidX, forbidY);
+	}
 
-	Player player; //player stats
-	Enemy enemy; //enemy stats (baseline scaled across levels)
-	Levelling levelling; // NEW: levelling system
+	// Greedy axis step shared with EnemyStore: try the longer axis first, then the other one.
+	static void greedyStep(int& ax, int& ay, int tx, int ty, const TileGrid& grid, int forbidX = -1, int forbidY = -1) {
+		auto canMove = [&](int nx, int ny) -> bool {
+			return grid.inBounds(nx, ny) && grid.isFloor(nx, ny);
+			};
 
-	static const int MAX_WIDTH = 109;
-	static const int MAX_HEIGHT = 25;
-	static const int MAX_BOXES = 14;
+		int dx = tx - ax;
+		int dy = ty - ay;
+		int stepx = (dx == 0) ? 0 : (dx > 0 ? 1 : -1);
+		int stepy = (dy == 0) ? 0 : (dy > 0 ? 1 : -1);
 
-	vector<vector<bool>> revealedAreas;
+		auto tryMove = [&](int nx, int ny) -> bool {
+			if (!canMove(nx, ny)) return false;
+			if (forbidX >= 0 && forbidY >= 0 && nx == forbidX && ny == forbidY) return false;
+			ax = nx; ay = ny;
+			return true;
+			};
 
-public:
-	Game(int width = 59, int height = 15, int boxNumber = 4)
-		: gameOver(false), width(width), height(height), boxNumber(boxNumber), playerX(0), playerY(0), dir(STOP), level(1), gold(0) {
-		grid.assign(height, vector<char>(width, ' '));
+		if (abs(dx) >= abs(dy)) {
+			if (stepx != 0 && tryMove(ax + stepx, ay)) return;
+			if (stepy != 0) tryMove(ax, ay + stepy);
+		}
+		else {
+			if (stepy != 0 && tryMove(ax, ay + stepy)) return;
+			if (stepx != 0) tryMove(ax + stepx, ay);
+		}
 	}
 
-	void clearGrid() {
-		// Ensure grid matches current width/height (handles dynamic resize between levels).
-		if (static_cast<int>(grid.size()) != height || (height > 0 && static_cast<int>(grid[0].size()) != width)) {
-			grid.assign(height, vector<char>(width, ' '));
-			return;
+	// Place at the center of a random box that does NOT contain the player and is NOT the exit box (exit is centered).
+	void placeInRandomBoxCenter(const pmr::vector<Box>& boxes, int playerX, int playerY, const Exit& exitTile, const TileGrid& grid, Rng& rng)
+	{
+		vector<int> candidates;
+		int h = grid.height();
+		int w = grid.width();
+
+		for (size_t i = 0; i < boxes.size(); ++i) {
+			const Box& b = boxes[i];
+			int cx = b.x() + b.width() / 2;
+			int cy = b.y() + b.height() / 2;
+
+			// inside bounds and on a floor tile
+			if (cx < 0 || cy < 0 || cx >= w || cy >= h) continue;
+			if (grid[cy][cx] != TILE_FLOOR) continue;
+
+			// exclude any box containing the player
+			if (b.contains(playerX, playerY)) continue;
+
+			// exclude the exit box (exit is always placed at a box center)
+			if (exitTile.isAt(cx, cy)) continue;
+
+			candidates.push_back(static_cast<int>(i));
+		}
+
+		if (!candidates.empty()) {
+			int idx = candidates[static_cast<size_t>(rng.below(static_cast<int>(candidates.size())))];
+			const Box& b = boxes[static_cast<size_t>(idx)];
+			ax = b.x() + b.width() / 2;
+			ay = b.y() + b.height() / 2;
+		}
+		else {
+			reset();
 		}
-		for (int i = 0; i < height; i++)
-			for (int j = 0; j < width; j++)
-				grid[i][j] = ' ';
 	}
 
-	int boxIndexForInterior(int x, int y) const {
-		for (size_t i = 0; i < boxes.size(); ++i) {
-			if (boxes[i].interiorContains(x, y)) {
-				return static_cast<int>(i);
+	bool isAt(int x, int y) const { return x == ax && y == ay; }
+
+	// Expose last per-stat deltas applied during the most recent difficulty increase
+	void getLastUpgradeDelta(int& h, int& d, int& s) const {
+		h = lastUpHealth;
+		d = lastUpDefense;
+		s = lastUpStrength;
+	}
+
+	// New behavior: spend 3 upgrade points across MaxHealth/Defense/Strength in any combination.
+	void enemyDifficultyIncrease(Rng& rng) {
+		// reset last-deltas
+		lastUpHealth = lastUpDefense = lastUpStrength = 0;
+
+		int points = 3;
+		while (points-- > 0) {
+			switch (rng.below(3)) {
+				case 0: lastUpHealth++;   break;
+				case 1: lastUpDefense++;  break;
+				default:lastUpStrength++; break;
 			}
 		}
-		return -1;
+
+		// apply upgrades
+		maxHealth += lastUpHealth;
+		defense   += lastUpDefense;
+		strength  += lastUpStrength;
+
+		// keep health full after scaling
+		currentHealth = maxHealth;
 	}
 
-	void revealBox(const Box& box) {
-		int startX = box.x(), startY = box.y();
-		int enxX = startX + box.width() - 1, endY = startY + box.height() - 1;
-		for (int y = max(0, startY); y <= min(height - 1, endY); ++y) {
-			for (int x = max(0, startX); x <= min(width - 1, enxX); ++x) {
-				revealedAreas[y][x] = true;
-			}
+	// NEW: Apply explicit upgrades (used by Levelling to apply biased point distribution)
+	void applyUpgrades(int upH, int upD, int upS) {
+		lastUpHealth  = upH;
+		lastUpDefense = upD;
+		lastUpStrength= upS;
+		maxHealth += upH;
+		defense   += upD;
+		strength  += upS;
+		currentHealth = maxHealth;
+	}
+};
+
+// A set of map cells that empties in constant time: a cell is in it while its stamp matches the current generation,
+// so clear() only moves to the next generation (the stamps are wiped when the counter wraps).
+class MarkGrid {
+	uint32_t generation = 0;
+	vector<uint32_t> stamp;
+
+public:
+	void clear(size_t cells) {
+		if (stamp.size() < cells) stamp.resize(cells, 0);
+		if (++generation == 0) {
+			fill(stamp.begin(), stamp.end(), 0u);
+			generation = 1;
 		}
 	}
+	void mark(size_t cell) { stamp[cell] = generation; }
+	bool marked(size_t cell) const { return stamp[cell] == generation; }
+};
+
+// Breadth-first distance field from the player, rebuilt once per player move and shared by every chasing enemy.
+// Each reached floor tile stores the direction of its next step toward the player, so an enemy's move is one lookup
+// no matter how many enemies there are. The caller's filter limits the search (e.g. to the player's room and nearby
+// corridors) so the build cost doesn't grow with the map either.
+class FlowField {
+	int width = 0;
+	int height = 0;
+	uint32_t generation = 0;
+	vector<uint32_t> stamp;   // generation a cell was last reached in (saves clearing the arrays every build)
+	vector<int> dist;
+	vector<uint8_t> toward;   // Direction to step from this cell to get closer to the player
+	vector<int> frontier;
+
+public:
+	// allowed(x, y, dist) decides whether a floor tile at the given BFS distance may join the field.
+	template<typename Allowed>
+	void build(int px, int py, const TileGrid& grid, Allowed allowed) {
+		height = grid.height();
+		width = grid.width();
+		size_t cells = static_cast<size_t>(width) * static_cast<size_t>(height);
+		if (stamp.size() != cells) {
+			stamp.assign(cells, 0);
+			dist.assign(cells, 0);
+			toward.assign(cells, STOP);
+			generation = 0;
+		}
+		if (++generation == 0) {
+			fill(stamp.begin(), stamp.end(), 0u);
+			generation = 1;
+		}
+
+		frontier.clear();
+		if (px < 0 || py < 0 || px >= width || py >= height) return;
 
-	void revealCorridorTile(int x, int y) {
-		if (x < 0 || x >= width || y < 0 || y >= height) return;
-		revealedAreas[y][x] = true;
+		int origin = py * width + px;
+		stamp[origin] = generation;
+		dist[origin] = 0;
+		toward[origin] = STOP;
+		frontier.push_back(origin);
 
+		// Neighbour offsets and the direction that leads back from the neighbour to the current cell
 		static const int dx[4] = { -1, 1, 0, 0 };
 		static const int dy[4] = { 0, 0, -1, 1 };
-		for (int k = 0; k < 4; ++k) {
-			int nx = x + dx[k];
-			int ny = y + dy[k];
-			if (nx < 0 || nx >= width || ny < 0 || ny >= height) continue;
-			char c = grid[ny][nx];
-			if (c == TILE_CORRIDOR_WALL || c == TILE_BOX_WALL) {
-				revealedAreas[ny][nx] = true;
-			}
-			else if (c == TILE_FLOOR) {
-				if (boxIndexForInterior(nx, ny) < 0) {
-					revealedAreas[ny][nx] = true;
-				}
+		static const uint8_t back[4] = { RIGHT, LEFT, DOWN, UP };
+
+		for (size_t head = 0; head < frontier.size(); ++head) {
+			int cur = frontier[head];
+			int cx = cur % width;
+			int cy = cur / width;
+			int nd = dist[cur] + 1;
+			for (int k = 0; k < 4; ++k) {
+				int nx = cx + dx[k];
+				int ny = cy + dy[k];
+				if (nx < 0 || ny < 0 || nx >= width || ny >= height) continue;
+				int n = ny * width + nx;
+				if (stamp[n] == generation) continue;
+				if (!grid.isFloor(nx, ny) || !allowed(nx, ny, nd)) continue;
+				stamp[n] = generation;
+				dist[n] = nd;
+				toward[n] = back[k];
+				frontier.push_back(n);
 			}
 		}
 	}
 
-	void revealCurrentSection() {
-		int px = player.getX();
-		int py = player.getY();
-		if (px < 0 || px >= width || py < 0 || py >= height) return;
-		int boxIndex = boxIndexForInterior(px, py);
-		if (boxIndex >= 0) {
-			revealBox(boxes[static_cast<size_t>(boxIndex)]);
-		} else if (grid[py][px] == TILE_FLOOR) {
-			revealCorridorTile(px, py);
+	bool reached(int x, int y) const {
+		if (x < 0 || y < 0 || x >= width || y >= height) return false;
+		return stamp[static_cast<size_t>(y * width + x)] == generation;
+	}
+
+	// Next tile on a shortest path to the player; false if (x,y) is outside the field or is the player's tile.
+	bool nextStep(int x, int y, int& nx, int& ny) const {
+		if (!reached(x, y)) return false;
+		nx = x;
+		ny = y;
+		switch (toward[static_cast<size_t>(y * width + x)]) {
+			case LEFT:  nx--; return true;
+			case RIGHT: nx++; return true;
+			case UP:    ny--; return true;
+			case DOWN:  ny++; return true;
+			default:    return false;
 		}
 	}
+};
 
-	pair<int,int> outsideCenterFromWall(const Box& b, pair<int,int> wall, pair<int,int> target) const {
-		int wx = wall.first;
-		int wy = wall.second;
+// Who acts when. Actors (enemies today, hazards later) register the game time of their next action; each player
+// move advances the clock by one TURN and only actors that are due get processed, so sleeping actors cost nothing.
+// The player is driven by input and isn't queued. Entries left behind by rescheduling, sleep or death are skipped
+// when they reach the top of the heap.
+class TurnScheduler {
+public:
+	static const int TURN = 100;            // game time of one player move; an actor with delay 50 acts twice per move
+	static const long long NOT_SCHEDULED = -1;
+
+private:
+	struct Entry {
+		long long at;
+		int id;
+	};
+	struct Later {
+		bool operator()(const Entry& a, const Entry& b) const { return a.at != b.at ? a.at > b.at : a.id > b.id; }
+	};
+	vector<Entry> heap; // binary heap under Later (a plain vector so snapshots can copy it)
+	vector<long long> due; // per actor id: time of its live heap entry, or NOT_SCHEDULED
+	long long clock = 0;
 
-		// allow immediate bends by not tying offset to corridor width
-		int maxOffset = gapFromBox;
+public:
+	void clear() {
+		heap.clear();
+		due.clear();
+		clock = 0;
+	}
 
-		// adaptive offset: don't place the corridor center farther than halfway
-		// along the Manhattan route from this wall to the target center.
-		int manhattanToTarget = abs(wx - target.first) + abs(wy - target.second);
-		int halfDist = max(1, manhattanToTarget / 2);
+	void save(SaveWriter& out) const {
+		out.putVec(heap);
+		out.putVec(due);
+		out.put(clock);
+	}
 
-		int offset = min(maxOffset, halfDist);
+	bool load(SaveReader& in) {
+		if (!in.getVec(heap) || !in.getVec(due) || !in.get(clock) || clock < 0 || !is_heap(heap.begin(), heap.end(), Later())) return false;
+		// Between moves every entry is still to come; one behind the clock would make runDue replay the whole gap
+		for (const Entry& e : heap) {
+			if (e.id < 0 || e.id >= static_cast<int>(due.size()) || e.at <= clock) return false;
+		}
+		return true;
+	}
 
-		if (wx == b.x()) return make_pair(wx - offset, wy);
-		if (wx == b.x() + b.width() - 1) return make_pair(wx + offset, wy);
-		if (wy == b.y()) return make_pair(wx, wy - offset);
-		return make_pair(wx, wy + offset);
+	long long now() const { return clock; }
+	void advance(long long dt) { clock += dt; }
+
+	void schedule(int id, long long at) {
+		if (id >= static_cast<int>(due.size())) due.resize(static_cast<size_t>(id) + 1, static_cast<long long>(NOT_SCHEDULED));
+		due[static_cast<size_t>(id)] = at;
+		heap.push_back({ at, id });
+		push_heap(heap.begin(), heap.end(), Later());
 	}
 
-	void lShapedCorridor(int sx, int sy, int ex, int ey, bool horizontalFirst, vector<pair<int, int>>& outCenters) const {
-		outCenters.clear();
+	void sleep(int id) {
+		if (id < static_cast<int>(due.size())) due[static_cast<size_t>(id)] = NOT_SCHEDULED;
+	}
 
-		// If endpoints coincide, just return the single center
-		if (sx == ex && sy == ey) {
-			outCenters.emplace_back(sx, sy);
-			return;
+	bool asleep(int id) const { return id >= static_cast<int>(due.size()) || due[static_cast<size_t>(id)] == NOT_SCHEDULED; }
+
+	// Run every actor due by now in time order (ties by id). act(id) returns the delay to its next action,
+	// or a negative value to put it to sleep.
+	template <class ActFn>
+	void runDue(ActFn act) {
+		while (!heap.empty() && heap.front().at <= clock) {
+			pop_heap(heap.begin(), heap.end(), Later());
+			Entry e = heap.back();
+			heap.pop_back();
+			if (due[static_cast<size_t>(e.id)] != e.at) continue; // stale
+			int delay = act(e.id);
+			if (delay < 0) due[static_cast<size_t>(e.id)] = NOT_SCHEDULED;
+			else schedule(e.id, e.at + max(1, delay));
 		}
+	}
+};
 
-		// Build a full Manhattan path from start -> end using the requested leg-order.
-		auto buildPath = [&](int ax, int ay, int bx, int by, bool horFirst) {
-			vector<pair<int,int>> path;
-			int x = ax, y = ay;
-			path.emplace_back(x, y);
+// Struct-of-arrays storage for a level's enemies. Positions and health, read on every move, sit in their own
+// contiguous arrays; the stats only needed once a battle starts live in a separate cold array.
+// Removal swaps the last enemy into the freed slot, so indices are only stable until the next removal.
+class EnemyStore {
+public:
+	struct ColdStats {
+		int maxHealth;
+		int defense;
+		int strength;
+		int actDelay; // game time between moves (TurnScheduler::TURN = once per player move)
+	};
+
+private:
+	vector<int> xs;
+	vector<int> ys;
+	vector<int> hps;
+	vector<ColdStats> cold;
+	vector<int> ids;   // stable id per slot, for the scheduler (slots move on swapRemove)
+	vector<int> slots; // id -> slot, -1 once removed
 
-			if (horFirst) {
-				// horizontal then vertical
-				while (x != bx) { x += (bx > x) ? 1 : -1; path.emplace_back(x, y); }
-				while (y != by) { y += (by > y) ? 1 : -1; path.emplace_back(x, y); }
-			} else {
-				// vertical then horizontal
-				while (y != by) { y += (by > y) ? 1 : -1; path.emplace_back(x, y); }
-				while (x != bx) { x += (bx > x) ? 1 : -1; path.emplace_back(x, y); }
-			}
-			return path;
-		};
+public:
+	size_t size() const { return xs.size(); }
+	bool empty() const { return xs.empty(); }
+
+	void clear() {
+		xs.clear();
+		ys.clear();
+		hps.clear();
+		cold.clear();
+		ids.clear();
+		slots.clear();
+	}
 
-		// Create the Manhattan route following the chosen initial direction.
-		vector<pair<int,int>> full = buildPath(sx, sy, ex, ey, horizontalFirst);
+	void reserve(size_t n) {
+		xs.reserve(n);
+		ys.reserve(n);
+		hps.reserve(n);
+		cold.reserve(n);
+		ids.reserve(n);
+		slots.reserve(n);
+	}
 
-		// Pick the midpoint index on that route (integer midpoint).
-		size_t midIdx = full.size() / 2;
+	// Spawn at (x,y) with full health using the given stat block; returns the enemy's stable id
+	int add(int x, int y, const Enemy& stats, int actDelay = TurnScheduler::TURN) {
+		int id = static_cast<int>(slots.size());
+		slots.push_back(static_cast<int>(xs.size()));
+		ids.push_back(id);
+		xs.push_back(x);
+		ys.push_back(y);
+		hps.push_back(stats.getMaxHealth());
+		cold.push_back({ stats.getMaxHealth(), stats.getDefense(), stats.getStrength(), actDelay });
+		return id;
+	}
 
-		// Compose outCenters: start..mid then mid..end (avoid duplicate mid)
-		outCenters.reserve(full.size());
-		for (size_t i = 0; i <= midIdx; ++i) outCenters.push_back(full[i]);
-		for (size_t i = midIdx + 1; i < full.size(); ++i) outCenters.push_back(full[i]);
+	int id(size_t i) const { return ids[i]; }
 
-		// Remove consecutive duplicates just in case
-		vector<pair<int,int>> tmp;
-		tmp.reserve(outCenters.size());
-		for (const auto &p : outCenters) {
-			if (tmp.empty() || tmp.back() != p) tmp.push_back(p);
-		}
-		outCenters.swap(tmp);
+	void save(SaveWriter& out) const {
+		out.putVec(xs);
+		out.putVec(ys);
+		out.putVec(hps);
+		out.putVec(cold);
+		out.putVec(ids);
+		out.putVec(slots);
 	}
 
-	void straightCenters(int sx, int sy, int ex, int ey, vector<pair<int,int>>& outCenters) const {
-		outCenters.clear();
-		if (sy == ey) {
-			if (sx <= ex) for (int x = sx; x <= ex; x++) outCenters.emplace_back(x, sy);
-			else for (int x = sx; x >= ex; --x) outCenters.emplace_back(x, sy);
-		} else if (sx == ex) {
-			if (sy <= ey) for (int y = sy; y <= ey; y++) outCenters.emplace_back(sx, y);
-			else for (int y = sy; y >= ey; --y) outCenters.emplace_back(sx, y);
-		} else {
-			lShapedCorridor(sx, sy, ex, ey, true, outCenters);
+	bool load(SaveReader& in) {
+		if (!in.getVec(xs) || !in.getVec(ys) || !in.getVec(hps) || !in.getVec(cold) || !in.getVec(ids) || !in.getVec(slots)) return false;
+		size_t n = xs.size();
+		if (ys.size() != n || hps.size() != n || cold.size() != n || ids.size() != n) return false;
+		for (size_t i = 0; i < n; ++i) {
+			if (ids[i] < 0 || ids[i] >= static_cast<int>(slots.size()) || slots[static_cast<size_t>(ids[i])] != static_cast<int>(i)) return false;
 		}
+		return true;
 	}
 
-	bool pathFits(const vector<pair<int, int>>& centers,
-	              size_t startBoxIdx, size_t endBoxIdx,
-	              pair<int,int> startWall, pair<int,int> endWall) const
-	{
-		// Helper lambda: return true if cell (nx,ny) is considered "connected" to the start or end box
-		// i.e. either inside that box or directly adjacent (4-neighbor) to the wall cell.
-		auto isConnectedToBoxOrWall = [&](int nx, int ny, size_t boxIdx, pair<int,int> wall)->bool {
-			if (boxIdx < boxes.size() && boxes[boxIdx].contains(nx, ny)) return true;
-			// direct adjacency to the wall cell (4-neighbor)
-			if (abs(nx - wall.first) + abs(ny - wall.second) == 1) return true;
-			return false;
-		};
+	// Current slot of an id, or -1 if that enemy has been removed
+	int indexOf(int id) const { return (id >= 0 && id < static_cast<int>(slots.size())) ? slots[static_cast<size_t>(id)] : -1; }
 
-		for (const auto& c : centers) {
-			int cx = c.first, cy = c.second;
-			for (int dy = -1; dy <= 1; dy++) {
-				for (int dx = -1; dx <= 1; ++dx) {
-					int nx = cx + dx, ny = cy + dy;
-					if (nx < 0 || nx >= width || ny < 0 || ny >= height) return false;
-					char cur = grid[ny][nx];
+	int x(size_t i) const { return xs[i]; }
+	int y(size_t i) const { return ys[i]; }
+	int health(size_t i) const { return hps[i]; }
+	const ColdStats& stats(size_t i) const { return cold[i]; }
 
-					// Allow corridor boundary '+' to be treated like empty space for fitting a new corridor.
-					// This lets two L-legs meet where previously only padding '+' existed between them.
-					if (cur == ' ' || cur == TILE_CORRIDOR_WALL) continue;
+	void moveTo(size_t i, int nx, int ny) {
+		xs[i] = nx;
+		ys[i] = ny;
+	}
 
-					if (make_pair(nx, ny) == startWall) continue;
-					if (make_pair(nx, ny) == endWall) continue;
-					if (startBoxIdx < boxes.size() && boxes[startBoxIdx].contains(nx, ny)) continue;
-					if (endBoxIdx < boxes.size() && boxes[endBoxIdx].contains(nx, ny)) continue;
-					if (cur == TILE_FLOOR) {
-						if (isConnectedToBoxOrWall(nx, ny, startBoxIdx, startWall)) continue;
-						if (isConnectedToBoxOrWall(nx, ny, endBoxIdx, endWall)) continue;
-					}
-					return false;
-				}
-			}
-			if (grid[cy][cx] == TILE_FLOOR) return false;
+	// Index of the first enemy at (x,y), or -1
+	int findAt(int x, int y) const {
+		for (size_t i = 0; i < xs.size(); ++i) {
+			if (xs[i] == x && ys[i] == y) return static_cast<int>(i);
 		}
-		return true;
+		return -1;
 	}
 
-	void writeCentersAsCorridor(const vector<pair<int,int>>& centers) {
-		unordered_set<int> centerSet;
-		centerSet.reserve(centers.size()*2);
-		for (const auto &c : centers) {
-			int cx = c.first, cy = c.second;
-			if (cx >= 0 && cx < width && cy >= 0 && cy < height) {
-				if (grid[cy][cx] != TILE_BOX_WALL) grid[cy][cx] = TILE_FLOOR;
-				centerSet.insert(cy * width + cx);
-			}
-		}
-		for (const auto &c : centers) {
-			int cx = c.first, cy = c.second;
-			for (int dy = -1; dy <= 1; dy++) {
-				for (int dx = -1; dx <= 1; dx++) {
-					if (dx == 0 && dy == 0) continue;
-					int nx = cx + dx, ny = cy + dy;
-					if (nx >= 0 && nx < width && ny >= 0 && ny < height) {
-						int key = ny * width + nx;
-						if (centerSet.find(key) != centerSet.end()) continue;
-						if (grid[ny][nx] == ' ') grid[ny][nx] = TILE_CORRIDOR_WALL;
-					}
-				}
-			}
+	bool anyAt(int x, int y) const {
+		// branch-free so the compiler can vectorize the scan
+		int hit = 0;
+		for (size_t i = 0; i < xs.size(); ++i) {
+			hit |= (xs[i] == x) & (ys[i] == y);
 		}
+		return hit != 0;
 	}
 
-	// fixed: create opening but keep corridor padding by writing side walls when stepping from wall -> center
-	void createOpeningAndConnectWallToCenter(pair<int, int> wall, pair<int, int> center) {
-		int wx = wall.first, wy = wall.second;
-		// open the wall (single-tile opening)
-		if (wx >= 0 && wx < width && wy >= 0 && wy < height) {
-			if (grid[wy][wx] == TILE_BOX_WALL || grid[wy][wx] == ' ' || grid[wy][wx] == TILE_CORRIDOR_WALL) {
-				grid[wy][wx] = TILE_FLOOR;
-			}
+	// Full Enemy record for a battle; write the result back with setHealth afterwards
+	Enemy toEnemy(size_t i) const {
+		Enemy e(cold[i].maxHealth, cold[i].defense, cold[i].strength);
+		e.setCurrentHealth(hps[i]);
+		e.placeAt(xs[i], ys[i]);
+		return e;
+	}
+
+	void setHealth(size_t i, int hp) { hps[i] = max(0, min(hp, cold[i].maxHealth)); }
+
+	// O(1) removal: move the last enemy into slot i
+	void swapRemove(size_t i) {
+		size_t last = xs.size() - 1;
+		slots[static_cast<size_t>(ids[i])] = -1;
+		if (i != last) {
+			xs[i] = xs[last];
+			ys[i] = ys[last];
+			hps[i] = hps[last];
+			cold[i] = cold[last];
+			ids[i] = ids[last];
+			slots[static_cast<size_t>(ids[i])] = static_cast<int>(i);
 		}
+		xs.pop_back();
+		ys.pop_back();
+		hps.pop_back();
+		cold.pop_back();
+		ids.pop_back();
+	}
+};
 
-		// Connect Manhattan-style (no diagonal stepping) from wall -> center.
+// Fog of war: one bit per tile, 64 tiles to a word, so room rectangles are revealed and tested a word at a time.
+class FogMask {
+	int w = 0;
+	int h = 0;
+	int wordsPerRow = 0;
+	vector<uint64_t> bits;
+
+	// Bits x0..x1 (inclusive) of the word that starts at column base
+	static uint64_t spanBits(int base, int x0, int x1) {
+		int lo = max(x0, base) - base;
+		int hi = min(x1, base + 63) - base;
+		return (~0ull >> (63 - hi)) & (~0ull << lo);
+	}
+
+public:
+	FogMask() = default;
+	FogMask(int width, int height) { reset(width, height); }
+
+	void reset(int width, int height) {
+		w = width;
+		h = height;
+		wordsPerRow = (width + 63) / 64;
+		bits.assign(static_cast<size_t>(wordsPerRow) * static_cast<size_t>(max(0, height)), 0);
+	}
+
+	bool test(int x, int y) const {
+		if (x < 0 || y < 0 || x >= w || y >= h) return false;
+		return (bits[static_cast<size_t>(y * wordsPerRow + (x >> 6))] >> (x & 63)) & 1u;
+	}
+
+	void set(int x, int y) {
+		if (x < 0 || y < 0 || x >= w || y >= h) return;
+		bits[static_cast<size_t>(y * wordsPerRow + (x >> 6))] |= 1ull << (x & 63);
+	}
+
+	// Set or test every tile in the rectangle (inclusive, clipped to the map)
+	void setRect(int x0, int y0, int x1, int y1) {
+		x0 = max(0, x0); y0 = max(0, y0); x1 = min(w - 1, x1); y1 = min(h - 1, y1);
+		for (int y = y0; y <= y1; ++y) {
+			for (int k = x0 >> 6; k <= x1 >> 6; ++k) bits[static_cast<size_t>(y * wordsPerRow + k)] |= spanBits(k << 6, x0, x1);
+		}
+	}
+
+	void save(SaveWriter& out) const {
+		out.put(w);
+		out.put(h);
+		out.putVec(bits);
+	}
+
+	// Like TileGrid's loaders: the size must be the one the caller expects before anything is allocated
+	bool load(SaveReader& in, int expectWidth, int expectHeight) {
+		int nw = 0, nh = 0;
+		if (!in.get(nw) || !in.get(nh) || nw != expectWidth || nh != expectHeight) return false;
+		reset(nw, nh);
+		size_t expected = bits.size();
+		return in.getVec(bits) && bits.size() == expected;
+	}
+
+	bool anyInRect(int x0, int y0, int x1, int y1) const {
+		x0 = max(0, x0); y0 = max(0, y0); x1 = min(w - 1, x1); y1 = min(h - 1, y1);
+		for (int y = y0; y <= y1; ++y) {
+			for (int k = x0 >> 6; k <= x1 >> 6; ++k) {
+				if (bits[static_cast<size_t>(y * wordsPerRow + k)] & spanBits(k << 6, x0, x1)) return true;
+			}
+		}
+		return false;
+	}
+};
+
+// Recursive shadowcasting over the eight octants. Floor is transparent; walls and rock block sight but are seen.
+// Every visible tile within the radius gets the grid's fog bit.
+struct FieldOfView {
+	static void compute(int cx, int cy, int radius, TileGrid& grid) {
+		// Octant transforms: (col, row) -> (dx, dy) = (col * xx + row * xy, col * yx + row * yy)
+		static const int xx[8] = { 1, 0, 0, -1, -1, 0, 0, 1 };
+		static const int xy[8] = { 0, 1, -1, 0, 0, -1, 1, 0 };
+		static const int yx[8] = { 0, 1, 1, 0, 0, -1, -1, 0 };
+		static const int yy[8] = { 1, 0, 0, 1, -1, 0, 0, -1 };
+		if (grid.inBounds(cx, cy)) grid.reveal(cx, cy);
+		for (int oct = 0; oct < 8; ++oct) {
+			castLight(cx, cy, 1, 1.0, 0.0, radius, xx[oct], xy[oct], yx[oct], yy[oct], grid);
+		}
+	}
+
+private:
+	static void castLight(int cx, int cy, int row, double start, double end, int radius,
+	                      int xx, int xy, int yx, int yy, TileGrid& grid) {
+		if (start < end) return;
+		double newStart = 0.0;
+		for (int j = row; j <= radius; ++j) {
+			bool blocked = false;
+			for (int dx = -j, dy = -j; dx <= 0; ++dx) {
+				double leftSlope = (dx - 0.5) / (dy + 0.5);
+				double rightSlope = (dx + 0.5) / (dy - 0.5);
+				if (start < rightSlope) continue;
+				if (end > leftSlope) break;
+
+				int x = cx + dx * xx + dy * xy;
+				int y = cy + dx * yx + dy * yy;
+				bool inside = grid.inBounds(x, y);
+				if (inside && dx * dx + dy * dy <= radius * radius) grid.reveal(x, y);
+
+				bool opaque = !inside || !grid.isFloor(x, y);
+				if (blocked) {
+					if (opaque) {
+						newStart = rightSlope;
+					}
+					else {
+						blocked = false;
+						start = newStart;
+					}
+				}
+				else if (opaque && j < radius) {
+					blocked = true;
+					castLight(cx, cy, j + 1, start, leftSlope, radius, xx, xy, yx, yy, grid);
+					newStart = rightSlope;
+				}
+			}
+			if (blocked) break;
+		}
+	}
+};
+
+class Player {
+	int x;
+	int y;
+
+	int maxHealth;
+	int currentHealth;
+	int defense;
+	int strength;
+	int potions; // healing potion inventory
+
+public:
+	Player(int h = 20, int d = 2, int s = 6)
+		: x(0), y(0), maxHealth(h), currentHealth(h), defense(d), strength(s), potions(0) {
+	}
+
+	// Position
+	int getX() const { 
+		return x; 
+	}
+	int getY() const { 
+		return y; 
+	}
+	void setX(int nx) { 
+		x = nx; 
+	}
+	void setY(int ny) {
+		y = ny; 
+	}
+	void setPosition(int nx, int ny) {
+		x = nx; 
+		y = ny; 
+	}
+
+	// Stats
+	int getMaxHealth() const {
+		return maxHealth; 
+	}
+	int getCurrentHealth() const { 
+		return currentHealth; 
+	}
+	int getDefense() const { 
+		return defense; 
+	}
+	int getStrength() const { 
+		return strength; 
+	}
+
+	void setMaxHealth(int mh) {
+		maxHealth = max(0, mh);
+		currentHealth = min(currentHealth, maxHealth);
+	}
+	void setCurrentHealth(int ch) { 
+		currentHealth = max(0, min(ch, maxHealth)); 
+	}
+	void setDefense(int d) { 
+		defense = d; 
+	}
+	void setStrength(int s) { 
+		strength = s; 
+	}
+
+	// Healing helpers
+	void heal(int amount) { 
+		setCurrentHealth(currentHealth + max(0, amount)); 
+	}
+	void healToFull() { 
+		currentHealth = maxHealth; 
+	}
+
+	// Damage helper
+	int applyDamage(int rawDamage) {
+		int dmg = max(0, rawDamage - defense);
+		currentHealth = max(0, currentHealth - dmg);
+		return dmg;
+	}
+
+	bool isDead() const { 
+		return currentHealth <= 0; 
+	}
+
+	// Potions inventory
+	int getPotions() const { 
+		return potions; 
+	}
+	void addPotions(int n) { 
+		potions = max(0, potions + n); 
+	}
+	bool canUsePotion() const { 
+		return potions > 0 && currentHealth < maxHealth; 
+	}
+	bool usePotion() {
+		if (!canUsePotion()) 
+			return false;
+		potions--;
+		heal(maxHealth / 2);
+		return true;
+	}
+};
+
+// Battle menu choices; values match the keys on the combat screen ('1'..'4').
+enum BattleAction { ACT_ATTACK = 1, ACT_DEFEND = 2, ACT_POTION = 3, ACT_RUN = 4 };
+
+// Automatic choice for the player's battle turn (used by the headless tools instead of a human).
+struct FightPolicy {
+	enum Kind : uint8_t { ATTACK, CAUTIOUS };
+	Kind kind = ATTACK;
+	int healBelowPercent = 40; // CAUTIOUS: drink a potion below this much health
+	int runBelowPercent = 20;  // CAUTIOUS: try to run below this much health when no potion helps
+
+	BattleAction choose(int hp, int maxHp, int potions) const {
+		if (kind == CAUTIOUS) {
+			if (potions > 0 && hp < maxHp && hp * 100 < maxHp * healBelowPercent) return ACT_POTION;
+			if (hp * 100 < maxHp * runBelowPercent) return ACT_RUN;
+		}
+		return ACT_ATTACK;
+	}
+};
+
+// Combat numbers for one side of a battle
+struct Fighter {
+	int health;
+	int maxHealth;
+	int defense;
+	int strength;
+};
+
+// What one turn did, so OpenBattle can word its combat log
+struct TurnResult {
+	BattleAction action = ACT_ATTACK; // enemy turns are ACT_ATTACK or ACT_DEFEND
+	bool valid = true;                // false: the choice had no effect (no usable potion) and the turn goes on
+	bool crit = false;
+	int damage = 0;                   // damage from the attack after any defend reduction
+	int reducedBy = 0;                // defense subtracted because the target had Defend ready
+	int parry = 0;                    // true damage the defender countered with (0 if no parry)
+	bool escaped = false;
+};
+
+// The OpenBattle rules as plain state and numbers: no console, strings or allocation.
+// 20% enemy defend, 10% crit for 1.5x, Defend subtracts the defender's Defense from the next hit and parries
+// for (damage + strength) / defense true damage, Run succeeds 40% of the time. An unused Defend wears off at the
+// start of the defender's next turn. RNG draws happen in the same order as the interactive screen.
+struct Battle {
+	Fighter player;
+	Fighter enemy;
+	int potions;
+	bool playerTurn;
+	bool playerDefendReady = false;
+	bool enemyDefendReady = false;
+	bool escaped = false;
+
+	Battle(const Fighter& p, const Fighter& e, int potionCount, bool playerStarts)
+		: player(p), enemy(e), potions(potionCount), playerTurn(playerStarts) {
+	}
+
+	bool over() const { return escaped || player.health <= 0 || enemy.health <= 0; }
+	bool canUsePotion() const { return potions > 0 && player.health < player.maxHealth; }
+
+	// Expire the acting side's unused Defend
+	void beginTurn() {
+		if (playerTurn) playerDefendReady = false;
+		else enemyDefendReady = false;
+	}
+
+	// Attack from one side to the other; shared by both turns
+	static void strike(Fighter& attacker, Fighter& target, bool& targetDefendReady, Rng& rng, TurnResult& r) {
+		int raw = max(0, attacker.strength);
+		if (rng.chance(10)) {
+			// 10% chance for critical hit (1.5x damage)
+			raw = static_cast<int>(static_cast<double>(raw) * 1.5);
+			r.crit = true;
+		}
+		bool consumedDefend = false;
+		if (targetDefendReady) {
+			r.reducedBy = target.defense;
+			targetDefendReady = false;
+			consumedDefend = true;
+		}
+		r.damage = max(1, raw - r.reducedBy);
+		target.health = max(0, target.health - r.damage);
+
+		// Parry: a defender that took damage deals true damage back
+		if (consumedDefend && r.damage > 0) {
+			r.parry = max(1, (r.damage + target.strength) / max(1, target.defense));
+			attacker.health = max(0, attacker.health - r.parry);
+		}
+	}
+
+	TurnResult enemyTurn(Rng& rng) {
+		TurnResult r;
+		if (rng.chance(20)) {
+			enemyDefendReady = true;
+			r.action = ACT_DEFEND;
+		}
+		else {
+			strike(enemy, player, playerDefendReady, rng, r);
+		}
+		playerTurn = true;
+		return r;
+	}
+
+	TurnResult playerAct(BattleAction a, Rng& rng) {
+		TurnResult r;
+		r.action = a;
+		switch (a) {
+			case ACT_ATTACK:
+				strike(player, enemy, enemyDefendReady, rng, r);
+				break;
+			case ACT_DEFEND:
+				playerDefendReady = true;
+				break;
+			case ACT_POTION:
+				if (!canUsePotion()) {
+					r.valid = false;
+					return r; // still the player's turn
+				}
+				potions--;
+				player.health = min(player.maxHealth, player.health + player.maxHealth / 2);
+				break;
+			case ACT_RUN:
+				if (rng.chance(40)) {
+					escaped = true;
+					r.escaped = true;
+				}
+				break;
+		}
+		playerTurn = false;
+		return r;
+	}
+};
+
+struct BattleOutcome {
+	bool won;          // enemy defeated and player alive
+	bool escaped;
+	int playerHealth;
+	int enemyHealth;
+	int potionsLeft;
+	int turns;
+};
+
+// Play a whole battle out with a fixed policy. Allocation-free; safe to call from many threads with separate Rngs.
+inline BattleOutcome resolveBattle(const Fighter& p, const Fighter& e, int potions, bool playerStarts,
+                                   const FightPolicy& policy, Rng& rng) {
+	Battle b(p, e, potions, playerStarts);
+	int turns = 0;
+	while (!b.over()) {
+		b.beginTurn();
+		if (b.playerTurn) {
+			BattleAction a = policy.choose(b.player.health, b.player.maxHealth, b.potions);
+			if (a == ACT_POTION && !b.canUsePotion()) a = ACT_ATTACK;
+			b.playerAct(a, rng);
+		}
+		else {
+			b.enemyTurn(rng);
+		}
+		turns++;
+	}
+	BattleOutcome o;
+	o.escaped = b.escaped;
+	o.won = !b.escaped && b.enemy.health <= 0 && b.player.health > 0;
+	o.playerHealth = b.player.health;
+	o.enemyHealth = b.enemy.health;
+	o.potionsLeft = b.potions;
+	o.turns = turns;
+	return o;
+}
+
+// Exact outcome odds for a battle under a fixed FightPolicy. The fight is a finite Markov chain over
+// (potions, player HP, enemy HP, whose turn, pending Defend); probability mass is pushed forward from the start
+// state in an order where every step either lowers a health value or spends a potion. Defend, a failed Run and an
+// enemy Defend change no numbers, so those loops stay inside one (potions, HP, HP) block of four states and are
+// solved exactly as a 4x4 linear system. Results are cached by stat tuple.
+struct BattleOdds {
+	double win = 0.0;
+	double loss = 0.0;
+	double escape = 0.0;
+	double expectedHealthLeft = 0.0;  // over all outcomes (0 HP when the player dies)
+	vector<double> healthLeft;        // healthLeft[h] = P(battle ends with the player on h HP)
+	vector<double> survivors;         // survivors[k * healthLeft.size() + h] = P(player lives, k potions and h HP left)
+};
+
+class BattleSolver {
+public:
+	// Start states: the player's or the enemy's turn, with the other side's Defend pending or not
+	enum StartState { PLAYER_TURN = 0, PLAYER_TURN_ENEMY_DEFENDING = 1, ENEMY_TURN = 2, ENEMY_TURN_PLAYER_DEFENDING = 3 };
+
+private:
+	typedef array<int, 12> Key;
+	map<Key, BattleOdds> cache;
+	vector<double> mass; // [potions][player HP][enemy HP][state]
+	BattleOdds spread;   // advance()'s result
+	int hpStride = 0;
+	int ehStride = 0;
+	long long blocks = 0; // (potions, HP, enemy HP) blocks solved so far, a machine-independent measure of work
+
+	size_t index(int pot, int ph, int eh, int state) const {
+		return ((static_cast<size_t>(pot) * hpStride + ph) * ehStride + eh) * 4 + state;
+	}
+
+	// x (I - Q) = m for a 4-state block, solved by Gaussian elimination on the transpose
+	static void solveBlock(const double q[4][4], const double m[4], double x[4]) {
+		double a[4][5];
+		for (int r = 0; r < 4; ++r) {
+			for (int c = 0; c < 4; ++c) a[r][c] = (r == c ? 1.0 : 0.0) - q[c][r];
+			a[r][4] = m[r];
+		}
+		for (int c = 0; c < 4; ++c) {
+			int pivot = c;
+			for (int r = c + 1; r < 4; ++r) if (fabs(a[r][c]) > fabs(a[pivot][c])) pivot = r;
+			for (int k = 0; k < 5; ++k) swap(a[c][k], a[pivot][k]);
+			for (int r = 0; r < 4; ++r) {
+				if (r == c || a[r][c] == 0.0) continue;
+				double f = a[r][c] / a[c][c];
+				for (int k = c; k < 5; ++k) a[r][k] -= f * a[c][k];
+			}
+		}
+		for (int r = 0; r < 4; ++r) x[r] = a[r][4] / a[r][r];
+	}
+
+public:
+	const BattleOdds& solve(const Fighter& p, const Fighter& e, int potions, StartState start, const FightPolicy& policy) {
+		Key key = { { p.health, p.maxHealth, p.defense, p.strength, e.health, e.defense, e.strength, potions,
+		              static_cast<int>(start), static_cast<int>(policy.kind), policy.healBelowPercent, policy.runBelowPercent } };
+		auto hit = cache.find(key);
+		if (hit != cache.end()) return hit->second;
+		if (cache.size() > 4096) cache.clear();
+
+		BattleOdds odds;
+		int pMax = max(p.maxHealth, p.health);
+		odds.healthLeft.assign(static_cast<size_t>(pMax + 1), 0.0);
+		odds.survivors.assign(static_cast<size_t>(potions + 1) * (pMax + 1), 0.0);
+		if (p.health <= 0 || e.health <= 0) {
+			(p.health <= 0 ? odds.loss : odds.win) = 1.0;
+			odds.healthLeft[static_cast<size_t>(max(0, p.health))] = 1.0;
+			odds.expectedHealthLeft = max(0, p.health);
+			if (p.health > 0) odds.survivors[static_cast<size_t>(potions) * (pMax + 1) + p.health] = 1.0;
+			return cache[key] = odds;
+		}
+
+		begin(pMax, e, potions);
+		mass[index(potions, p.health, e.health, start)] = 1.0;
+		sweep(p, e, pMax, potions, policy, odds);
+		return cache[key] = odds;
+	}
+
+	long long blocksSolved() const { return blocks; }
+
+	// Battles from a whole spread of starting states in one pass: start[k * (p.maxHealth + 1) + h] is the chance of
+	// going in with k potions (k <= potions) on h HP, opening half the time on each side's turn. The chain is linear
+	// in its start, so the odds come out summed over the spread and survivors is the spread the player leaves with.
+	// The result is scratch that the next call overwrites.
+	const BattleOdds& advance(const Fighter& p, const Fighter& e, int potions, const vector<double>& start, const FightPolicy& policy) {
+		int pMax = max(1, p.maxHealth);
+		spread = BattleOdds();
+		spread.healthLeft.assign(static_cast<size_t>(pMax + 1), 0.0);
+		spread.survivors.assign(static_cast<size_t>(potions + 1) * (pMax + 1), 0.0);
+		begin(pMax, e, potions);
+		for (int pot = 0; pot <= potions; ++pot) {
+			for (int ph = 1; ph <= pMax; ++ph) {
+				double m = start[static_cast<size_t>(pot) * hpStride + ph];
+				if (m == 0.0) continue;
+				if (e.health <= 0) {
+					spread.win += m;
+					spread.healthLeft[static_cast<size_t>(ph)] += m;
+					spread.survivors[static_cast<size_t>(pot) * hpStride + ph] += m;
+					continue;
+				}
+				mass[index(pot, ph, e.health, PLAYER_TURN)] = 0.5 * m;
+				mass[index(pot, ph, e.health, ENEMY_TURN)] = 0.5 * m;
+			}
+		}
+		if (e.health > 0) sweep(p, e, pMax, potions, policy, spread);
+		return spread;
+	}
+
+private:
+	void begin(int pMax, const Fighter& e, int potions) {
+		hpStride = pMax + 1;
+		ehStride = max(0, e.health) + 1;
+		mass.assign(static_cast<size_t>(potions + 1) * hpStride * ehStride * 4, 0.0);
+	}
+
+	// Push the seeded mass through the chain into odds
+	void sweep(const Fighter& p, const Fighter& e, int pMax, int potions, const FightPolicy& policy, BattleOdds& odds) {
+		int critStrP = static_cast<int>(static_cast<double>(max(0, p.strength)) * 1.5);
+		int critStrE = static_cast<int>(static_cast<double>(max(0, e.strength)) * 1.5);
+		int parryDivP = max(1, p.defense);
+		int parryDivE = max(1, e.defense);
+
+		// Move probability into a later block, or into an outcome when someone drops to 0 HP
+		auto deliver = [&](double prob, int pot, int ph, int eh, int state) {
+			if (prob == 0.0) return;
+			if (ph <= 0) { odds.loss += prob; odds.healthLeft[0] += prob; }
+			else if (eh <= 0) {
+				odds.win += prob;
+				odds.healthLeft[static_cast<size_t>(ph)] += prob;
+				odds.survivors[static_cast<size_t>(pot) * hpStride + ph] += prob;
+			}
+			else mass[index(pot, ph, eh, state)] += prob;
+		};
+
+		for (int pot = potions; pot >= 0; --pot) {
+			for (int ph = pMax; ph >= 1; --ph) {
+				for (int eh = e.health; eh >= 1; --eh) {
+					const double* m = &mass[index(pot, ph, eh, 0)];
+					if (m[0] == 0.0 && m[1] == 0.0 && m[2] == 0.0 && m[3] == 0.0) continue;
+					++blocks;
+
+					BattleAction act = policy.choose(ph, p.maxHealth, pot);
+					bool canPotion = pot > 0 && ph < p.maxHealth;
+					if (act == ACT_POTION && !canPotion) act = ACT_ATTACK;
+
+					// Transitions that stay in this block
+					double q[4][4] = {};
+					for (int s = 0; s < 2; ++s) {
+						if (act == ACT_DEFEND) q[s][ENEMY_TURN_PLAYER_DEFENDING] = 1.0;
+						if (act == ACT_RUN) q[s][ENEMY_TURN] = 0.6;
+					}
+					q[ENEMY_TURN][PLAYER_TURN_ENEMY_DEFENDING] = 0.2;
+					q[ENEMY_TURN_PLAYER_DEFENDING][PLAYER_TURN_ENEMY_DEFENDING] = 0.2;
+
+					double visits[4];
+					solveBlock(q, m, visits);
+
+					// Player turns (enemy Defend pending in state 1)
+					for (int s = 0; s < 2; ++s) {
+						double v = visits[s];
+						if (v == 0.0) continue;
+						if (act == ACT_ATTACK) {
+							for (int crit = 0; crit < 2; ++crit) {
+								int dmg = max(1, (crit ? critStrP : max(0, p.strength)) - (s ? e.defense : 0));
+								int parry = s ? max(1, (dmg + e.strength) / parryDivE) : 0;
+								deliver(v * (crit ? 0.1 : 0.9), pot, ph - parry, eh - dmg, ENEMY_TURN);
+							}
+						}
+						else if (act == ACT_POTION) {
+							deliver(v, pot - 1, min(p.maxHealth, ph + p.maxHealth / 2), eh, ENEMY_TURN);
+						}
+						else if (act == ACT_RUN) {
+							odds.escape += 0.4 * v;
+							odds.healthLeft[static_cast<size_t>(ph)] += 0.4 * v;
+							odds.survivors[static_cast<size_t>(pot) * hpStride + ph] += 0.4 * v;
+						}
+					}
+
+					// Enemy turns (player Defend pending in state 3): 80% attack
+					for (int s = ENEMY_TURN; s <= ENEMY_TURN_PLAYER_DEFENDING; ++s) {
+						double v = visits[s] * 0.8;
+						if (v == 0.0) continue;
+						bool defending = (s == ENEMY_TURN_PLAYER_DEFENDING);
+						for (int crit = 0; crit < 2; ++crit) {
+							int dmg = max(1, (crit ? critStrE : max(0, e.strength)) - (defending ? p.defense : 0));
+							int parry = defending ? max(1, (dmg + p.strength) / parryDivP) : 0;
+							deliver(v * (crit ? 0.1 : 0.9), pot, ph - dmg, eh - parry, PLAYER_TURN);
+						}
+					}
+				}
+			}
+		}
+
+		for (size_t h = 0; h < odds.healthLeft.size(); ++h) odds.expectedHealthLeft += static_cast<double>(h) * odds.healthLeft[h];
+	}
+};
+
+// Several independent battles advanced in lockstep, one per SIMD lane. Battle i runs on lane i % LANES after that
+// lane's earlier battles and draws only from rngs[lane], so the AVX2 path and the scalar fallback (resolveBattle
+// per lane) give bit-identical outcomes and leave every Rng in the same state. The lane code follows Battle turn
+// for turn: each Rng.chance() becomes a threshold compare on the raw draw, and the crit/defend/parry damage
+// values are worked out per lane up front so a turn is only blends and min/max.
+struct BattleJob {
+	Fighter player;
+	Fighter enemy;
+	int potions;
+	bool playerStarts;
+};
+
+class BattleBatch {
+public:
+	static const int LANES = 8;
+
+	static bool simdAvailable() {
+#if BATTLE_SIMD && defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] < 7) return false;
+		__cpuid(info, 1);
+		if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0) return false; // OSXSAVE, AVX
+		if ((_xgetbv(0) & 6) != 6) return false;                                     // OS saves YMM state
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;                                            // AVX2
+#elif BATTLE_SIMD
+		return __builtin_cpu_supports("avx2") != 0;
+#else
+		return false;
+#endif
+	}
+
+	// job(i) returns battle i; sink(i, outcome) receives its result
+	template <class JobFn, class SinkFn>
+	static void run(int count, Rng (&rngs)[LANES], const FightPolicy& policy, JobFn job, SinkFn sink, bool allowSimd = true) {
+#if BATTLE_SIMD
+		if (allowSimd && count > 0 && simdAvailable()) {
+			runAvx2(count, rngs, policy, job, sink);
+			return;
+		}
+#endif
+		(void)allowSimd;
+		for (int lane = 0; lane < LANES; ++lane) {
+			for (int i = lane; i < count; i += LANES) {
+				BattleJob b = job(i);
+				sink(i, resolveBattle(b.player, b.enemy, b.potions, b.playerStarts, policy, rngs[lane]));
+			}
+		}
+	}
+
+private:
+	// Chance thresholds on a raw 32-bit draw x: below(100) < pct  <=>  x < ceil(pct * 2^32 / 100)
+	static uint32_t chanceThreshold(int percent) {
+		return static_cast<uint32_t>(((static_cast<uint64_t>(percent) << 32) + 99) / 100);
+	}
+
+	// One lane's numbers, laid out as arrays of LANES so each field loads as a vector
+	struct alignas(32) Lanes {
+		int32_t pHealth[LANES], eHealth[LANES], potions[LANES], turns[LANES];
+		int32_t playerTurn[LANES], playerDefend[LANES], enemyDefend[LANES], escaped[LANES], active[LANES];
+		int32_t pMax[LANES], heal[LANES], healLimit[LANES], runLimit[LANES];
+		int32_t pHit[4][LANES], eHit[4][LANES];     // [crit * 2 + defended]
+		int32_t pParried[2][LANES], eParried[2][LANES]; // [crit]: parry damage taken hitting a defender
+		uint32_t s[4][LANES];                         // xoshiro128++ state per lane
+		int job[LANES];
+		Fighter lastPlayer[LANES], lastEnemy[LANES];  // the damage tables above were built for these
+	};
+
+	static int hitDamage(int strength, bool crit, int defense) {
+		int raw = max(0, strength);
+		if (crit) raw = static_cast<int>(static_cast<double>(raw) * 1.5);
+		return max(1, raw - defense);
+	}
+
+	static int lowestBit(unsigned v) {
+#if defined(_MSC_VER)
+		unsigned long i;
+		_BitScanForward(&i, v);
+		return static_cast<int>(i);
+#else
+		return __builtin_ctz(v);
+#endif
+	}
+
+	static bool sameStats(const Fighter& a, const Fighter& b) {
+		return a.maxHealth == b.maxHealth && a.defense == b.defense && a.strength == b.strength;
+	}
+
+	// Start battle i on a lane. The per-lane damage tables are kept when the stats match the lane's last battle,
+	// which is the common case for the balance tools.
+	static void load(Lanes& L, int lane, int i, const BattleJob& b, const FightPolicy& policy) {
+		L.job[lane] = i;
+		L.active[lane] = -1;
+		L.pHealth[lane] = b.player.health;
+		L.eHealth[lane] = b.enemy.health;
+		L.potions[lane] = b.potions;
+		L.turns[lane] = 0;
+		L.playerTurn[lane] = b.playerStarts ? -1 : 0;
+		L.playerDefend[lane] = L.enemyDefend[lane] = L.escaped[lane] = 0;
+		if (L.job[lane] >= LANES && sameStats(L.lastPlayer[lane], b.player) && sameStats(L.lastEnemy[lane], b.enemy)) return;
+		L.lastPlayer[lane] = b.player;
+		L.lastEnemy[lane] = b.enemy;
+		L.pMax[lane] = b.player.maxHealth;
+		L.heal[lane] = b.player.maxHealth / 2;
+		bool cautious = policy.kind == FightPolicy::CAUTIOUS;
+		L.healLimit[lane] = cautious ? b.player.maxHealth * policy.healBelowPercent : INT_MIN;
+		L.runLimit[lane] = cautious ? b.player.maxHealth * policy.runBelowPercent : INT_MIN;
+		for (int crit = 0; crit < 2; ++crit) {
+			for (int def = 0; def < 2; ++def) {
+				L.pHit[crit * 2 + def][lane] = hitDamage(b.player.strength, crit != 0, def ? b.enemy.defense : 0);
+				L.eHit[crit * 2 + def][lane] = hitDamage(b.enemy.strength, crit != 0, def ? b.player.defense : 0);
+			}
+			L.pParried[crit][lane] = max(1, (L.pHit[crit * 2 + 1][lane] + b.enemy.strength) / max(1, b.enemy.defense));
+			L.eParried[crit][lane] = max(1, (L.eHit[crit * 2 + 1][lane] + b.player.strength) / max(1, b.player.defense));
+		}
+	}
+
+	// A battle that ended on this lane: report it and pull the lane's next one, if any
+	template <class JobFn, class SinkFn>
+	static void retire(Lanes& L, int lane, int count, const FightPolicy& policy, JobFn& job, SinkFn& sink) {
+		BattleOutcome o;
+		o.escaped = L.escaped[lane] != 0;
+		o.won = !o.escaped && L.eHealth[lane] <= 0 && L.pHealth[lane] > 0;
+		o.playerHealth = L.pHealth[lane];
+		o.enemyHealth = L.eHealth[lane];
+		o.potionsLeft = L.potions[lane];
+		o.turns = L.turns[lane];
+		sink(L.job[lane], o);
+		int next = L.job[lane] + LANES;
+		if (next < count) load(L, lane, next, job(next), policy);
+		else L.active[lane] = 0;
+	}
+
+#if BATTLE_SIMD
+	// xoshiro128++ next() on the lanes in mask (other lanes keep their state), biased by 2^31 so that signed
+	// compares against biased thresholds act as unsigned ones
+	TARGET_AVX2 static __m256i draw(__m256i& s0, __m256i& s1, __m256i& s2, __m256i& s3, __m256i mask) {
+		__m256i sum = _mm256_add_epi32(s0, s3);
+		__m256i result = _mm256_add_epi32(_mm256_or_si256(_mm256_slli_epi32(sum, 7), _mm256_srli_epi32(sum, 25)), s0);
+		__m256i t = _mm256_slli_epi32(s1, 9);
+		__m256i n2 = _mm256_xor_si256(s2, s0);
+		__m256i n3 = _mm256_xor_si256(s3, s1);
+		__m256i n1 = _mm256_xor_si256(s1, n2);
+		__m256i n0 = _mm256_xor_si256(s0, n3);
+		n2 = _mm256_xor_si256(n2, t);
+		n3 = _mm256_or_si256(_mm256_slli_epi32(n3, 11), _mm256_srli_epi32(n3, 21));
+		s0 = _mm256_blendv_epi8(s0, n0, mask);
+		s1 = _mm256_blendv_epi8(s1, n1, mask);
+		s2 = _mm256_blendv_epi8(s2, n2, mask);
+		s3 = _mm256_blendv_epi8(s3, n3, mask);
+		return _mm256_xor_si256(result, _mm256_set1_epi32(INT_MIN));
+	}
+
+	template <class JobFn, class SinkFn>
+	TARGET_AVX2 static void runAvx2(int count, Rng (&rngs)[LANES], const FightPolicy& policy, JobFn& job, SinkFn& sink) {
+		Lanes L;
+		for (int lane = 0; lane < LANES; ++lane) {
+			uint32_t st[4];
+			rngs[lane].getState(st);
+			for (int k = 0; k < 4; ++k) L.s[k][lane] = st[k];
+			if (lane < count) load(L, lane, lane, job(lane), policy);
+			else L.active[lane] = 0;
+		}
+
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i one = _mm256_set1_epi32(1);
+		const __m256i hundred = _mm256_set1_epi32(100);
+		const __m256i crit10 = _mm256_set1_epi32(static_cast<int>(chanceThreshold(10) ^ 0x80000000u));
+		const __m256i defend20 = _mm256_set1_epi32(static_cast<int>(chanceThreshold(20) ^ 0x80000000u));
+		const __m256i escape40 = _mm256_set1_epi32(static_cast<int>(chanceThreshold(40) ^ 0x80000000u));
+		#define LD(a) _mm256_load_si256(reinterpret_cast<const __m256i*>(a))
+		#define ST(a, v) _mm256_store_si256(reinterpret_cast<__m256i*>(a), v)
+		#define SEL(m, a, b) _mm256_blendv_epi8(b, a, m)
+
+		// Battle state lives in registers and is only spilled to L when a lane retires
+		__m256i s0 = LD(L.s[0]), s1 = LD(L.s[1]), s2 = LD(L.s[2]), s3 = LD(L.s[3]);
+		__m256i active, ph, eh, pot, pt, pDef, eDef, escaped, turns;
+		#define RELOAD() active = LD(L.active); ph = LD(L.pHealth); eh = LD(L.eHealth); pot = LD(L.potions); \
+			pt = LD(L.playerTurn); pDef = LD(L.playerDefend); eDef = LD(L.enemyDefend); escaped = LD(L.escaped); turns = LD(L.turns)
+		RELOAD();
+
+		while (!_mm256_testz_si256(active, active)) {
+			__m256i pMax = LD(L.pMax);
+
+			// beginTurn: the acting side's unused Defend expires
+			pDef = _mm256_andnot_si256(pt, pDef);
+			eDef = _mm256_and_si256(pt, eDef);
+
+			// FightPolicy::choose (the policy never picks Defend, and only picks a potion it can drink)
+			__m256i hp100 = _mm256_mullo_epi32(ph, hundred);
+			__m256i drink = _mm256_and_si256(_mm256_cmpgt_epi32(pot, zero),
+				_mm256_and_si256(_mm256_cmpgt_epi32(pMax, ph), _mm256_cmpgt_epi32(LD(L.healLimit), hp100)));
+			__m256i run = _mm256_andnot_si256(drink, _mm256_cmpgt_epi32(LD(L.runLimit), hp100));
+			__m256i attack = _mm256_andnot_si256(_mm256_or_si256(drink, run), pt);
+			drink = _mm256_and_si256(_mm256_and_si256(drink, pt), active);
+			run = _mm256_and_si256(_mm256_and_si256(run, pt), active);
+			attack = _mm256_and_si256(attack, active);
+			__m256i enemyTurn = _mm256_andnot_si256(pt, active);
+
+			// First draw: player crit or escape roll, or the enemy's Defend roll; second: the enemy's crit
+			__m256i r1 = draw(s0, s1, s2, s3, _mm256_or_si256(_mm256_or_si256(attack, run), enemyTurn));
+			__m256i enemyDefends = _mm256_and_si256(enemyTurn, _mm256_cmpgt_epi32(defend20, r1));
+			__m256i enemyAttacks = _mm256_andnot_si256(enemyDefends, enemyTurn);
+			__m256i r2 = draw(s0, s1, s2, s3, enemyAttacks);
+
+			// Player attack
+			__m256i crit = _mm256_cmpgt_epi32(crit10, r1);
+			__m256i dmg = SEL(crit, SEL(eDef, LD(L.pHit[3]), LD(L.pHit[2])), SEL(eDef, LD(L.pHit[1]), LD(L.pHit[0])));
+			__m256i parry = _mm256_and_si256(eDef, SEL(crit, LD(L.pParried[1]), LD(L.pParried[0])));
+			eh = SEL(attack, _mm256_max_epi32(zero, _mm256_sub_epi32(eh, dmg)), eh);
+			ph = SEL(attack, _mm256_max_epi32(zero, _mm256_sub_epi32(ph, parry)), ph);
+			eDef = _mm256_andnot_si256(attack, eDef);
+
+			// Potion and Run
+			pot = _mm256_sub_epi32(pot, _mm256_and_si256(drink, one));
+			ph = SEL(drink, _mm256_min_epi32(pMax, _mm256_add_epi32(ph, LD(L.heal))), ph);
+			escaped = _mm256_or_si256(escaped, _mm256_and_si256(run, _mm256_cmpgt_epi32(escape40, r1)));
+
+			// Enemy turn
+			eDef = _mm256_or_si256(eDef, enemyDefends);
+			crit = _mm256_cmpgt_epi32(crit10, r2);
+			dmg = SEL(crit, SEL(pDef, LD(L.eHit[3]), LD(L.eHit[2])), SEL(pDef, LD(L.eHit[1]), LD(L.eHit[0])));
+			parry = _mm256_and_si256(pDef, SEL(crit, LD(L.eParried[1]), LD(L.eParried[0])));
+			ph = SEL(enemyAttacks, _mm256_max_epi32(zero, _mm256_sub_epi32(ph, dmg)), ph);
+			eh = SEL(enemyAttacks, _mm256_max_epi32(zero, _mm256_sub_epi32(eh, parry)), eh);
+			pDef = _mm256_andnot_si256(enemyAttacks, pDef);
+
+			pt = _mm256_xor_si256(pt, active);
+			turns = _mm256_sub_epi32(turns, active);
+
+			__m256i over = _mm256_or_si256(escaped, _mm256_or_si256(_mm256_cmpgt_epi32(one, ph), _mm256_cmpgt_epi32(one, eh)));
+			unsigned done = static_cast<unsigned>(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_and_si256(over, active))));
+			if (done == 0) continue;
+
+			// Retired lanes load their next battle into the arrays; the Rng state stays in registers
+			ST(L.pHealth, ph); ST(L.eHealth, eh); ST(L.potions, pot); ST(L.playerTurn, pt);
+			ST(L.playerDefend, pDef); ST(L.enemyDefend, eDef); ST(L.escaped, escaped); ST(L.turns, turns);
+			for (; done != 0; done &= done - 1) retire(L, lowestBit(done), count, policy, job, sink);
+			RELOAD();
+		}
+		#undef RELOAD
+		#undef LD
+		#undef ST
+		#undef SEL
+
+		{
+			alignas(32) uint32_t st[4][LANES];
+			_mm256_store_si256(reinterpret_cast<__m256i*>(st[0]), s0);
+			_mm256_store_si256(reinterpret_cast<__m256i*>(st[1]), s1);
+			_mm256_store_si256(reinterpret_cast<__m256i*>(st[2]), s2);
+			_mm256_store_si256(reinterpret_cast<__m256i*>(st[3]), s3);
+			for (int lane = 0; lane < LANES; ++lane) {
+				uint32_t out[4] = { st[0][lane], st[1][lane], st[2][lane], st[3][lane] };
+				rngs[lane].setState(out);
+			}
+		}
+	}
+#endif
+};
+
+class Combat {
+	Session& session;
+
+public:
+	explicit Combat(Session& s) : session(s) {}
+
+	// Odds shown on the battle screen; one cache per thread so headless tools can share the code safely
+	static BattleSolver& oddsSolver() {
+		static thread_local BattleSolver solver;
+		return solver;
+	}
+
+	// Shows a modal "combat screen" in the SAME console window, then returns. Text is UTF-8.
+	void OpenModal(const char* title = "Combat",
+	               const char* message = "You made contact with an enemy!\nPress Esc/Enter/Space to continue.")
+	{
+		if (!session.headless) {
+			TextScreen& screen = TextScreen::frame();
+			screen.begin();
+			screen.openPanel(title ? title : "Combat");
+			screen.paragraph(message ? message : "");
+			screen.blank();
+			screen.centered("[Esc]  [Enter]  [Space] to continue");
+			screen.closePanel();
+			screen.present();
+		}
+
+		// Wait for a key without echoing
+		for (;;) {
+			int ch = session.readKey(KEY_MODAL);
+			if (ch == 27 || ch == 13 || ch == ' ') break; // ESC / ENTER / SPACE
+		}
+
+		// Drain any extra buffered keystrokes to avoid affecting the game loop
+		session.drainKeys();
+
+		// Let the game redraw its next frame
+	}
+
+	// Interactive battle with explicit starter: playerStarts = true if player walked into the enemy.
+	// Defend action expires at the start of the defender's next turn if unused.
+	// Parry: If a defending character is dealt damage, they counter for scaled true damage.
+	// Returns true if the player successfully ran away (escaped).
+	bool OpenBattle(Player& player, Enemy& enemy, bool playerStarts, int prevPlayerX, int prevPlayerY) {
+		TRACE_SCOPE("OpenBattle");
+
+		// Battle rules live in Battle; this screen only reads keys, words the log and mirrors the numbers back.
+		Battle battle({ player.getCurrentHealth(), player.getMaxHealth(), player.getDefense(), player.getStrength() },
+		              { enemy.getCurrentHealth(), enemy.getMaxHealth(), enemy.getDefense(), enemy.getStrength() },
+		              player.getPotions(), playerStarts);
+		auto sync = [&]() {
+			player.setCurrentHealth(battle.player.health);
+			enemy.setCurrentHealth(battle.enemy.health);
+			player.addPotions(battle.potions - player.getPotions());
+		};
+
+		auto render = [&](const vector<string>& lines, bool showMenu, const Player& p) {
+			if (session.headless) return;
+			TextScreen& screen = TextScreen::frame();
+			screen.begin();
+			screen.openPanel("Combat");
+
+			// Keep within the console height: leave 5 lines for title/menu/odds/borders
+			screen.log(lines, screen.height() - 5);
+
+			screen.blank();
+			if (showMenu) {
+				screen.centeredf("Your turn: [1] Attack   [2] Defend   [3] Item (Potions: %d)   [4] Run (40%%)%s",
+				                 p.getPotions(), battle.playerDefendReady ? " (Defend active)" : "");
+
+				// Live odds from the exact solver if the player just keeps attacking from here
+				const BattleOdds& odds = oddsSolver().solve(battle.player, battle.enemy, battle.potions,
+					battle.enemyDefendReady ? BattleSolver::PLAYER_TURN_ENEMY_DEFENDING : BattleSolver::PLAYER_TURN, FightPolicy());
+				screen.centeredf("Odds if you keep attacking: %.1f%% win, %.1f HP left on average",
+				                 odds.win * 100.0, odds.expectedHealthLeft);
+			} else {
+				screen.centered("[Esc]/[Enter]/[Space] to continue");
+			}
+			screen.closePanel();
+			screen.present();
+		};
+
+		// " (reduced by n)" when a defend softened a hit
+		auto reduced = [](const TurnResult& r) {
+			return r.reducedBy > 0 ? formatText(" (reduced by %d)", r.reducedBy) : string();
+		};
+
+		vector<string> log;
+
+		while (!player.isDead() && !enemy.isDead()) {
+			// Expire defend at the start of the defender's own turn if it wasn't used.
+			battle.beginTurn();
+
+			// Enemy turn
+			if (!battle.playerTurn) {
+				TurnResult r = battle.enemyTurn(session.rng);
+				sync();
+
+				// 20% chance to defend instead of attacking
+				if (r.action == ACT_DEFEND) {
+					log.push_back(formatText("Enemy braces to defend. Next damage taken reduced by %d.", enemy.getDefense()));
+					log.push_back(" ");
+					continue;
+				}
+
+				if (r.crit) log.push_back("Enemy lands a critical hit!");
+				log.push_back(formatText("Enemy hits you for %d%s. Health: %d/%d", r.damage, reduced(r).c_str(),
+				                         battle.player.health, player.getMaxHealth()));
+
+				if (r.parry > 0) {
+					log.push_back(formatText("You parry and deals %d damage back. Enemy health: %d/%d", r.parry,
+					                         battle.enemy.health, enemy.getMaxHealth()));
+				}
+
+				log.push_back(" ");
+				continue;
+			}
+
+			// Player turn
+			for (;;) {
+				render(log, true, player);
+				int ch = session.readKey(KEY_BATTLE);
+				if (ch < '1' || ch > '4') continue; // ignore other keys
+
+				BattleAction action = static_cast<BattleAction>(ch - '0');
+				if (action == ACT_RUN) log.push_back("You try to run...");
+
+				TurnResult r = battle.playerAct(action, session.rng);
+				sync();
+
+				if (action == ACT_ATTACK) {
+					if (r.crit) log.push_back("You land a critical hit!");
+					log.push_back(formatText("You hit Enemy for %d%s. Enemy health: %d/%d", r.damage, reduced(r).c_str(),
+					                         battle.enemy.health, enemy.getMaxHealth()));
+
+					if (r.parry > 0) {
+						log.push_back(formatText("Enemy parries and deals %d damage back. Health: %d/%d", r.parry,
+						                         battle.player.health, player.getMaxHealth()));
+					}
+					break; // end player's turn
+				}
+				if (action == ACT_DEFEND) {
+					log.push_back(formatText("You defend. Next damage taken reduced by %d.", player.getDefense()));
+					break; // defending consumes the turn
+				}
+				if (action == ACT_POTION) {
+					if (r.valid) {
+						log.push_back(formatText("You used a Healing Potion. Health: %d/%d (Potions left: %d)",
+						                         player.getCurrentHealth(), player.getMaxHealth(), player.getPotions()));
+						break; // using item consumes the turn
+					}
+					log.push_back("No usable potion (none owned or already at full health).");
+					continue; // keep waiting on the same turn for a valid action
+				}
+
+				// Run: 40% chance to escape; on success, move back to previous position
+				if (r.escaped) {
+					log.push_back("You successfully ran away!");
+					// Render outcome and wait for dismiss before leaving combat
+					render(log, false, player);
+					for (;;) {
+						int k = session.readKey(KEY_MODAL);
+						if (k == 27 || k == 13 || k == ' ') break;
+					}
+					session.drainKeys();
+					session.clearScreen();
+
+					// Move player back to previous position
+					player.setPosition(prevPlayerX, prevPlayerY);
+					return true; // escaped
+				}
+				log.push_back("Failed to run!");
+				// Running attempt consumes the turn; enemy acts next
+				break;
+			}
+		}
+
+		// Outcome screen
+		if (enemy.isDead()) {
+			log.push_back("Enemy defeated!");
+			log.push_back("You gained some gold!");
+		} 
+		if (player.isDead()) {
+			log.push_back("You were defeated!");
+		}
+
+		render(log, false, player);
+		for (;;) {
+			int ch = session.readKey(KEY_MODAL);
+			if (ch == 27 || ch == 13 || ch == ' ') break;
+		}
+		session.drainKeys();
+
+		// Clear the combat UI so the game frame doesn't overlap with leftover lines
+		session.clearScreen();
+		return false; // did not escape
+	}
+};
+
+
+// Shop planner: the purchases that maximise the expected number of the next few levels survived with the gold in
+// hand. Fights are played exactly by BattleSolver under the player's FightPolicy, half of them opened by each side,
+// on the whole spread of (potions, HP) the player can be in: a win or an escape passes its share on to the next
+// fight, so a level's survival is the mass still alive after it, and the HP and potions left at the end count as
+// the further levels they should last at the rate the horizon used them up. Gold left over isn't wasted: it counts
+// as potions bought at the next visit, so it helps from the second level on. The coming enemy upgrade splits its
+// 3 points by this visit's purchases the way Levelling::enemyDifficultyIncrease biases them (largest remainders
+// get the odd points); later levels add one point per stat.
+// The DP over (gold, upgrade counts) has one state per (health, strength) count pair, since the counts fix the gold
+// spent and the rest goes on potions; best() memoises those states and climbs through them rather than filling in
+// every pair, which large gold totals make too slow. Defense only counts when defending, which neither policy
+// does, so it isn't bought.
+class PurchasePlanner {
+public:
+	struct Request {
+		int gold = 0;
+		int health = 0, maxHealth = 0, defense = 0, strength = 0, potions = 0; // player now
+		int upHealth = 0, upStrength = 0;                                      // upgrades bought so far (prices)
+		int potionCost = 2;
+		int boughtHealth = 0, boughtDefense = 0, boughtStrength = 0;           // this visit (enemy bias)
+		int enemyHealth = 0, enemyDefense = 0, enemyStrength = 0;              // baseline enemy before its upgrade
+		int fightsPerLevel = 1;
+		int levels = 3;
+		FightPolicy policy;                                                    // decides whether potions get drunk
+	};
+
+	struct Plan {
+		int health = 0;   // +2 max health purchases
+		int strength = 0;
+		int potions = 0;
+		long long cost = 0;
+		double expectedLevels = 0.0; // of Request::levels, plus up to as many again that the reserve left should last
+	};
+
+	static Plan best(const Request& r) {
+		// Climb from buying nothing: each step adds or takes away 1, 2, 4, ... health and/or strength purchases, as
+		// far as the gold goes, and moves to the best plan while it beats the current one. The doubling keeps large
+		// gold totals to a few steps and hops integer damage thresholds a single point misses.
+		// The value tops out at twice the horizon, so with plenty of gold many plans tie there: a tie goes to the
+		// cheaper plan, which the steps down find, and no step goes further up a direction once it reaches the top.
+		// The climb also stops once its sweeps pass SWEEP_BUDGET solved blocks, which keeps it inside a frame at any
+		// gold; counting blocks rather than time keeps the answer the same on every machine.
+		map<pair<int, int>, Plan> memo;
+		long long work = 0;
+		auto at = [&](int h, int s) -> const Plan* {
+			if (h < 0 || s < 0) return nullptr;
+			auto it = memo.find({ h, s });
+			if (it == memo.end()) {
+				if (price(h, r.upHealth) + price(s, r.upStrength) > r.gold || work > SWEEP_BUDGET) return nullptr;
+				it = memo.emplace(make_pair(h, s), withPotions(r, h, s, work)).first;
+			}
+			return &it->second;
+		};
+		// Values rounded to LEVELS_STEP, then cost: a strict order, so the climb can't go round in circles
+		auto better = [](const Plan& a, const Plan& b) {
+			long long va = llround(a.expectedLevels / LEVELS_STEP), vb = llround(b.expectedLevels / LEVELS_STEP);
+			return va != vb ? va > vb : a.cost < b.cost;
+		};
+
+		Plan current = *at(0, 0);
+		for (;;) {
+			const Plan* next = nullptr;
+			for (const auto& step : STEPS) {
+				int dh = step[0], ds = step[1];
+				bool up = dh >= 0 && ds >= 0;
+				if (up && current.expectedLevels >= top(r)) continue;
+				for (int d = 1;; d *= 2) {
+					const Plan* candidate = at(current.health + d * dh, current.strength + d * ds);
+					if (!candidate) break;
+					if (better(*candidate, next ? *next : current)) next = candidate;
+					if (up && candidate->expectedLevels >= top(r)) break;
+				}
+			}
+			if (!next) break;
+			current = *next;
+		}
+		return current;
+	}
+
+	// Expected levels survived after buying h health, s strength and p potions with leftover gold kept (see Plan);
+	// work grows by the blocks BattleSolver solved for it
+	static double evaluate(const Request& r, int h, int s, int p, long long leftover, long long& work) {
+		BattleSolver& odds = solver();
+		Fighter player = { r.health + 2 * h, r.maxHealth + 2 * h, r.defense, r.strength + s };
+
+		double bias[3] = { 1.0 + 0.25 * r.boughtDefense, 1.0 + 0.25 * (r.boughtStrength + s), 1.0 + 0.25 * (r.boughtHealth + h) };
+		int points[3];
+		splitPoints(bias, points);
+		Fighter foe = { r.enemyHealth + points[0], r.enemyHealth + points[0], r.enemyDefense + points[1], r.enemyStrength + points[2] };
+
+		// alive[k * stride + hp] = P(the player is still alive carrying k potions on hp HP)
+		// A policy that never drinks gets nothing from potions, so they're left out of its model
+		int most = r.policy.kind == FightPolicy::CAUTIOUS ? static_cast<int>(min<long long>(r.potions + p + leftover / max(1, r.potionCost), POTION_CAP)) : 0;
+		size_t stride = static_cast<size_t>(player.maxHealth + 1);
+		vector<double> alive(static_cast<size_t>(most + 1) * stride, 0.0);
+		alive[static_cast<size_t>(min(r.potions + p, most)) * stride + static_cast<size_t>(min(max(1, player.health), player.maxHealth))] = 1.0;
+
+		// What the player has to spend on the fights: HP plus what every potion (the leftover's included) heals
+		int horizon = max(1, r.levels);
+		auto reserve = [&]() {
+			double sum = 0.0;
+			for (size_t i = 0; i < alive.size(); ++i) sum += alive[i] * (static_cast<double>(i % stride) + (i / stride) * (player.maxHealth / 2));
+			return sum;
+		};
+		double before = reserve() + (most - min(r.potions + p, most)) * (player.maxHealth / 2);
+
+		double value = 0.0;
+		for (int k = 0; k < horizon; ++k) {
+			// The leftover gold turns into potions at the next visit
+			if (k == 1 && most > r.potions + p) {
+				size_t shift = static_cast<size_t>(most - r.potions - p) * stride;
+				for (size_t i = alive.size(); i-- > shift;) alive[i] = alive[i - shift];
+				fill(alive.begin(), alive.begin() + static_cast<ptrdiff_t>(shift), 0.0);
+			}
+			for (int f = 0; f < r.fightsPerLevel; ++f) {
+				long long solved = odds.blocksSolved();
+				alive = odds.advance(player, foe, most, alive, r.policy).survivors;
+				work += odds.blocksSolved() - solved;
+				drinkBetweenFights(alive, stride, most, player.maxHealth, r.policy);
+			}
+			for (double mass : alive) value += mass;
+			foe.maxHealth++;
+			foe.health = foe.maxHealth;
+			foe.defense++;
+			foe.strength++;
+		}
+
+		// The reserve still in hand lasts about as many more levels as it did per level here, capped at the horizon
+		double after = reserve(), perLevel = (before - after) / horizon;
+		return value + (perLevel > 0.0 ? min<double>(horizon, after / perLevel) : horizon);
+	}
+
+private:
+	// Potions carried past this many are left out of the model: three full heals barely move the odds any more and
+	// each one adds a layer to every fight's sweep
+	static constexpr int POTION_CAP = 6;
+	// Values that round to the same multiple of this are a tie
+	static constexpr double LEVELS_STEP = 1e-3;
+	// best()'s directions, the ones that usually pay first so a climb cut short by the budget has still taken them
+	static constexpr int STEPS[8][2] = { { 1, 1 }, { 1, 0 }, { 0, 1 }, { 1, -1 }, { -1, 1 }, { -1, 0 }, { 0, -1 }, { -1, -1 } };
+
+	// The most a plan can score (see Plan::expectedLevels), less what rounds to it
+	static double top(const Request& r) { return 2.0 * max(1, r.levels) - LEVELS_STEP / 2; }
+	// BattleSolver blocks best() may solve before it settles for the best plan so far: at 100-200 ns a block that's
+	// 20-40 ms, inside the 50 ms frame
+	static constexpr long long SWEEP_BUDGET = 200000;
+
+	// h health and s strength plus potions: buying them now is never worse than keeping the gold, which only
+	// turns into potions a level later, so it's all the potions that fit under the cap. Only when that plan is at
+	// the top anyway is the cheaper one without them tried too. The attack policy never drinks, so it isn't offered
+	// any. The pair must be affordable.
+	static Plan withPotions(const Request& r, int h, int s, long long& work) {
+		Plan plan;
+		plan.health = h;
+		plan.strength = s;
+		plan.cost = price(h, r.upHealth) + price(s, r.upStrength);
+
+		long long potionCost = max(1, r.potionCost);
+		int fit = r.policy.kind == FightPolicy::CAUTIOUS ? static_cast<int>(min<long long>((r.gold - plan.cost) / potionCost, max(0, POTION_CAP - r.potions))) : 0;
+		plan.potions = fit;
+		plan.cost += fit * potionCost;
+		plan.expectedLevels = evaluate(r, h, s, fit, r.gold - plan.cost, work);
+		if (fit > 0 && plan.expectedLevels >= top(r)) {
+			double value = evaluate(r, h, s, 0, r.gold - plan.cost + fit * potionCost, work);
+			if (value >= top(r)) {
+				plan.potions = 0;
+				plan.cost -= fit * potionCost;
+				plan.expectedLevels = value;
+			}
+		}
+		return plan;
+	}
+
+	// n more purchases of a stat bought `bought` times already: the k-th costs 1 + (bought + k - 1)
+	static long long price(int n, int bought) {
+		return static_cast<long long>(n) * bought + static_cast<long long>(n) * (n + 1) / 2;
+	}
+
+	static BattleSolver& solver() {
+		static thread_local BattleSolver cached;
+		return cached;
+	}
+
+	// Out of battle the player drinks whenever the policy would, with no enemy turn to pay for it
+	static void drinkBetweenFights(vector<double>& alive, size_t stride, int most, int maxHealth, const FightPolicy& policy) {
+		for (int pot = 1; pot <= most; ++pot) {
+			for (int hp = 1; hp < maxHealth; ++hp) {
+				double& mass = alive[static_cast<size_t>(pot) * stride + static_cast<size_t>(hp)];
+				if (mass == 0.0 || policy.choose(hp, maxHealth, pot) != ACT_POTION) continue;
+				alive[static_cast<size_t>(pot - 1) * stride + static_cast<size_t>(min(maxHealth, hp + maxHealth / 2))] += mass;
+				mass = 0.0;
+			}
+		}
+	}
+
+	// The enemy upgrade's 3 points in proportion to the (health, defense, strength) weights, the odd points going
+	// to the largest remainders
+	static void splitPoints(const double weights[3], int points[3]) {
+		double sum = weights[0] + weights[1] + weights[2];
+		double remainder[3];
+		int given = 0;
+		for (int i = 0; i < 3; ++i) {
+			double share = 3.0 * weights[i] / sum;
+			points[i] = static_cast<int>(share);
+			remainder[i] = share - points[i];
+			given += points[i];
+		}
+		for (; given < 3; ++given) {
+			int top = 0;
+			for (int i = 1; i < 3; ++i) if (remainder[i] > remainder[top]) top = i;
+			points[top]++;
+			remainder[top] = -1.0;
+		}
+	}
+};
+
+// Levelling system: upgrade screen + per-stat cost escalation + enemy difficulty wrapper
+class Levelling {
+	int upHealth = 0;
+	int upDefense = 0;
+	int upStrength = 0;
+
+	// NEW: track per-session purchases to bias enemy upgrades
+	int boughtHealthThis = 0;
+	int boughtDefenseThis = 0;
+	int boughtStrengthThis = 0;
+
+
+public:
+	Levelling() = default;
+
+	// For restores: every purchase count in [0, limit]
+	bool countersWithin(int limit) const {
+		for (int n : { upHealth, upDefense, upStrength, boughtHealthThis, boughtDefenseThis, boughtStrengthThis }) {
+			if (n < 0 || n > limit) return false;
+		}
+		return true;
+	}
+
+	// Current shop prices: 1 + number of prior upgrades for that stat
+	int healthCost() const { return 1 + upHealth; }
+	int defenseCost() const { return 1 + upDefense; }
+	int strengthCost() const { return 1 + upStrength; }
+	static int potionCost() { return 2; }
+	static const int PLAN_LEVELS = 3; // auto-buy horizon
+
+	// Wrapper to centralize difficulty increase as requested.
+	template<typename TEnemy>
+	void enemyDifficultyIncrease(TEnemy& enemy, Session& session) {
+		// Bias weights based on this session's player purchases:
+		// - Player Strength -> Enemy Defense gets +5% per purchase
+		// - Player Defense  -> Enemy Health  gets +5% per purchase
+		// - Player Health   -> Enemy Strength gets +5% per purchase
+		double wH = 1.0 + 0.25 * static_cast<double>(boughtDefenseThis);
+		double wD = 1.0 + 0.25 * static_cast<double>(boughtStrengthThis);
+		double wS = 1.0 + 0.25 * static_cast<double>(boughtHealthThis);
+
+		auto chooseStat = [&](double wh, double wd, double ws) -> int {
+			double sum = wh + wd + ws;
+			if (sum <= 0.0) { return session.rng.below(3); }
+			double r = session.rng.unit() * sum;
+			if (r < wh) return 0; r -= wh;
+			if (r < wd) return 1;
+			return 2;
+		};
+
+		// Spend 3 points using the biased distribution
+		int dH = 0, dD = 0, dS = 0;
+		for (int i = 0; i < 3; ++i) {
+			switch (chooseStat(wH, wD, wS)) {
+				case 0: ++dH; break;
+				case 1: ++dD; break;
+				default: ++dS; break;
+			}
+		}
+
+		// Apply to enemy and keep "last delta" for messaging
+		enemy.applyUpgrades(dH, dD, dS);
+
+		// Build a message listing only the stats that actually increased
+		std::string msg;
+		if (dH > 0) msg += "- The enemies are looking healthier! \n";
+		if (dD > 0) msg += "- The enemies are looking tougher! \n";
+		if (dS > 0) msg += "- The enemies are looking stronger! \n";
+
+		Combat modal(session);
+		modal.OpenModal("Enemy Difficulty Increased", msg.c_str());
+
+		// Reset session counts after use (safety; next Open() will reset them too)
+		boughtHealthThis = boughtDefenseThis = boughtStrengthThis = 0;
+	}
+
+	// One shop purchase by its menu key ('1'-'4'); false (with the reason in msg) if it can't be bought
+	bool buy(int key, Player& player, int& gold, std::string& msg) {
+		// Compute costs each time
+		int cH = 1 + upHealth;
+		int cD = 1 + upDefense;
+		int cS = 1 + upStrength;
+
+		switch (key) {
+			case '1':
+				if (gold >= cH) {
+					gold -= cH;
+					upHealth += 1;
+					boughtHealthThis += 1; // track this session
+					player.setMaxHealth(player.getMaxHealth() + 2);
+					player.setCurrentHealth(player.getCurrentHealth() + 2);
+					msg = "Purchased +2 Max Health.";
+					return true;
+				}
+				msg = "Not enough gold for +2 Max Health.";
+				return false;
+			case '2':
+				if (gold >= cD) {
+					gold -= cD;
+					upDefense++;
+					boughtDefenseThis += 1; // track this session
+					player.setDefense(player.getDefense() + 1);
+					msg = "Purchased +1 Defense.";
+					return true;
+				}
+				msg = "Not enough gold for +1 Defense.";
+				return false;
+			case '3':
+				if (gold >= cS) {
+					gold -= cS;
+					upStrength++;
+					boughtStrengthThis += 1; // track this session
+					player.setStrength(player.getStrength() + 1);
+					msg = "Purchased +1 Strength.";
+					return true;
+				}
+				msg = "Not enough gold for +1 Strength.";
+				return false;
+			case '4':
+				if (gold >= potionCost()) {
+					gold -= potionCost();
+					player.addPotions(1);
+					msg = "You gained a health potion!";
+					return true;
+				}
+				msg = "Not enough gold for Healing Potion.";
+				return false;
+			default:
+				return false;
+		}
+	}
+
+	// Best purchases for the next PLAN_LEVELS levels with the gold in hand (see PurchasePlanner)
+	PurchasePlanner::Plan plan(const Player& player, int gold, const Enemy& enemy, int fightsPerLevel, const FightPolicy& style) const {
+		PurchasePlanner::Request r;
+		r.gold = gold;
+		r.health = player.getCurrentHealth();
+		r.maxHealth = player.getMaxHealth();
+		r.defense = player.getDefense();
+		r.strength = player.getStrength();
+		r.potions = player.getPotions();
+		r.upHealth = upHealth;
+		r.upStrength = upStrength;
+		r.potionCost = potionCost();
+		r.boughtHealth = boughtHealthThis;
+		r.boughtDefense = boughtDefenseThis;
+		r.boughtStrength = boughtStrengthThis;
+		r.enemyHealth = enemy.getMaxHealth();
+		r.enemyDefense = enemy.getDefense();
+		r.enemyStrength = enemy.getStrength();
+		r.fightsPerLevel = max(1, fightsPerLevel);
+		r.levels = PLAN_LEVELS;
+		r.policy = style;
+		return PurchasePlanner::best(r);
+	}
+
+	// The auto-buy key: make the planned purchases and describe them
+	std::string autoBuy(Player& player, int& gold, const Enemy& enemy, int fightsPerLevel, const FightPolicy& style) {
+		PurchasePlanner::Plan p = plan(player, gold, enemy, fightsPerLevel, style);
+		std::string ignored;
+		for (int i = 0; i < p.strength; ++i) buy('3', player, gold, ignored);
+		for (int i = 0; i < p.health; ++i) buy('1', player, gold, ignored);
+		for (int i = 0; i < p.potions; ++i) buy('4', player, gold, ignored);
+		if (p.strength + p.health + p.potions == 0) return "Auto-buy: nothing worth buying right now.";
+		std::string msg = "Auto-buy:";
+		if (p.health) msg += formatText(" +%d Max Health", 2 * p.health);
+		if (p.strength) msg += formatText(" +%d Strength", p.strength);
+		if (p.potions) msg += formatText(p.potions == 1 ? " +%d potion" : " +%d potions", p.potions);
+		return msg;
+	}
+
+	// Modal upgrade screen. Appears at the start of each level after gold is awarded.
+	// The enemy baseline, expected fights per level and the player's fighting style feed the auto-buy planner.
+	void Open(Player& player, int& gold, const Enemy& enemy, int fightsPerLevel, const FightPolicy& style, Session& session) {
+		TRACE_SCOPE("Levelling::Open");
+		// Reset per-session purchase tracking
+		boughtHealthThis = boughtDefenseThis = boughtStrengthThis = 0;
+
+		bool done = false;
+		std::string lastMsg;
+
+		auto render = [&]() {
+			TextScreen& screen = TextScreen::frame();
+			screen.begin();
+			screen.openPanel("Leveling");
+
+			// Current gold
+			screen.centeredf("Gold: %d", gold);
+			screen.blank();
+
+			// Current stats
+			screen.centered("Current Stats:");
+			screen.centeredf("- Current Health: %d/%d", player.getCurrentHealth(), player.getMaxHealth());
+			screen.centeredf("- Defense:    %d", player.getDefense());
+			screen.centeredf("- Strength:   %d", player.getStrength());
+			screen.centeredf("- Potions:    %d", player.getPotions());
+			screen.blank();
+
+			// Costs: cost = 1 + number of prior upgrades for that stat
+			screen.option('1', "+2 Max Health  (Cost: %d)", 1 + upHealth);
+			screen.option('2', "+1 Defense     (Cost: %d)", 1 + upDefense);
+			screen.option('3', "+1 Strength    (Cost: %d)", 1 + upStrength);
+			screen.option('4', "Healing Potion (Cost: %d)", potionCost());
+			screen.option('5', "Auto-buy for the next %d levels", PLAN_LEVELS);
+			// The planner plays the fights the way `style` does and never buys Defense (see PurchasePlanner)
+			if (style.kind == FightPolicy::CAUTIOUS) {
+				screen.centeredf("(assumes you drink a potion below %d%% health and run below %d%%; skips Defense)", style.healBelowPercent,
+				                 style.runBelowPercent);
+			}
+			else {
+				screen.centered("(assumes you always attack; skips Defense)");
+			}
+			screen.blank();
+
+			if (!lastMsg.empty()) {
+				screen.centered(lastMsg);
+				screen.blank();
+			}
+
+			screen.centered("[Enter]/[Esc]/[Space] to start the next level");
+			screen.closePanel();
+			screen.present();
+		};
+
+		while (!done) {
+			if (!session.headless) render();
+
+			// Input
+			int ch = session.readKey(KEY_SHOP);
+			if (ch == 27 || ch == 13 || ch == ' ') {
+				done = true;
+				break;
+			}
+
+			if (ch == '5') lastMsg = autoBuy(player, gold, enemy, fightsPerLevel, style);
+			else if (ch >= '1' && ch <= '4') buy(ch, player, gold, lastMsg);
+			else lastMsg = "Press [1]-[5] to buy, or [Enter]/[Esc]/[Space] to start.";
+			session.drainKeys();
+		}
+
+		session.drainKeys();
+	}
+};
+
+// NEW: Gold class to place 'G' at centers of boxes with exactly one corridor
+class Gold {
+	vector<pair<int,int>> positions;
+
+	static int countCorridorOpenings(const Box& b, const TileGrid& grid) {
+		int x0 = b.x();
+		int y0 = b.y();
+		int x1 = x0 + b.width() - 1;
+		int y1 = y0 + b.height() - 1;
+
+		// Top and bottom edges, a word at a time
+		int count = grid.countFloor(y0, x0, x1) + grid.countFloor(y1, x0, x1);
+		// Left and right edges (exclude corners to avoid double counting)
+		for (int y = y0 + 1; y <= y1 - 1; ++y) {
+			if (grid.inBounds(x0, y) && grid.isFloor(x0, y)) count++;
+			if (grid.inBounds(x1, y) && grid.isFloor(x1, y)) count++;
+		}
+		return count;
+	}
+
+public:
+	void clear() { positions.clear(); }
+	const vector<pair<int,int>>& all() const { return positions; }
+
+	// Place 'G' at centers of boxes that have exactly one corridor opening.
+	// Avoid placing on the player's current tile or the exit tile.
+	void placeForDeadEnds(const pmr::vector<Box>& boxes,
+	                      const TileGrid& grid,
+	                      const Exit& exitTile,
+	                      int avoidX, int avoidY)
+	{
+		positions.clear();
+		int h = grid.height();
+		int w = grid.width();
+
+		for (const auto& b : boxes) {
+			int openings = countCorridorOpenings(b, grid);
+			if (openings == 1) {
+				int cx = b.x() + b.width() / 2;
+				int cy = b.y() + b.height() / 2;
+				if (cx < 0 || cy < 0 || cx >= w || cy >= h) continue;
+				if (grid[cy][cx] != TILE_FLOOR) continue; // center should be floor
+				if (exitTile.isAt(cx, cy)) continue;
+				if (cx == avoidX && cy == avoidY) continue;
+				positions.emplace_back(cx, cy);
+			}
+		}
+	}
+
+	bool isAt(int x, int y) const {
+		for (const auto& p : positions) {
+			if (p.first == x && p.second == y) return true;
+		}
+		return false;
+	}
+
+	void save(SaveWriter& out) const {
+		out.put(static_cast<uint32_t>(positions.size()));
+		for (const auto& p : positions) {
+			out.put(p.first);
+			out.put(p.second);
+		}
+	}
+
+	bool load(SaveReader& in) {
+		uint32_t n = 0;
+		if (!in.get(n) || n > 1u << 16) return false;
+		positions.resize(n);
+		for (auto& p : positions) {
+			if (!in.get(p.first) || !in.get(p.second)) return false;
+		}
+		return true;
+	}
+
+	// NEW: Try to pick up gold at a position. Returns true if there was gold and it was removed.
+	bool tryPickup(int x, int y) {
+		for (size_t i = 0; i < positions.size(); ++i) {
+			if (positions[i].first == x && positions[i].second == y) {
+				positions.erase(positions.begin() + static_cast<long long>(i));
+				return true;
+			}
+		}
+		return false;
+	}
+};
+
+// Box placement by binary space partitioning. The placement area (the bounds Box::placeRandom uses) is cut into
+// exactly `count` leaves and one box of random size goes at a random spot in each. Every leaf keeps a SEPARATION
+// strip free along its right and bottom edges, so boxes in different leaves are always far enough apart for
+// Box::intersects with a gap of 2, and no overlap test is needed. A leaf is at least a minimum box plus that strip,
+// so the area holds at most cols x rows leaves (cols = whole minimum leaves across, rows down); the cuts are chosen
+// so both sides can hold their share, which always works when count fits. Runs in O(count).
+class BoxPlacer {
+public:
+	static const int SEPARATION = 5; // Box::intersects(other, 2) needs 5 clear columns one way round
+
+	struct Limits {
+		int minW, maxW, minH, maxH;
+	};
+
+	// Most boxes the area can take this way
+	static int capacity(int areaWidth, int areaHeight, const Limits& lim) {
+		return cols(areaWidth, lim) * rows(areaHeight, lim);
+	}
+
+	// Places min(count, capacity) boxes into out; returns how many
+	static int place(int areaWidth, int areaHeight, int count, const Limits& lim, Rng& rng, pmr::vector<Box>& out) {
+		out.clear();
+		count = min(count, capacity(areaWidth, areaHeight, lim));
+		if (count <= 0) return 0;
+		out.reserve(static_cast<size_t>(count));
+		// Boxes may start at x 2 and y 1 and must end 2 columns / 1 row before the edge (see Box::placeRandom);
+		// the last leaf's strip may hang over that edge
+		split(2, 1, areaWidth - 4 + SEPARATION, areaHeight - 2 + SEPARATION, count, lim, rng, out);
+		return count;
+	}
+
+private:
+	static int cols(int areaWidth, const Limits& lim) { return max(0, areaWidth - 4 + SEPARATION) / (lim.minW + SEPARATION); }
+	static int rows(int areaHeight, const Limits& lim) { return max(0, areaHeight - 2 + SEPARATION) / (lim.minH + SEPARATION); }
+
+	static void split(int x, int y, int w, int h, int count, const Limits& lim, Rng& rng, pmr::vector<Box>& out) {
+		const int leafW = lim.minW + SEPARATION, leafH = lim.minH + SEPARATION;
+		if (count == 1) {
+			int boxW = lim.minW + rng.below(max(1, min(lim.maxW, w - SEPARATION) - lim.minW + 1));
+			int boxH = lim.minH + rng.below(max(1, min(lim.maxH, h - SEPARATION) - lim.minH + 1));
+			Box b(boxW, boxH);
+			b.placeAt(x + rng.below(w - SEPARATION - boxW + 1), y + rng.below(h - SEPARATION - boxH + 1));
+			out.push_back(b);
+			return;
+		}
+
+		int c = w / leafW, r = h / leafH;
+		// Cut across the longer side when both can be cut
+		bool cutX = r < 2 || (c >= 2 && rng.below(w + h) < w);
+		int across = cutX ? c : r;   // leaves that fit along the cut axis
+		int along = cutX ? r : c;    // and per strip of the other axis
+		int leaf = cutX ? leafW : leafH;
+		int span = cutX ? w : h;
+
+		// First side gets k of the whole strips; its box count is proportional, clamped so both sides fit theirs
+		int k = 1 + rng.below(across - 1);
+		int first = static_cast<int>(static_cast<long long>(count) * k / across);
+		first = max(first, max(1, count - (across - k) * along));
+		first = min(first, min(count - 1, k * along));
+		int cut = k * leaf + rng.below(span - across * leaf + 1);
+
+		if (cutX) {
+			split(x, y, cut, h, first, lim, rng, out);
+			split(x + cut, y, w - cut, h, count - first, lim, rng, out);
+		}
+		else {
+			split(x, y, w, cut, first, lim, rng, out);
+			split(x, y + cut, w, h - cut, count - first, lim, rng, out);
+		}
+	}
+};
+
+// Which boxes get corridors. Candidate edges are the Delaunay triangulation of the box centers (Bowyer-Watson,
+// inserting points in x order and retiring triangles whose circumcircle lies wholly to the left, so the work per
+// point stays near-constant in practice), which always contains the Euclidean minimum spanning tree plus the short
+// edges that close loops. Setup walks them shortest first: Kruskal over a Forest gives the tree, leftover edges
+// add loops.
+class RoomGraph {
+public:
+	struct Edge {
+		int a, b;
+		long long d2; // squared length
+		bool operator<(const Edge& o) const { return d2 != o.d2 ? d2 < o.d2 : (a != o.a ? a < o.a : b < o.b); }
+	};
+
+	// Union-find over the boxes
+	class Forest {
+		pmr::vector<int> parent;
+		int sets;
+	public:
+		explicit Forest(size_t n, pmr::memory_resource* mem = pmr::get_default_resource())
+			: parent(n, mem), sets(static_cast<int>(n)) {
+			for (size_t i = 0; i < n; ++i) parent[i] = static_cast<int>(i);
+		}
+		int find(int v) {
+			while (parent[v] != v) v = parent[v] = parent[parent[v]];
+			return v;
+		}
+		bool unite(int a, int b) {
+			a = find(a);
+			b = find(b);
+			if (a == b) return false;
+			parent[b] = a;
+			sets--;
+			return true;
+		}
+		int components() const { return sets; }
+	};
+
+	// Delaunay edges of the points, sorted shortest first. The result and the working lists come from mem.
+	static pmr::vector<Edge> delaunay(const pmr::vector<pair<int, int>>& pts,
+	                                  pmr::memory_resource* mem = pmr::get_default_resource()) {
+		int n = static_cast<int>(pts.size());
+		pmr::vector<Edge> edges(mem);
+		if (n < 2) return edges;
+		if (n == 2) {
+			edges.push_back(makeEdge(pts, 0, 1));
+			return edges;
+		}
+
+		// Points plus a super triangle (indices n..n+2) that contains them all
+		pmr::vector<double> px(n + 3, mem), py(n + 3, mem);
+		double minX = pts[0].first, maxX = minX, minY = pts[0].second, maxY = minY;
+		for (int i = 0; i < n; ++i) {
+			px[i] = pts[i].first;
+			py[i] = pts[i].second;
+			minX = min(minX, px[i]); maxX = max(maxX, px[i]);
+			minY = min(minY, py[i]); maxY = max(maxY, py[i]);
+		}
+		double span = max(maxX - minX, maxY - minY) + 1.0;
+		double midX = (minX + maxX) / 2, midY = (minY + maxY) / 2;
+		px[n] = midX - 20 * span; py[n] = midY - span;
+		px[n + 1] = midX; py[n + 1] = midY + 20 * span;
+		px[n + 2] = midX + 20 * span; py[n + 2] = midY - span;
+
+		pmr::vector<int> order(n, mem);
+		for (int i = 0; i < n; ++i) order[i] = i;
+		sort(order.begin(), order.end(), [&](int a, int b) { return px[a] != px[b] ? px[a] < px[b] : py[a] < py[b]; });
+
+		pmr::vector<Triangle> open(mem), done(mem);
+		open.push_back(triangle(px, py, n, n + 1, n + 2));
+		pmr::vector<pair<int, int>> hole(mem);
+		for (int p : order) {
+			hole.clear();
+			for (size_t t = 0; t < open.size();) {
+				const Triangle& tri = open[t];
+				double dx = px[p] - tri.cx, dy = py[p] - tri.cy;
+				if (dx > 0.0 && dx * dx > tri.r2) {
+					// Points come in x order, so no later point can fall in this circumcircle
+					done.push_back(tri);
+				}
+				else if (dx * dx + dy * dy <= tri.r2) {
+					hole.emplace_back(min(tri.a, tri.b), max(tri.a, tri.b));
+					hole.emplace_back(min(tri.b, tri.c), max(tri.b, tri.c));
+					hole.emplace_back(min(tri.a, tri.c), max(tri.a, tri.c));
+				}
+				else {
+					++t;
+					continue;
+				}
+				open[t] = open.back();
+				open.pop_back();
+			}
+			// The hole's boundary is the edges that belong to exactly one removed triangle
+			sort(hole.begin(), hole.end());
+			for (size_t i = 0; i < hole.size();) {
+				size_t j = i + 1;
+				while (j < hole.size() && hole[j] == hole[i]) ++j;
+				if (j == i + 1) open.push_back(triangle(px, py, hole[i].first, hole[i].second, p));
+				i = j;
+			}
+		}
+		done.insert(done.end(), open.begin(), open.end());
+
+		for (const Triangle& t : done) {
+			int v[3] = { t.a, t.b, t.c };
+			for (int k = 0; k < 3; ++k) {
+				int a = v[k], b = v[(k + 1) % 3];
+				if (a < n && b < n) edges.push_back(makeEdge(pts, min(a, b), max(a, b)));
+			}
+		}
+		sort(edges.begin(), edges.end());
+		edges.erase(unique(edges.begin(), edges.end(), [](const Edge& x, const Edge& y) { return x.a == y.a && x.b == y.b; }),
+		            edges.end());
+		return edges;
+	}
+
+	// Every pair, sorted shortest first; the fallback when corridors can't follow the triangulation
+	static pmr::vector<Edge> allPairs(const pmr::vector<pair<int, int>>& pts,
+	                                  pmr::memory_resource* mem = pmr::get_default_resource()) {
+		pmr::vector<Edge> edges(mem);
+		int n = static_cast<int>(pts.size());
+		edges.reserve(static_cast<size_t>(n) * static_cast<size_t>(max(0, n - 1)) / 2);
+		for (int a = 0; a < n; ++a) {
+			for (int b = a + 1; b < n; ++b) edges.push_back(makeEdge(pts, a, b));
+		}
+		sort(edges.begin(), edges.end());
+		return edges;
+	}
+
+	// Whether b is at most maxHops corridors away from a
+	static bool withinHops(const pmr::vector<pmr::vector<int>>& adj, int a, int b, int maxHops) {
+		if (a == b) return true;
+		if (maxHops <= 0) return false;
+		for (int v : adj[static_cast<size_t>(a)]) {
+			if (withinHops(adj, v, b, maxHops - 1)) return true;
+		}
+		return false;
+	}
+
+private:
+	struct Triangle {
+		int a, b, c;
+		double cx, cy, r2; // circumcircle
+	};
+
+	static Edge makeEdge(const pmr::vector<pair<int, int>>& pts, int a, int b) {
+		long long dx = pts[static_cast<size_t>(a)].first - pts[static_cast<size_t>(b)].first;
+		long long dy = pts[static_cast<size_t>(a)].second - pts[static_cast<size_t>(b)].second;
+		return { a, b, dx * dx + dy * dy };
+	}
+
+	static Triangle triangle(const pmr::vector<double>& px, const pmr::vector<double>& py, int a, int b, int c) {
+		Triangle t = { a, b, c, 0.0, 0.0, 0.0 };
+		double ax = px[a], ay = py[a], bx = px[b], by = py[b], cx = px[c], cy = py[c];
+		double d = 2.0 * (ax * (by - cy) + bx * (cy - ay) + cx * (ay - by));
+		if (fabs(d) < 1e-12) {
+			// Collinear: an unbounded circle, so the triangle is replaced by the next point that sees it
+			t.cx = (ax + bx + cx) / 3.0;
+			t.cy = (ay + by + cy) / 3.0;
+			t.r2 = 1e300;
+			return t;
+		}
+		double a2 = ax * ax + ay * ay, b2 = bx * bx + by * by, c2 = cx * cx + cy * cy;
+		t.cx = (a2 * (by - cy) + b2 * (cy - ay) + c2 * (ay - by)) / d;
+		t.cy = (a2 * (cx - bx) + b2 * (ax - cx) + c2 * (bx - ax)) / d;
+		t.r2 = (ax - t.cx) * (ax - t.cx) + (ay - t.cy) * (ay - t.cy) + 1e-9;
+		return t;
+	}
+};
+
+// Checks a generated level the way a player would find it: flood-fills the floor from the player's start and
+// requires every target (exit, gold, enemy spawns) to be reached, every door to be a single tile in a box wall and
+// every corridor floor tile to be fenced off from bare rock by walls. The map is held as one bit per tile in
+// 64-tile words, so the fill grows a whole row per step (log-step shifts along the row, then a sweep down and back
+// up the rows until nothing changes). Scratch buffers are reused, so checking a level doesn't allocate once warm.
+class LevelValidator {
+public:
+	enum Failure : unsigned {
+		NO_START = 1u << 0,           // the player doesn't stand on floor
+		UNREACHABLE_EXIT = 1u << 1,
+		UNREACHABLE_GOLD = 1u << 2,
+		UNREACHABLE_ENEMY = 1u << 3,
+		WIDE_DOOR = 1u << 4,          // two wall tiles of a box opened side by side, or a corner opened
+		UNPADDED_CORRIDOR = 1u << 5   // corridor floor touching rock
+	};
+	static const int FAILURE_KINDS = 6;
+
+	static const char* failureName(int bit) {
+		static const char* names[FAILURE_KINDS] = { "no start", "exit unreachable", "gold unreachable", "enemy unreachable",
+		                                            "wide door", "unpadded corridor" };
+		return bit >= 0 && bit < FAILURE_KINDS ? names[bit] : "?";
+	}
+
+	// Returns the Failure bits; 0 is a valid level
+	unsigned check(const TileGrid& grid, const pmr::vector<Box>& boxes, pair<int, int> start, pair<int, int> exit,
+	               const vector<pair<int, int>>& gold, const vector<pair<int, int>>& enemies) {
+		load(grid);
+		unsigned failures = 0;
+
+		if (!test(floor, start.first, start.second)) failures |= NO_START;
+		else fill(start.first, start.second);
+		if (!test(reach, exit.first, exit.second)) failures |= UNREACHABLE_EXIT;
+		for (const auto& g : gold) if (!test(reach, g.first, g.second)) { failures |= UNREACHABLE_GOLD; break; }
+		for (const auto& e : enemies) if (!test(reach, e.first, e.second)) { failures |= UNREACHABLE_ENEMY; break; }
+
+		for (const Box& b : boxes) {
+			if (!singleDoors(b)) { failures |= WIDE_DOOR; break; }
+		}
+		if (!corridorsPadded()) failures |= UNPADDED_CORRIDOR;
+		return failures;
+	}
+
+	// Setup's own check on a fresh layout: a fill from the first box's centre must reach every box's centre
+	bool boxesConnected(const TileGrid& grid, const pmr::vector<Box>& boxes) {
+		if (boxes.empty()) return true;
+		load(grid);
+		const Box& first = boxes.front();
+		int sx = first.x() + first.width() / 2, sy = first.y() + first.height() / 2;
+		if (!test(floor, sx, sy)) return false;
+		fill(sx, sy);
+		for (const Box& b : boxes) {
+			if (!test(reach, b.x() + b.width() / 2, b.y() + b.height() / 2)) return false;
+		}
+		return true;
+	}
+
+private:
+	int w = 0, h = 0, stride = 0;  // stride: 64-tile words per row
+	vector<uint64_t> floor, rock, corridor, reach;
+	vector<uint64_t> gen, pro, tmp, left, right; // one row each
+
+	bool test(const vector<uint64_t>& bits, int x, int y) const {
+		if (x < 0 || y < 0 || x >= w || y >= h) return false;
+		return (bits[static_cast<size_t>(y * stride + (x >> 6))] >> (x & 63)) & 1;
+	}
+
+	void load(const TileGrid& grid) {
+		w = grid.width();
+		h = grid.height();
+		stride = (w + 63) >> 6;
+		size_t n = static_cast<size_t>(stride) * static_cast<size_t>(max(0, h));
+		floor.assign(n, 0);
+		rock.assign(n, 0);
+		corridor.assign(n, 0);
+		reach.assign(n, 0);
+		for (vector<uint64_t>* row : { &gen, &pro, &tmp, &left, &right }) row->assign(static_cast<size_t>(stride), 0);
+		for (int y = 0; y < h; ++y) {
+			for (int x0 = 0; x0 < w; x0 += 16) {
+				size_t at = static_cast<size_t>(y * stride + (x0 >> 6));
+				int bit = x0 & 63;
+				floor[at] |= grid.kindBits(x0, y, KIND_FLOOR) << bit;
+				rock[at] |= grid.kindBits(x0, y, KIND_ROCK) << bit;
+				corridor[at] |= (grid.kindBits(x0, y, KIND_FLOOR) & ~grid.interiorBits(x0, y)) << bit;
+			}
+		}
+	}
+
+	// Row shifts by s columns toward higher / lower x, carrying between the row's words
+	void shiftUp(const uint64_t* in, uint64_t* out, int s) const {
+		int words = s >> 6, bits = s & 63;
+		for (int k = stride - 1; k >= 0; --k) {
+			int from = k - words;
+			uint64_t hi = from >= 0 ? in[from] << bits : 0;
+			uint64_t lo = bits && from - 1 >= 0 ? in[from - 1] >> (64 - bits) : 0;
+			out[k] = hi | lo;
+		}
+	}
+	void shiftDown(const uint64_t* in, uint64_t* out, int s) const {
+		int words = s >> 6, bits = s & 63;
+		for (int k = 0; k < stride; ++k) {
+			int from = k + words;
+			uint64_t lo = from < stride ? in[from] >> bits : 0;
+			uint64_t hi = bits && from + 1 < stride ? in[from + 1] << (64 - bits) : 0;
+			out[k] = lo | hi;
+		}
+	}
+
+	// Grow row y of reach along its floor runs in both directions (occluded fill, doubling the step each round)
+	void fillRow(int y) {
+		uint64_t* r = &reach[static_cast<size_t>(y * stride)];
+		const uint64_t* f = &floor[static_cast<size_t>(y * stride)];
+		uint64_t* g = gen.data();
+		uint64_t* p = pro.data();
+		uint64_t* t = tmp.data();
+		for (int dir = 0; dir < 2; ++dir) {
+			for (int k = 0; k < stride; ++k) { g[k] = r[k]; p[k] = f[k]; }
+			for (int s = 1; s < w; s <<= 1) {
+				dir ? shiftDown(g, t, s) : shiftUp(g, t, s);
+				for (int k = 0; k < stride; ++k) g[k] |= p[k] & t[k];
+				dir ? shiftDown(p, t, s) : shiftUp(p, t, s);
+				for (int k = 0; k < stride; ++k) p[k] &= t[k];
+			}
+			for (int k = 0; k < stride; ++k) r[k] = g[k];
+		}
+	}
+
+	void fill(int sx, int sy) {
+		reach[static_cast<size_t>(sy * stride + (sx >> 6))] |= 1ull << (sx & 63);
+		fillRow(sy);
+		bool changed = true;
+		while (changed) {
+			changed = false;
+			for (int pass = 0; pass < 2; ++pass) {
+				for (int i = 1; i < h; ++i) {
+					int y = pass ? h - 1 - i : i;
+					int from = pass ? y + 1 : y - 1;
+					uint64_t* r = &reach[static_cast<size_t>(y * stride)];
+					const uint64_t* above = &reach[static_cast<size_t>(from * stride)];
+					const uint64_t* f = &floor[static_cast<size_t>(y * stride)];
+					bool grew = false;
+					for (int k = 0; k < stride; ++k) {
+						uint64_t add = above[k] & f[k] & ~r[k];
+						if (add) { r[k] |= add; grew = true; }
+					}
+					if (grew) {
+						fillRow(y);
+						changed = true;
+					}
+				}
+			}
+		}
+	}
+
+	// Floor tiles in a box's wall ring are its doors: no corner may be open and no two doors may touch
+	bool singleDoors(const Box& b) const {
+		int x0 = b.x(), y0 = b.y(), x1 = b.x() + b.width() - 1, y1 = b.y() + b.height() - 1;
+		if (test(floor, x0, y0) || test(floor, x1, y0) || test(floor, x0, y1) || test(floor, x1, y1)) return false;
+		for (int x = x0 + 1; x < x1 - 1; ++x) {
+			if ((test(floor, x, y0) && test(floor, x + 1, y0)) || (test(floor, x, y1) && test(floor, x + 1, y1))) return false;
+		}
+		for (int y = y0 + 1; y < y1 - 1; ++y) {
+			if ((test(floor, x0, y) && test(floor, x0, y + 1)) || (test(floor, x1, y) && test(floor, x1, y + 1))) return false;
+		}
+		return true;
+	}
+
+	// No corridor floor tile (floor outside room interiors) may have rock among its eight neighbours
+	bool corridorsPadded() {
+		uint64_t* row = gen.data();
+		uint64_t* l = left.data();
+		uint64_t* rt = right.data();
+		for (int y = 0; y < h; ++y) {
+			// Corridor tiles of rows y-1..y+1, spread one column each way: the tiles that must not be rock in row y
+			for (int k = 0; k < stride; ++k) {
+				row[k] = corridor[static_cast<size_t>(y * stride + k)];
+				if (y > 0) row[k] |= corridor[static_cast<size_t>((y - 1) * stride + k)];
+				if (y + 1 < h) row[k] |= corridor[static_cast<size_t>((y + 1) * stride + k)];
+			}
+			shiftUp(row, l, 1);
+			shiftDown(row, rt, 1);
+			for (int k = 0; k < stride; ++k) {
+				if ((row[k] | l[k] | rt[k]) & rock[static_cast<size_t>(y * stride + k)]) return false;
+			}
+		}
+		return true;
+	}
+};
+
+// Floors the player has left, each packed by Game::packFloor, most recently left last. Once the packed floors
+// pass the byte budget the least recently left are dropped; a dropped floor is generated afresh if the player ever
+// goes back to it.
+class FloorArchive {
+public:
+	static const size_t DEFAULT_BUDGET = 128 * 1024;
+
+	explicit FloorArchive(size_t budgetBytes = DEFAULT_BUDGET) : budget(budgetBytes) {}
+
+	void store(int depth, vector<char> packed) {
+		vector<char> stale;
+		take(depth, stale);
+		used += packed.size();
+		floors.push_back({ depth, move(packed) });
+		while (used > budget && !floors.empty()) {
+			used -= floors.front().packed.size();
+			floors.erase(floors.begin());
+			dropped++;
+		}
+	}
+
+	// Moves a floor out of the archive (it becomes the live one)
+	bool take(int depth, vector<char>& packed) {
+		for (size_t i = 0; i < floors.size(); ++i) {
+			if (floors[i].depth != depth) continue;
+			packed = move(floors[i].packed);
+			used -= packed.size();
+			floors.erase(floors.begin() + static_cast<ptrdiff_t>(i));
+			return true;
+		}
+		return false;
+	}
+
+	size_t size() const { return floors.size(); }
+	size_t bytes() const { return used; }
+	size_t droppedFloors() const { return dropped; }
+
+	void save(SaveWriter& out) const {
+		out.put(static_cast<uint32_t>(floors.size()));
+		for (const Floor& f : floors) {
+			out.put(f.depth);
+			out.putVec(f.packed);
+		}
+		out.put(static_cast<uint64_t>(dropped));
+	}
+
+	bool load(SaveReader& in) {
+		uint32_t n = 0;
+		if (!in.get(n) || n > 1u << 16) return false;
+		floors.assign(n, Floor());
+		used = 0;
+		for (Floor& f : floors) {
+			if (!in.get(f.depth) || !in.getVec(f.packed)) return false;
+			used += f.packed.size();
+		}
+		uint64_t d = 0;
+		if (!in.get(d)) return false;
+		dropped = static_cast<size_t>(d);
+		return true;
+	}
+
+private:
+	struct Floor {
+		int depth;
+		vector<char> packed;
+	};
+
+	vector<Floor> floors;
+	size_t used = 0;
+	size_t budget;
+	size_t dropped = 0;
+};
+
+class Game {
+	friend class AutoPlayer;
+	friend class RlEnv;
+	friend class Bench;
+
+	// A Game is cheap to copy (see fork): the tile grid (terrain plus fog), the room lists and the sleeper lists are
+	// shared copy-on-write; the rest is a few small vectors and plain values.
+	Session* session; // RNG, key routing and replay recording for this run
+	bool gameOver;
+	int width;
+	int height;
+	int boxNumber;
+	int playerX, playerY;
+	Direction dir;
+
+	// Level data (boxes, room ids, sleeper lists) comes from two arenas that take turns: a level is built in the one
+	// the level before last used, which nothing here points into any more, and one that a copy of this game still
+	// shares is left to it. A build that stopped halfway (a failed load) leaves data in both, so the next build
+	// carries on in the current arena instead of swapping. Declared ahead of the data so they outlive it.
+	static constexpr size_t LEVEL_ARENA_BYTES = 16 * 1024;
+	shared_ptr<Arena> levelArenas[2];
+	int levelSide = 0;
+	bool levelBuilt = true;
+
+	CowPtr<pmr::vector<Box>> boxes;
+	CowPtr<TileGrid> grid; // tiles, room-interior and fog bits
+
+	const int minBoxWidth = 7;
+	const int maxBoxWidth = 12;
+	const int minBoxHeight = 5;
+	const int maxBoxHeight = 8;
+
+	// corridor parameters
+	const int gapFromBox = 1;      // buffer between box wall and corridor boundary (kept moderate)
+	const int maxRoomDegree = 3;   // doors per box
+	const int extraLoopPercent = 25; // loop corridors beyond the spanning tree, as a share of the box count
+
+	// enemy chasing: how far (in steps) the shared flow field follows corridors out from the player
+	const int chaseCorridorReach = 8;
+
+	Exit exitTile;   // 'X', the stairs down
+	Exit stairsUp;   // '<' back to the floor above; none on the first floor
+
+	// Floors above and below the one being played, packed. Map sizes grow by floor from the starting size.
+	CowPtr<FloorArchive> floors;
+	int deepest = 1;
+	int battlesFought = 0; // this run, for the auto-buy planner's fights-per-level estimate
+	int startWidth, startHeight, startBoxNumber;
+
+	// CHANGED: multiple enemies (struct-of-arrays store)
+	EnemyStore enemies;
+
+	// Enemy turns: due enemies act after each player move. Enemies are grouped by room and only rooms that are
+	// discovered or hold the player are simulated: a dormant room's enemies sleep until it is revealed, and ones
+	// that have settled in a room sleep until the player enters it.
+	TurnScheduler scheduler;
+	CowPtr<pmr::vector<pmr::vector<int>>> sleepersByBox; // enemy ids asleep in each box
+	vector<uint8_t> boxDiscovered;     // any tile of the box (walls included) revealed
+	vector<int> undiscoveredBoxes;     // boxes still waiting for their reveal event
+
+	// Gold placer
+	Gold goldItems;
+
+	// Leveling
+	int level;
+	int gold;
+
+	Player player; //player stats
+	Enemy enemy; //enemy stats (baseline scaled across levels)
+	Levelling levelling; // NEW: levelling system
+
+	static constexpr int MAX_WIDTH = 109;
+	static constexpr int MAX_HEIGHT = 25;
+	static constexpr int MAX_BOXES = 14;
+	static const int DEFAULT_FOV_RADIUS = 6;
+
+	// Corridor centre lines, built in the caller's buffer. A Manhattan path between two tiles of the map has at most
+	// width + height - 1 tiles, so a corridor trial never allocates.
+	typedef FixedVector<pair<int, int>, MAX_WIDTH + MAX_HEIGHT> CorridorPath;
+
+	// Fog of war, kept in the grid's fog bits. Rooms are lit, so entering one reveals all of it once (roomLit); from
+	// corridors and doorways the player sees by shadowcasting, at most once per tile since the map doesn't change
+	// within a level (fovCast).
+	CowPtr<FogMask> fovCast;
+	vector<uint8_t> roomLit;
+	int fovRadius = DEFAULT_FOV_RADIUS;
+
+	const Enemy* activeFoe = nullptr; // enemy in the battle currently open, for automatic players
+
+	bool restored = false;               // state came from a snapshot, so Run() skips Setup()
+	int boxesDropped = 0;                // boxes the last Setup went without because no layout with them connected
+	string savePath = "savegame.c3s";    // where K saves the run
+	FightPolicy playStyle = { FightPolicy::CAUTIOUS }; // how the player fights, for the auto-buy planner
+
+	// Room-id layer aligned with grid (row-major), rebuilt after each generation
+	CowPtr<pmr::vector<uint16_t>> roomIds;
+
+	// Per-thread scratch rebuilt before every use, so copies of a game don't carry (or copy) them
+	static FlowField& chaseField() {
+		static thread_local FlowField field; // chase distances from the player, rebuilt each player move
+		return field;
+	}
+	static vector<uint8_t>& enemyMask() {
+		static thread_local vector<uint8_t> mask; // per-frame enemy occupancy used by Draw
+		return mask;
+	}
+	static vector<pair<int, int>>& validatorSpawns() {
+		static thread_local vector<pair<int, int>> spawns; // enemy positions handed to validateLevel
+		return spawns;
+	}
+	static MarkGrid& corridorMarks() {
+		static thread_local MarkGrid marks; // corridor centre tiles, for writeCentersAsCorridor
+		return marks;
+	}
+	static LevelValidator& levelValidator() {
+		static thread_local LevelValidator validator;
+		return validator;
+	}
+	static Arena& generationArena() {
+		static thread_local Arena arena(16 * 1024); // Setup's working lists, reset for every generation attempt
+		return arena;
+	}
+
+public:
+	Game(Session& session, int width = 59, int height = 15, int boxNumber = 4)
+		: session(&session), gameOver(false), width(width), height(height), boxNumber(boxNumber), playerX(0), playerY(0), dir(STOP),
+		  startWidth(width), startHeight(height), startBoxNumber(boxNumber), level(1), gold(0) {
+		grid.assign(TileGrid(width, height));
+		floors.assign(FloorArchive());
+	}
+
+	void clearGrid() {
+		// All rock and unrevealed at the current width/height (handles dynamic resize between levels). A grid still
+		// shared with a copy of this game is replaced rather than copied just to be blanked.
+		if (grid.shared()) grid.assign(TileGrid(width, height));
+		else grid.edit().reset(width, height);
+	}
+
+	// Start building a level's data; returns the arena it goes in
+	pmr::memory_resource* beginLevelData() {
+		if (levelBuilt) {
+			levelSide ^= 1;
+			shared_ptr<Arena>& arena = levelArenas[levelSide];
+			if (arena && arena.use_count() == 1) arena->reset();
+			else arena = make_shared<Arena>(LEVEL_ARENA_BYTES);
+			levelBuilt = false;
+		}
+		return levelArenas[levelSide]->get();
+	}
+
+	// Every arena-backed part of the level has been replaced
+	void endLevelData() { levelBuilt = true; }
+
+	// Label every tile with the box it belongs to (interior or wall ring) or as corridor floor.
+	void buildRoomIds() {
+		pmr::vector<uint16_t> ids(static_cast<size_t>(width) * static_cast<size_t>(height), ROOM_NONE, beginLevelData());
+		for (size_t i = 0; i < boxes.size(); ++i) {
+			const Box& b = boxes[i];
+			uint16_t id = static_cast<uint16_t>(i & ROOM_INDEX_MASK);
+			for (int y = max(0, b.y()); y < min(height, b.y() + b.height()); ++y) {
+				for (int x = max(0, b.x()); x < min(width, b.x() + b.width()); ++x) {
+					uint16_t kind = b.interiorContains(x, y) ? ROOM_INTERIOR : ROOM_WALL;
+					ids[static_cast<size_t>(y * width + x)] = static_cast<uint16_t>((kind << ROOM_KIND_SHIFT) | id);
+				}
+			}
+		}
+		for (int y = 0; y < height; ++y) {
+			for (int x = 0; x < width; ++x) {
+				uint16_t& r = ids[static_cast<size_t>(y * width + x)];
+				if (r == ROOM_NONE && grid[y][x] == TILE_FLOOR) r = static_cast<uint16_t>(ROOM_CORRIDOR << ROOM_KIND_SHIFT);
+			}
+		}
+		roomIds.assign(move(ids));
+	}
+
+	RoomKind roomKindAt(int x, int y) const {
+		if (x < 0 || x >= width || y < 0 || y >= height || roomIds.empty()) return ROOM_NONE;
+		return static_cast<RoomKind>(roomIds[static_cast<size_t>(y * width + x)] >> ROOM_KIND_SHIFT);
+	}
+
+	// Box whose interior or wall ring covers (x,y), or -1
+	int boxIndexAt(int x, int y) const {
+		RoomKind kind = roomKindAt(x, y);
+		if (kind != ROOM_INTERIOR && kind != ROOM_WALL) return -1;
+		return roomIds[static_cast<size_t>(y * width + x)] & ROOM_INDEX_MASK;
+	}
+
+	int boxIndexForInterior(int x, int y) const {
+		if (x < 0 || x >= width || y < 0 || y >= height || !grid->interior(x, y)) return -1;
+		return roomIds[static_cast<size_t>(y * width + x)] & ROOM_INDEX_MASK;
+	}
+
+	void revealBox(const Box& box) {
+		grid.edit().revealRect(box.x(), box.y(), box.x() + box.width() - 1, box.y() + box.height() - 1);
+	}
+
+	void revealCurrentSection() {
+		int px = player.getX();
+		int py = player.getY();
+		if (px < 0 || px >= width || py < 0 || py >= height) return;
+		int boxIndex = boxIndexForInterior(px, py);
+		if (boxIndex >= 0) {
+			// Inside a room everything visible is the room itself; O(1) once it has been lit
+			if (!roomLit[static_cast<size_t>(boxIndex)]) {
+				revealBox(boxes[static_cast<size_t>(boxIndex)]);
+				roomLit[static_cast<size_t>(boxIndex)] = 1;
+				discoverRevealedBoxes();
+			}
+		} else if (grid[py][px] == TILE_FLOOR && !fovCast->test(px, py)) {
+			fovCast.edit().set(px, py);
+			FieldOfView::compute(px, py, fovRadius, grid.edit());
+			discoverRevealedBoxes();
+		}
+	}
+
+	// Past the largest map's span a wider radius sees nothing more, it only makes the shadowcast longer
+	void setFovRadius(int r) { fovRadius = min(max(1, r), MAX_WIDTH + MAX_HEIGHT); }
+
+	pair<int,int> outsideCenterFromWall(const Box& b, pair<int,int> wall, pair<int,int> target) const {
+		int wx = wall.first;
+		int wy = wall.second;
+
+		// allow immediate bends by not tying offset to corridor width
+		int maxOffset = gapFromBox;
+
+		// adaptive offset: don't place the corridor center farther than halfway
+		// along the Manhattan route from this wall to the target center.
+		int manhattanToTarget = abs(wx - target.first) + abs(wy - target.second);
+		int halfDist = max(1, manhattanToTarget / 2);
+
+		int offset = min(maxOffset, halfDist);
+
+		if (wx == b.x()) return make_pair(wx - offset, wy);
+		if (wx == b.x() + b.width() - 1) return make_pair(wx + offset, wy);
+		if (wy == b.y()) return make_pair(wx, wy - offset);
+		return make_pair(wx, wy + offset);
+	}
+
+	// Manhattan path from start to end taking the requested leg first. Every step moves, so no tile repeats and
+	// coinciding endpoints give the single tile. False when the path outgrows CorridorPath (a map past MAX_WIDTH or
+	// MAX_HEIGHT); the trial is then skipped rather than built from a truncated path.
+	bool lShapedCorridor(int sx, int sy, int ex, int ey, bool horizontalFirst, CorridorPath& outCenters) const {
+		outCenters.clear();
+		int x = sx, y = sy;
+		bool fits = outCenters.emplace_back(x, y);
+
+		if (horizontalFirst) {
+			// horizontal then vertical
+			while (fits && x != ex) { x += (ex > x) ? 1 : -1; fits = outCenters.emplace_back(x, y); }
+			while (fits && y != ey) { y += (ey > y) ? 1 : -1; fits = outCenters.emplace_back(x, y); }
+		} else {
+			// vertical then horizontal
+			while (fits && y != ey) { y += (ey > y) ? 1 : -1; fits = outCenters.emplace_back(x, y); }
+			while (fits && x != ex) { x += (ex > x) ? 1 : -1; fits = outCenters.emplace_back(x, y); }
+		}
+		return fits;
+	}
+
+	bool straightCenters(int sx, int sy, int ex, int ey, CorridorPath& outCenters) const {
+		if (sx != ex && sy != ey) return lShapedCorridor(sx, sy, ex, ey, true, outCenters);
+		return lShapedCorridor(sx, sy, ex, ey, sy == ey, outCenters);
+	}
+
+	bool pathFits(const CorridorPath& centers,
+	              size_t startBoxIdx, size_t endBoxIdx,
+	              pair<int,int> startWall, pair<int,int> endWall) const
+	{
+		TRACE_SCOPE("pathFits");
+		// Helper lambda: return true if cell (nx,ny) is considered "connected" to the start or end box
+		// i.e. either inside that box or directly adjacent (4-neighbor) to the wall cell.
+		auto isConnectedToBoxOrWall = [&](int nx, int ny, size_t boxIdx, pair<int,int> wall)->bool {
+			if (boxIdx < boxes.size() && boxes[boxIdx].contains(nx, ny)) return true;
+			// direct adjacency to the wall cell (4-neighbor)
+			if (abs(nx - wall.first) + abs(ny - wall.second) == 1) return true;
+			return false;
+		};
+
+		for (const auto& c : centers) {
+			int cx = c.first, cy = c.second;
+			for (int dy = -1; dy <= 1; dy++) {
+				for (int dx = -1; dx <= 1; ++dx) {
+					int nx = cx + dx, ny = cy + dy;
+					if (nx < 0 || nx >= width || ny < 0 || ny >= height) return false;
+					char cur = grid[ny][nx];
+
+					// Allow corridor boundary '+' to be treated like empty space for fitting a new corridor.
+					// This lets two L-legs meet where previously only padding '+' existed between them.
+					if (cur == ' ' || cur == TILE_CORRIDOR_WALL) continue;
+
+					if (make_pair(nx, ny) == startWall) continue;
+					if (make_pair(nx, ny) == endWall) continue;
+					if (startBoxIdx < boxes.size() && boxes[startBoxIdx].contains(nx, ny)) continue;
+					if (endBoxIdx < boxes.size() && boxes[endBoxIdx].contains(nx, ny)) continue;
+					if (cur == TILE_FLOOR) {
+						if (isConnectedToBoxOrWall(nx, ny, startBoxIdx, startWall)) continue;
+						if (isConnectedToBoxOrWall(nx, ny, endBoxIdx, endWall)) continue;
+					}
+					return false;
+				}
+			}
+			if (grid[cy][cx] == TILE_FLOOR) return false;
+		}
+		return true;
+	}
+
+	// Corridor writers below edit the terrain in place; they only run while a level is being generated
+	void writeCentersAsCorridor(const CorridorPath& centers) {
+		TileGrid& grid = this->grid.edit();
+		MarkGrid& centerSet = corridorMarks();
+		centerSet.clear(static_cast<size_t>(width) * static_cast<size_t>(height));
+		for (const auto &c : centers) {
+			int cx = c.first, cy = c.second;
+			if (cx >= 0 && cx < width && cy >= 0 && cy < height) {
+				if (grid[cy][cx] != TILE_BOX_WALL) grid.set(cx, cy, TILE_FLOOR);
+				centerSet.mark(static_cast<size_t>(cy * width + cx));
+			}
+		}
+		for (const auto &c : centers) {
+			int cx = c.first, cy = c.second;
+			for (int dy = -1; dy <= 1; dy++) {
+				for (int dx = -1; dx <= 1; dx++) {
+					if (dx == 0 && dy == 0) continue;
+					int nx = cx + dx, ny = cy + dy;
+					if (nx >= 0 && nx < width && ny >= 0 && ny < height) {
+						if (centerSet.marked(static_cast<size_t>(ny * width + nx))) continue;
+						if (grid[ny][nx] == ' ') grid.set(nx, ny, TILE_CORRIDOR_WALL);
+					}
+				}
+			}
+		}
+	}
+
+	// fixed: create opening but keep corridor padding by writing side walls when stepping from wall -> center
+	void createOpeningAndConnectWallToCenter(pair<int, int> wall, pair<int, int> center) {
+		TileGrid& grid = this->grid.edit();
+		int wx = wall.first, wy = wall.second;
+		// open the wall (single-tile opening)
+		if (wx >= 0 && wx < width && wy >= 0 && wy < height) {
+			if (grid[wy][wx] == TILE_BOX_WALL || grid[wy][wx] == ' ' || grid[wy][wx] == TILE_CORRIDOR_WALL) {
+				grid.set(wx, wy, TILE_FLOOR);
+			}
+		}
+
+		// Connect Manhattan-style (no diagonal stepping) from wall -> center.
 		// Move entirely along one axis, then along the other. Prefer the longer axis first.
 		int cx = wx;
 		int cy = wy;
@@ -1317,18 +4156,18 @@ public:
 		int absdy = abs(dy);
 
 		auto pad_vertical = [&](int x, int y) {
-			if (y - 1 >= 0 && grid[y - 1][x] == ' ') grid[y - 1][x] = TILE_CORRIDOR_WALL;
-			if (y + 1 < height && grid[y + 1][x] == ' ') grid[y + 1][x] = TILE_CORRIDOR_WALL;
+			if (y - 1 >= 0 && grid[y - 1][x] == ' ') grid.set(x, y - 1, TILE_CORRIDOR_WALL);
+			if (y + 1 < height && grid[y + 1][x] == ' ') grid.set(x, y + 1, TILE_CORRIDOR_WALL);
 			};
 		auto pad_horizontal = [&](int x, int y) {
-			if (x - 1 >= 0 && grid[y][x - 1] == ' ') grid[y][x - 1] = TILE_CORRIDOR_WALL;
-			if (x + 1 < width && grid[y][x + 1] == ' ') grid[y][x + 1] = TILE_CORRIDOR_WALL;
+			if (x - 1 >= 0 && grid[y][x - 1] == ' ') grid.set(x - 1, y, TILE_CORRIDOR_WALL);
+			if (x + 1 < width && grid[y][x + 1] == ' ') grid.set(x + 1, y, TILE_CORRIDOR_WALL);
 			};
 
 		// helper to set a floor cell if we're not opening a box wall
 		auto setFloorIfNotBoxWall = [&](int x, int y) {
 			if (x >= 0 && x < width && y >= 0 && y < height) {
-				if (grid[y][x] != TILE_BOX_WALL) grid[y][x] = TILE_FLOOR;
+				if (grid[y][x] != TILE_BOX_WALL) grid.set(x, y, TILE_FLOOR);
 			}
 			};
 
@@ -1367,855 +4206,2372 @@ public:
 			}
 		}
 
-		// ensure center cell floored and its side padding set
-		if (center.first >= 0 && center.first < width && center.second >= 0 && center.second < height) {
-			if (grid[center.second][center.first] != TILE_BOX_WALL) grid[center.second][center.first] = TILE_FLOOR;
-			int cx0 = center.first, cy0 = center.second;
-			if (cy0 - 1 >= 0 && grid[cy0 - 1][cx0] == ' ') grid[cy0 - 1][cx0] = TILE_CORRIDOR_WALL;
-			if (cy0 + 1 < height && grid[cy0 + 1][cx0] == ' ') grid[cy0 + 1][cx0] = TILE_CORRIDOR_WALL;
-			if (cx0 - 1 >= 0 && grid[cy0][cx0 - 1] == ' ') grid[cy0][cx0 - 1] = TILE_CORRIDOR_WALL;
-			if (cx0 + 1 < width && grid[cy0][cx0 + 1] == ' ') grid[cy0][cx0 + 1] = TILE_CORRIDOR_WALL;
+		// ensure center cell floored and its side padding set
+		if (center.first >= 0 && center.first < width && center.second >= 0 && center.second < height) {
+			if (grid[center.second][center.first] != TILE_BOX_WALL) grid.set(center.first, center.second, TILE_FLOOR);
+			int cx0 = center.first, cy0 = center.second;
+			if (cy0 - 1 >= 0 && grid[cy0 - 1][cx0] == ' ') grid.set(cx0, cy0 - 1, TILE_CORRIDOR_WALL);
+			if (cy0 + 1 < height && grid[cy0 + 1][cx0] == ' ') grid.set(cx0, cy0 + 1, TILE_CORRIDOR_WALL);
+			if (cx0 - 1 >= 0 && grid[cy0][cx0 - 1] == ' ') grid.set(cx0 - 1, cy0, TILE_CORRIDOR_WALL);
+			if (cx0 + 1 < width && grid[cy0][cx0 + 1] == ' ') grid.set(cx0 + 1, cy0, TILE_CORRIDOR_WALL);
+		}
+	}
+
+	bool isPassableCorridor(int x, int y) const {
+		if (x < 0 || x >= width || y < 0 || y >= height) return false;
+		return grid[y][x] == TILE_FLOOR;
+	}
+
+	bool tryConnectBoxes(size_t i, size_t j) {
+		TRACE_SCOPE("tryConnectBoxes");
+		if (tryStraightCorridor(i, j)) {
+			return true;
+		}
+
+		int targetJx = boxes[j].x() + boxes[j].width() / 2;
+		int targetJy = boxes[j].y() + boxes[j].height() / 2;
+		auto startWalls = boxes[i].closestEdge(targetJx, targetJy);
+
+		int targetIx = boxes[i].x() + boxes[i].width() / 2;
+		int targetIy = boxes[i].y() + boxes[i].height() / 2;
+		auto endWalls = boxes[j].closestEdge(targetIx, targetIy);
+
+		CorridorPath centers;
+
+		// Try each wall-pair and for *that* pair prefer a straight corridor first,
+		// falling back to the two L-shaped orders only when straight is not possible.
+		for (auto sWall : startWalls) {
+			for (auto eWall : endWalls) {
+				auto sCenter = outsideCenterFromWall(boxes[i], sWall, make_pair(targetJx, targetJy));
+				auto eCenter = outsideCenterFromWall(boxes[j], eWall, make_pair(targetIx, targetIy));
+
+				// skip out-of-bounds centers early
+				if (sCenter.first < 0 || sCenter.first >= width || sCenter.second < 0 || sCenter.second >= height) continue;
+				if (eCenter.first < 0 || eCenter.first >= width || eCenter.second < 0 || eCenter.second >= height) continue;
+
+				// If they are aligned, try the straight corridor first for this pair.
+				if (sCenter.second == eCenter.second || sCenter.first == eCenter.first) {
+					if (straightCenters(sCenter.first, sCenter.second, eCenter.first, eCenter.second, centers) &&
+						pathFits(centers, i, j, sWall, eWall)) {
+						writeCentersAsCorridor(centers);
+						createOpeningAndConnectWallToCenter(sWall, sCenter);
+						createOpeningAndConnectWallToCenter(eWall, eCenter);
+						return true;
+					}
+					// If straight failed for this pair, still try L-shaped orders for same pair below.
+				}
+
+				// Not aligned, or straight attempt failed  try L-shaped for this pair.
+				int horizLen = abs(sCenter.first - eCenter.first);
+				int vertLen  = abs(sCenter.second - eCenter.second);
+
+				// prefer the L-order that yields the longer initial straight leg
+				int firstOrder = (horizLen >= vertLen) ? 0 : 1;
+				int orders[2] = { firstOrder, 1 - firstOrder };
+
+				for (int k = 0; k < 2; k++) {
+					bool horizontalFirst = (orders[k] == 0);
+					if (lShapedCorridor(sCenter.first, sCenter.second, eCenter.first, eCenter.second, horizontalFirst, centers) &&
+						pathFits(centers, i, j, sWall, eWall)) {
+						writeCentersAsCorridor(centers);
+						createOpeningAndConnectWallToCenter(sWall, sCenter);
+						createOpeningAndConnectWallToCenter(eWall, eCenter);
+						return true;
+					}
+				}
+			}
+		}
+
+		return false;
+	}
+
+	bool tryStraightCorridor(size_t i, size_t j) {
+		const Box& A = boxes[i];
+		const Box& B = boxes[j];
+
+		pair<int,int> ac = make_pair(A.x() + A.width() / 2,  A.y() + A.height() / 2);
+		pair<int,int> bc = make_pair(B.x() + B.width() / 2,  B.y() + B.height() / 2);
+
+		CorridorPath centers;
+
+		// Try horizontal straight corridors (left/right facing) over the overlapping Y-span.
+		auto tryHorizontal = [&](size_t leftIdx, size_t rightIdx)->bool {
+			const Box& L = boxes[leftIdx];
+			const Box& R = boxes[rightIdx];
+			// ensure L is strictly left of R
+			if (L.x() + L.width() - 1 >= R.x()) return false;
+
+			int yLow  = max(L.y() + 1, R.y() + 1);
+			int yHigh = min(L.y() + L.height() - 2, R.y() + R.height() - 2);
+			if (yLow > yHigh) return false;
+
+			// scan the whole overlap; first valid straight path wins
+			for (int y = yLow; y <= yHigh; ++y) {
+				pair<int,int> sWall = make_pair(L.x() + L.width() - 1, y);
+				pair<int,int> eWall = make_pair(R.x(), y);
+
+				auto sCenter = outsideCenterFromWall(L, sWall, bc);
+				auto eCenter = outsideCenterFromWall(R, eWall, ac);
+
+				// bounds guard
+				if (sCenter.first < 0 || sCenter.first >= width || sCenter.second < 0 || sCenter.second >= height) continue;
+				if (eCenter.first < 0 || eCenter.first >= width || eCenter.second < 0 || eCenter.second >= height) continue;
+
+				if (straightCenters(sCenter.first, sCenter.second, eCenter.first, eCenter.second, centers) &&
+					pathFits(centers, leftIdx, rightIdx, sWall, eWall)) {
+					writeCentersAsCorridor(centers);
+					createOpeningAndConnectWallToCenter(sWall, sCenter);
+					createOpeningAndConnectWallToCenter(eWall, eCenter);
+					return true;
+				}
+			}
+			return false;
+		};
+
+		// Try vertical straight corridors (top/bottom facing) over the overlapping X-span.
+		auto tryVertical = [&](size_t topIdx, size_t bottomIdx)->bool {
+			const Box& T = boxes[topIdx];
+			const Box& D = boxes[bottomIdx];
+			// ensure T is strictly above D
+			if (T.y() + T.height() - 1 >= D.y()) return false;
+
+			int xLow  = max(T.x() + 1, D.x() + 1);
+			int xHigh = min(T.x() + T.width() - 2, D.x() + D.width() - 2);
+			if (xLow > xHigh) return false;
+
+			for (int x = xLow; x <= xHigh; ++x) {
+				pair<int,int> sWall = make_pair(x, T.y() + T.height() - 1);
+				pair<int,int> eWall = make_pair(x, D.y());
+
+				auto sCenter = outsideCenterFromWall(T, sWall, bc);
+				auto eCenter = outsideCenterFromWall(D, eWall, ac);
+
+				if (sCenter.first < 0 || sCenter.first >= width || sCenter.second < 0 || sCenter.second >= height) continue;
+				if (eCenter.first < 0 || eCenter.first >= width || eCenter.second < 0 || eCenter.second >= height) continue;
+
+				if (straightCenters(sCenter.first, sCenter.second, eCenter.first, eCenter.second, centers) &&
+					pathFits(centers, topIdx, bottomIdx, sWall, eWall)) {
+					writeCentersAsCorridor(centers);
+					createOpeningAndConnectWallToCenter(sWall, sCenter);
+					createOpeningAndConnectWallToCenter(eWall, eCenter);
+					return true;
+				}
+			}
+			return false;
+		};
+
+		// orientation checks
+		if (A.x() + A.width() - 1 < B.x())         { if (tryHorizontal(i, j)) return true; }
+		if (B.x() + B.width() - 1 < A.x())         { if (tryHorizontal(j, i)) return true; }
+		if (A.y() + A.height() - 1 < B.y())        { if (tryVertical(i, j))   return true; }
+		if (B.y() + B.height() - 1 < A.y())        { if (tryVertical(j, i))   return true; }
+
+		return false;
+	}
+
+	void Setup() {
+		TRACE_SCOPE("Setup");
+		gameOver = false;
+		dir = STOP;
+
+		// We'll try a few times to generate a layout where every box ends up with degree 1 or 2. Each run of
+		// maxGenerationAttempts failures asks for one box fewer; a single box always succeeds, so this ends.
+		const int maxGenerationAttempts = 20;
+		bool success = false;
+		int boxTarget = boxNumber;
+		pmr::memory_resource* levelMemory = beginLevelData();
+
+		for (int genAttempt = 0; !success; ++genAttempt) {
+			if (genAttempt > 0 && genAttempt % maxGenerationAttempts == 0) boxTarget = max(1, boxTarget - 1);
+			TraceScope phase("Setup.boxes");
+			// Working lists live for one attempt; the last attempt's are out of scope by here
+			Arena& scratch = generationArena();
+			scratch.reset();
+			pmr::memory_resource* mem = scratch.get();
+
+			// 1) generate non-overlapping boxes (as many as the map can hold, up to boxNumber)
+			BoxPlacer::Limits limits = { minBoxWidth, min(maxBoxWidth, width - 4), minBoxHeight, min(maxBoxHeight, height - 3) };
+			pmr::vector<Box> placed(levelMemory);
+			BoxPlacer::place(width, height, boxTarget, limits, session->rng, placed);
+			boxes.assign(std::move(placed));
+
+			if (boxes.empty()) {
+				int backupBoxWidth = min(maxBoxWidth, width - 4);
+				int backupBoxHeight = min(maxBoxHeight, height - 3);
+				Box backupBox(backupBoxWidth, backupBoxHeight);
+				backupBox.placeAt((width - backupBoxWidth) / 2, (height - backupBoxHeight) / 2);
+				boxes.edit().push_back(backupBox);
+			}
+
+			// Start with fresh grid and draw boxes
+			phase.next("Setup.draw");
+			clearGrid();
+			for (const Box& box : boxes) box.drawBox(grid.edit());
+
+			size_t n = boxes.size();
+			// If not enough boxes, mark as success (nothing to connect)
+			if (n < 2) {
+				success = true;
+				break;
+			}
+
+			// Precompute centers
+			phase.next("Setup.graph");
+			pmr::vector<pair<int,int>> centers(n, mem);
+			for (size_t i = 0; i < n; ++i)
+				centers[i] = make_pair(boxes[i].x() + boxes[i].width() / 2, boxes[i].y() + boxes[i].height() / 2);
+
+			// Corridors follow the room graph shortest edge first: a spanning tree, then a few loops. No box gets
+			// more than maxRoomDegree doors.
+			pmr::vector<RoomGraph::Edge> candidates = RoomGraph::delaunay(centers, mem);
+			RoomGraph::Forest forest(n, mem);
+			pmr::vector<int> degree(n, 0, mem);
+			pmr::vector<pmr::vector<int>> adj(n, mem);
+			auto connect = [&](const RoomGraph::Edge& e) {
+				if (degree[e.a] >= maxRoomDegree || degree[e.b] >= maxRoomDegree) return false;
+				if (!tryConnectBoxes(e.a, e.b) && !tryConnectBoxes(e.b, e.a)) return false;
+				degree[e.a]++;
+				degree[e.b]++;
+				adj[e.a].push_back(e.b);
+				adj[e.b].push_back(e.a);
+				return true;
+			};
+
+			phase.next("Setup.tree");
+			pmr::vector<RoomGraph::Edge> spare(mem);
+			for (const RoomGraph::Edge& e : candidates) {
+				if (forest.find(e.a) == forest.find(e.b)) spare.push_back(e);
+				else if (connect(e)) forest.unite(e.a, e.b);
+			}
+
+			// Connectivity repair: corridors that couldn't follow the triangulation may still join the pieces some
+			// other way, so try every pair between components, nearest first
+			phase.next("Setup.repair");
+			if (forest.components() > 1) {
+				for (const RoomGraph::Edge& e : RoomGraph::allPairs(centers, mem)) {
+					if (forest.find(e.a) != forest.find(e.b) && connect(e)) forest.unite(e.a, e.b);
+					if (forest.components() == 1) break;
+				}
+			}
+
+			// Loops: the shortest spare edges between boxes that are far apart along the tree
+			phase.next("Setup.loops");
+			int loops = static_cast<int>(n) * extraLoopPercent / 100;
+			for (const RoomGraph::Edge& e : spare) {
+				if (loops <= 0) break;
+				if (RoomGraph::withinHops(adj, e.a, e.b, 3)) continue;
+				if (connect(e)) loops--;
+			}
+
+			// Every box must be reachable; if not, the generator retries with a new layout. The forest only records
+			// the corridors that were laid, so the map itself is flood-filled too.
+			success = forest.components() == 1 && levelValidator().boxesConnected(*grid, *boxes);
+
+			// If failed this generation attempt, clear corridors and try again (next genAttempt).
+			if (!success) {
+				clearGrid(); // remove any corridors placed during failed attempt
+				// continue to next genAttempt
+			}
+		}
+
+		boxesDropped = boxNumber - boxTarget;
+		TraceScope placement("Setup.populate");
+		buildRoomIds();
+
+		// Place player in a random box center
+		int starterBox = session->rng.below(static_cast<int>(boxes.size()));
+		int px = boxes[starterBox].x() + boxes[starterBox].width() / 2;
+		int py = boxes[starterBox].y() + boxes[starterBox].height() / 2;
+		player.setPosition(px, py);
+
+		if (!isPassableCorridor(player.getX(), player.getY())) {
+			bool foundOpening = false;
+			for (int dy = 0; dy < boxes[starterBox].height() && !foundOpening; dy++) {
+				for (int dx = 0; dx < boxes[starterBox].width() && !foundOpening; dx++) {
+					int tx = boxes[starterBox].x() + dx;
+					int ty = boxes[starterBox].y() + dy;
+					if (tx >= 0 && tx < width && ty >= 0 && ty < height && isPassableCorridor(tx, ty)) {
+						player.setPosition(tx, ty);
+						foundOpening = true;
+					}
+				}
+			}
+			if (!foundOpening) {
+				for (int yy = 0; yy < height && !foundOpening; yy++)
+					for (int xx = 0; xx < width && !foundOpening; xx++)
+						if (isPassableCorridor(xx, yy)) { player.setPosition(xx, yy); foundOpening = true; }
+			}
+		}
+
+		// Place exit at the center of a different box than the player's
+		if (!boxes.empty()) {
+			int exitBoxIdx = starterBox;
+			if (boxes.size() > 1) {
+				do {
+					exitBoxIdx = session->rng.below(static_cast<int>(boxes.size()));
+				} while (exitBoxIdx == starterBox);
+			}
+			int ex = boxes[exitBoxIdx].x() + boxes[exitBoxIdx].width() / 2;
+			int ey = boxes[exitBoxIdx].y() + boxes[exitBoxIdx].height() / 2;
+			exitTile.placeAt(ex, ey);
+		}
+
+		// Below the first floor the player arrives on the stairs back up
+		stairsUp = Exit();
+		if (level > 1) stairsUp.placeAt(player.getX(), player.getY());
+
+		// Place 'G' in centers of boxes with exactly one corridor (dead-ends), avoiding player and exit tiles
+		goldItems.placeForDeadEnds(boxes, grid, exitTile, player.getX(), player.getY());
+
+		// NEW: Spawn an enemy in every box that does NOT contain Gold, Player, or Exit
+		enemies.clear();
+		scheduler.clear();
+		pmr::vector<pmr::vector<int>> sleepers(boxes.size(), levelMemory);
+		for (size_t bi = 0; bi < boxes.size(); ++bi) {
+			const Box& b = boxes[bi];
+			int cx = b.x() + b.width() / 2;
+			int cy = b.y() + b.height() / 2;
+
+			// must be a valid floor center
+			if (cy < 0 || cy >= height || cx < 0 || cx >= width) continue;
+			if (grid[cy][cx] != TILE_FLOOR) continue;
+
+			// exclude player's box center position, exit, and gold
+			if (b.contains(player.getX(), player.getY()) && (player.getX() == cx && player.getY() == cy)) continue;
+			if (exitTile.isAt(cx, cy)) continue;
+			if (goldItems.isAt(cx, cy)) continue;
+
+			// Baseline scaled stats so difficulty increases across levels
+			// Dormant until the fog setup below discovers its room
+			sleepers[bi].push_back(enemies.add(cx, cy, enemy));
 		}
+		sleepersByBox.assign(move(sleepers));
+		endLevelData();
+
+		fovCast.assign(FogMask(width, height));
+		roomLit.assign(boxes.size(), 0);
+		boxDiscovered.assign(boxes.size(), 0);
+		undiscoveredBoxes.clear();
+		for (size_t i = 0; i < boxes.size(); ++i) undiscoveredBoxes.push_back(static_cast<int>(i));
+		revealCurrentSection();
 	}
 
-	bool isPassableCorridor(int x, int y) const {
-		if (x < 0 || x >= width || y < 0 || y >= height) return false;
-		return grid[y][x] == TILE_FLOOR;
+	// Helper: any enemy at x,y
+	bool anyEnemyAt(int x, int y) const {
+		return enemies.anyAt(x, y);
 	}
 
-	bool tryConnectBoxes(size_t i, size_t j) {
-		if (tryStraightCorridor(i, j)) {
-			return true;
-		}
+	void Draw() const {
+		TRACE_SCOPE("Draw");
+		if (session->headless) return;
 
-		int targetJx = boxes[j].x() + boxes[j].width() / 2;
-		int targetJy = boxes[j].y() + boxes[j].height() / 2;
-		auto startWalls = boxes[i].closestEdge(targetJx, targetJy);
+		// One write at the top-left without clearing the screen (avoids slow system(\"cls\") and iostream flushing)
+		Terminal::instance().write(composeFrame());
+	}
 
-		int targetIx = boxes[i].x() + boxes[i].width() / 2;
-		int targetIy = boxes[i].y() + boxes[i].height() / 2;
-		auto endWalls = boxes[j].closestEdge(targetIx, targetIy);
+	// Build the entire frame in memory so Draw writes it once, avoiding excessive flushing.
+	std::string composeFrame() const {
+		std::string frame;
+		frame.reserve(static_cast<size_t>((height + 8) * (width + 4)));
 
-		vector<pair<int,int>> centers;
+		// HUD
+		string hudLeft = "Level " + to_string(level);
+		string hudMiddleLeft = "Health: " + to_string(player.getCurrentHealth()) + "/" + to_string(player.getMaxHealth());
+		string hudMiddleRight = "Potions: " + to_string(player.getPotions());
+		string hudRight = "Gold: " + to_string(gold);
+		int total = width + 2;
+		int spaces = total - static_cast<int>(hudLeft.size()) - static_cast<int>(hudRight.size()) - static_cast<int>(hudMiddleLeft.size());
+		int leftOverSpaces = (spaces / 2) - static_cast<int>(hudMiddleRight.size());
+		if (spaces < 2) spaces = 2;
+		frame += hudLeft;
+		frame.append(spaces / 2, ' ');
+		frame+= hudMiddleLeft;
+		frame.append(leftOverSpaces / 2, ' ');
+		frame += hudMiddleRight;
+		frame.append(leftOverSpaces / 2, ' ');
+		frame += hudRight;
+		frame += '\n';
 
-		// Try each wall-pair and for *that* pair prefer a straight corridor first,
-		// falling back to the two L-shaped orders only when straight is not possible.
-		for (auto sWall : startWalls) {
-			for (auto eWall : endWalls) {
-				auto sCenter = outsideCenterFromWall(boxes[i], sWall, make_pair(targetJx, targetJy));
-				auto eCenter = outsideCenterFromWall(boxes[j], eWall, make_pair(targetIx, targetIy));
+		// Top border
+		frame.append(width + 2, '#');
+		frame += '\n';
 
-				// skip out-of-bounds centers early
-				if (sCenter.first < 0 || sCenter.first >= width || sCenter.second < 0 || sCenter.second >= height) continue;
-				if (eCenter.first < 0 || eCenter.first >= width || eCenter.second < 0 || eCenter.second >= height) continue;
+		// Mark enemy tiles once per frame instead of scanning every enemy for every tile
+		vector<uint8_t>& mask = enemyMask();
+		mask.assign(static_cast<size_t>(width) * static_cast<size_t>(height), 0);
+		for (size_t e = 0; e < enemies.size(); ++e) {
+			int ex = enemies.x(e), ey = enemies.y(e);
+			if (ex >= 0 && ex < width && ey >= 0 && ey < height) mask[static_cast<size_t>(ey * width + ex)] = 1;
+		}
 
-				// If they are aligned, try the straight corridor first for this pair.
-				if (sCenter.second == eCenter.second || sCenter.first == eCenter.first) {
-					straightCenters(sCenter.first, sCenter.second, eCenter.first, eCenter.second, centers);
-					if (pathFits(centers, i, j, sWall, eWall)) {
-						writeCentersAsCorridor(centers);
-						createOpeningAndConnectWallToCenter(sWall, sCenter);
-						createOpeningAndConnectWallToCenter(eWall, eCenter);
-						return true;
-					}
-					// If straight failed for this pair, still try L-shaped orders for same pair below.
+		for (int i = 0; i < height; i++) {
+			for (int j = 0; j < width; j++) {
+				if (j == 0) frame += '#'; // Left border
+
+				if (i == player.getY() && j == player.getX()) {
+					frame += 'O'; // Player position
+				}
+				else if (!grid->revealed(j, i)) {
+					frame += ' '; // Unrevealed area
+				}
+				else if (mask[static_cast<size_t>(i * width + j)]) {
+					frame += 'A'; // Enemy
+				}
+				else if (exitTile.isAt(j, i)) {
+					frame += 'X'; // Exit tile (center of a different box)
+				}
+				else if (stairsUp.isAt(j, i)) {
+					frame += '<'; // Stairs back up
+				}
+				else if (goldItems.isAt(j, i)) {
+					frame += 'G'; // Gold in dead-end rooms
+				}
+				else {
+					char c = grid[i][j];
+					if (c == TILE_FLOOR || c == TILE_BOX_WALL || c == TILE_CORRIDOR_WALL)
+						frame += c; // Corridor floor, box wall, corridor boundary
+					else
+						frame += ' '; // Empty space
 				}
 
-				// Not aligned, or straight attempt failed  try L-shaped for this pair.
-				int horizLen = abs(sCenter.first - eCenter.first);
-				int vertLen  = abs(sCenter.second - eCenter.second);
+				if (j == width - 1) frame += '#'; // Right border
+			}
+			frame += '\n';
+		}
 
-				// prefer the L-order that yields the longer initial straight leg
-				int firstOrder = (horizLen >= vertLen) ? 0 : 1;
-				int orders[2] = { firstOrder, 1 - firstOrder };
+		// Bottom border
+		frame.append(width + 2, '#');
+		frame += '\n';
 
-				for (int k = 0; k < 2; k++) {
-					bool horizontalFirst = (orders[k] == 0);
-					lShapedCorridor(sCenter.first, sCenter.second, eCenter.first, eCenter.second, horizontalFirst, centers);
-					if (pathFits(centers, i, j, sWall, eWall)) {
-						writeCentersAsCorridor(centers);
-						createOpeningAndConnectWallToCenter(sWall, sCenter);
-						createOpeningAndConnectWallToCenter(eWall, eCenter);
-						return true;
+		if (level == 1) {
+			frame += "Controls: W/A/S/D to move, P to use a potion, K to save and Esc to exit\n";
+			frame += "Reach the exit (X) to advance levels and earn more gold! Stairs (<) lead back up.\n";
+			frame += "Be on the lookout for adversaries (A) in your way and don't forget to pick up any gold (G) you find!\n";
+		}
+		return frame;
+	}
+
+	void Input() {
+		int key = 0;
+		if(session->pollKey(KEY_MOVE, key)) {
+			switch(key) {
+				case 'a':
+					dir = LEFT;
+					break;
+				case 'd':
+					dir = RIGHT;
+					break;
+				case 'w':
+					dir = UP;
+					break;
+				case 's':
+					dir = DOWN;
+					break;
+				case 'p': 
+					// If a potion was used, redraw immediately so HUD updates without waiting for movement.
+					if (player.usePotion()) {
+						Draw();
 					}
-				}
+					break;
+				
+				case 'k':
+					if (!session->headless) saveToFile(savePath);
+					break;
+
+				case 27:
+					gameOver = true;
+					break;
 			}
+			session->drainKeys();
 		}
-
-		return false;
 	}
 
-	bool tryStraightCorridor(size_t i, size_t j) {
-		const Box& A = boxes[i];
-		const Box& B = boxes[j];
+	// Battles per level cleared so far, rounded; one until the run has a history
+	int fightsPerLevel() const {
+		return max(1, static_cast<int>(lround(static_cast<double>(battlesFought) / max(1, deepest - 1))));
+	}
 
-		pair<int,int> ac = make_pair(A.x() + A.width() / 2,  A.y() + A.height() / 2);
-		pair<int,int> bc = make_pair(B.x() + B.width() / 2,  B.y() + B.height() / 2);
+	void nextLevel() {
+		// Back down to a floor already visited: no reward, shop or enemy scaling
+		if (level < deepest) {
+			changeFloor(level + 1);
+			return;
+		}
+		floors.edit().store(level, packFloor()); // the floor left behind stays as it is
 
-		vector<pair<int,int>> centers;
+		// Increase level and gold and grow the map size up to the configured maximums.
+		gold++; // reward for reaching exit (gain gold first)
+		level++;
+		deepest = level;
+		sizeForFloor(level);
 
-		// Try horizontal straight corridors (left/right facing) over the overlapping Y-span.
-		auto tryHorizontal = [&](size_t leftIdx, size_t rightIdx)->bool {
-			const Box& L = boxes[leftIdx];
-			const Box& R = boxes[rightIdx];
-			// ensure L is strictly left of R
-			if (L.x() + L.width() - 1 >= R.x()) return false;
+		// Player upgrades first
+		levelling.Open(player, gold, enemy, fightsPerLevel(), playStyle, *session); // allow spending gold to upgrade player
 
-			int yLow  = max(L.y() + 1, R.y() + 1);
-			int yHigh = min(L.y() + L.height() - 2, R.y() + R.height() - 2);
-			if (yLow > yHigh) return false;
+		// Then scale enemies (so they level up after the player)
+		levelling.enemyDifficultyIncrease(enemy, *session); // scale future enemies
 
-			// scan the whole overlap; first valid straight path wins
-			for (int y = yLow; y <= yHigh; ++y) {
-				pair<int,int> sWall = make_pair(L.x() + L.width() - 1, y);
-				pair<int,int> eWall = make_pair(R.x(), y);
+		// Ensure the leveling screen is cleared before rendering the next level frame
+		session->clearScreen();
 
-				auto sCenter = outsideCenterFromWall(L, sWall, bc);
-				auto eCenter = outsideCenterFromWall(R, eWall, ac);
+		Setup(); // build the next level with upgraded player and scaled enemies
+	}
 
-				// bounds guard
-				if (sCenter.first < 0 || sCenter.first >= width || sCenter.second < 0 || sCenter.second >= height) continue;
-				if (eCenter.first < 0 || eCenter.first >= width || eCenter.second < 0 || eCenter.second >= height) continue;
+	// Up the stairs, arriving on the floor above's stairs down
+	void previousLevel() {
+		if (level > 1) changeFloor(level - 1);
+	}
 
-				straightCenters(sCenter.first, sCenter.second, eCenter.first, eCenter.second, centers);
-				if (pathFits(centers, leftIdx, rightIdx, sWall, eWall)) {
-					writeCentersAsCorridor(centers);
-					createOpeningAndConnectWallToCenter(sWall, sCenter);
-					createOpeningAndConnectWallToCenter(eWall, eCenter);
-					return true;
-				}
-			}
-			return false;
-		};
+	void sizeForFloor(int depth) {
+		int grown = min(depth - 1, MAX_WIDTH); // past this every size is at its cap, and 5 * grown can't overflow
+		width = min(MAX_WIDTH, startWidth + 5 * grown);
+		height = min(MAX_HEIGHT, startHeight + grown);
+		boxNumber = min(MAX_BOXES, startBoxNumber + grown);
+	}
 
-		// Try vertical straight corridors (top/bottom facing) over the overlapping X-span.
-		auto tryVertical = [&](size_t topIdx, size_t bottomIdx)->bool {
-			const Box& T = boxes[topIdx];
-			const Box& D = boxes[bottomIdx];
-			// ensure T is strictly above D
-			if (T.y() + T.height() - 1 >= D.y()) return false;
+	// Swap the live floor for a visited one: from the archive, or generated afresh if it was dropped from it
+	void changeFloor(int depth) {
+		bool down = depth > level;
+		floors.edit().store(level, packFloor());
+		level = depth;
+		vector<char> packed;
+		if (!floors.edit().take(depth, packed) || !unpackFloor(packed)) {
+			sizeForFloor(depth);
+			Setup();
+		}
+		const Exit& arrival = down ? stairsUp : exitTile;
+		if (arrival.x() >= 0) player.setPosition(arrival.x(), arrival.y());
+		revealCurrentSection();
+		session->clearScreen();
+	}
 
-			int xLow  = max(T.x() + 1, D.x() + 1);
-			int xHigh = min(T.x() + T.width() - 2, D.x() + D.width() - 2);
-			if (xLow > xHigh) return false;
+	// The live floor in archive form: tiles run-length coded with their fog and room bits, the boxes, the sparse
+	// entity lists and what has been discovered. Room ids and the corridor FOV cache are rebuilt instead of stored.
+	vector<char> packFloor() const {
+		SaveWriter out;
+		out.put(width);
+		out.put(height);
+		out.put(boxNumber);
+		out.putVec(*boxes);
+		grid->saveRuns(out);
+		out.put(exitTile);
+		out.put(stairsUp);
+		goldItems.save(out);
+		enemies.save(out);
+		scheduler.save(out);
+		out.put(static_cast<uint32_t>(sleepersByBox.size()));
+		for (const auto& ids : sleepersByBox) out.putVec(ids);
+		out.putVec(roomLit);
+		out.putVec(boxDiscovered);
+		out.putVec(undiscoveredBoxes);
+		return out.bytes;
+	}
 
-			for (int x = xLow; x <= xHigh; ++x) {
-				pair<int,int> sWall = make_pair(x, T.y() + T.height() - 1);
-				pair<int,int> eWall = make_pair(x, D.y());
+	bool unpackFloor(const vector<char>& bytes) {
+		SaveReader in(bytes.data(), bytes.size());
+		int w = 0, h = 0;
+		if (!in.get(w) || !in.get(h) || w < 1 || h < 1 || w > MAX_WIDTH || h > MAX_HEIGHT) return false;
+		width = w;
+		height = h;
+		in.get(boxNumber);
+		pmr::memory_resource* mem = beginLevelData();
+		boxes.assign(pmr::vector<Box>(mem));
+		in.getVec(boxes.edit());
+		grid.assign(TileGrid());
+		if (!grid.edit().loadRuns(in, width, height)) return false;
+		in.get(exitTile);
+		in.get(stairsUp);
+		if (!goldItems.load(in) || !enemies.load(in) || !scheduler.load(in)) return false;
+		uint32_t boxLists = 0;
+		if (!in.get(boxLists) || boxLists != boxes.size()) return false;
+		sleepersByBox.assign(pmr::vector<pmr::vector<int>>(boxLists, mem));
+		for (auto& ids : sleepersByBox.edit()) in.getVec(ids);
+		in.getVec(roomLit);
+		in.getVec(boxDiscovered);
+		in.getVec(undiscoveredBoxes);
+		if (!in.good() || !in.atEnd() || roomLit.size() != boxes.size() || boxDiscovered.size() != boxes.size()) return false;
+
+		buildRoomIds();
+		endLevelData();
+		if (!levelRefsValid()) return false;
+		fovCast.assign(FogMask(width, height));
+		dir = STOP;
+		return true;
+	}
 
-				auto sCenter = outsideCenterFromWall(T, sWall, bc);
-				auto eCenter = outsideCenterFromWall(D, eWall, ac);
+	void Logic() {
+		TRACE_SCOPE("Logic");
+		int prevX = player.getX();
+		int prevY = player.getY();
 
-				if (sCenter.first < 0 || sCenter.first >= width || sCenter.second < 0 || sCenter.second >= height) continue;
-				if (eCenter.first < 0 || eCenter.first >= width || eCenter.second < 0 || eCenter.second >= height) continue;
+		int newX = prevX;
+		int newY = prevY;
 
-				straightCenters(sCenter.first, sCenter.second, eCenter.first, eCenter.second, centers);
-				if (pathFits(centers, topIdx, bottomIdx, sWall, eWall)) {
-					writeCentersAsCorridor(centers);
-					createOpeningAndConnectWallToCenter(sWall, sCenter);
-					createOpeningAndConnectWallToCenter(eWall, eCenter);
-					return true;
-				}
-			}
-			return false;
-		};
+		switch (dir) {
+			case LEFT:
+				newX = prevX - 1;
+				break;
+			case RIGHT:
+				newX = prevX + 1;
+				break;
+			case UP:
+				newY = prevY - 1;
+				break;
+			case DOWN:
+				newY = prevY + 1;
+				break;
+			default:
+				return;
+		}
 
-		// orientation checks
-		if (A.x() + A.width() - 1 < B.x())         { if (tryHorizontal(i, j)) return true; }
-		if (B.x() + B.width() - 1 < A.x())         { if (tryHorizontal(j, i)) return true; }
-		if (A.y() + A.height() - 1 < B.y())        { if (tryVertical(i, j))   return true; }
-		if (B.y() + B.height() - 1 < A.y())        { if (tryVertical(j, i))   return true; }
+		if (isPassableCorridor(newX, newY)) {
+			player.setX(newX);
+			player.setY(newY);
+		}
 
-		return false;
-	}
+		if (player.getX() != prevX || player.getY() != prevY) {
+			revealCurrentSection();
+		}
 
-	void Setup() {
-		gameOver = false;
-		dir = STOP;
+		bool playerMoved = (player.getX() != prevX) || (player.getY() != prevY);
 
-		// Seed RNG
-		srand(static_cast<unsigned int>(time(nullptr)));
+		// Combat if player walked into an enemy (player goes first)
+		if (playerMoved && anyEnemyAt(player.getX(), player.getY())) {
+			int idx = enemies.findAt(player.getX(), player.getY());
 
-		// We'll try a few times to generate a layout where every box ends up with degree 1 or 2.
-		const int maxGenerationAttempts = 20;
-		bool success = false;
+			if (idx >= 0) {
+				Combat combat(*session);
+				Enemy foe = enemies.toEnemy(static_cast<size_t>(idx));
+				activeFoe = &foe;
+				battlesFought++;
+				const bool escaped = combat.OpenBattle(player, foe, /*playerStarts=*/true, prevX, prevY);
+				activeFoe = nullptr;
+				enemies.setHealth(static_cast<size_t>(idx), foe.getCurrentHealth());
 
-		for (int genAttempt = 0; genAttempt < maxGenerationAttempts && !success; ++genAttempt) {
-			// 1) generate non-overlapping boxes
-			boxes.clear();
-			for (int boxesPlaced = 0; boxesPlaced < boxNumber; boxesPlaced++) {
-				bool boxPlaced = false;
-				for (int attempts = 0; attempts < 400; attempts++) {
-					int maxWidthAllowed = min(maxBoxWidth, width - 4);
-					int maxHeightAllowed = min(maxBoxHeight, height - 3);
-					int boxW = minBoxWidth + (maxWidthAllowed > minBoxWidth ? rand() % (maxWidthAllowed - minBoxWidth + 1) : 0);
-					int boxH = minBoxHeight + (maxHeightAllowed > minBoxHeight ? rand() % (maxHeightAllowed - minBoxHeight + 1) : 0);
-
-					Box newBox(boxW, boxH);
-					newBox.placeRandom(width, height);
-
-					bool overlapping = false;
-					for (const Box& existingBox : boxes) {
-						if (newBox.intersects(existingBox, 2)) {
-							overlapping = true;
-							break;
-						}
-					}
+				if (escaped) {
+					// Stop processing this tick after escape (avoid immediate re-trigger)
+					dir = STOP;
+					Draw();
+					return;
+				}
 
-					if (!overlapping) {
-						boxes.push_back(newBox);
-						boxPlaced = true;
-						break;
-					}
+				if (foe.isDead()) {
+					enemies.swapRemove(static_cast<size_t>(idx));
+					gold += session->rng.below(3) + 1; // reward for defeating enemy
 				}
-				if (!boxPlaced) {
-					break;
+
+				// If player died, end the game immediately
+				if (player.isDead()) {
+					gameOver = true;
+					return;
 				}
 			}
+		}
 
-			if (boxes.empty()) {
-				int backupBoxWidth = min(maxBoxWidth, width - 4);
-				int backupBoxHeight = min(maxBoxHeight, height - 3);
-				Box backupBox(backupBoxWidth, backupBoxHeight);
-				backupBox.placeAt((width - backupBoxWidth) / 2, (height - backupBoxHeight) / 2);
-				boxes.push_back(backupBox);
-			}
+		// Enemy movement
+		if (playerMoved) {
+			// Determine the player's current box, if any
+			int playerBoxIdx = boxIndexAt(player.getX(), player.getY());
 
-			// Start with fresh grid and draw boxes
-			clearGrid();
-			for (const Box& box : boxes) box.drawBox(grid);
+			// One distance field per player move covering the player's room plus nearby corridors
+			chaseField().build(player.getX(), player.getY(), grid, [&](int x, int y, int dist) {
+				int interiorIdx = boxIndexForInterior(x, y);
+				if (interiorIdx >= 0) return interiorIdx == playerBoxIdx;
+				return dist <= chaseCorridorReach;
+			});
 
-			// Helper to create a stable pair key for unordered_set (min<<32 | max)
-			auto pairKey = [](size_t a, size_t b) -> uint64_t {
-				if (a > b) std::swap(a, b);
-				return (static_cast<uint64_t>(a) << 32) | static_cast<uint64_t>(b);
-			};
+			// Enemies asleep in the player's box wake up: the field now covers them
+			if (playerBoxIdx >= 0) wakeBox(playerBoxIdx);
 
-			size_t n = boxes.size();
-			// If not enough boxes, mark as success (nothing to connect)
-			if (n < 2) {
-				success = true;
-				break;
-			}
+			scheduler.advance(TurnScheduler::TURN);
+			scheduler.runDue([&](int id) { return enemyTurn(id, playerBoxIdx); });
+		}
 
-			// Precompute centers
-			vector<pair<int,int>> centers(n);
-			for (size_t i = 0; i < n; ++i)
-				centers[i] = make_pair(boxes[i].x() + boxes[i].width() / 2, boxes[i].y() + boxes[i].height() / 2);
+		// Combat if an enemy walked into the player (enemy goes first)
+		if (anyEnemyAt(player.getX(), player.getY())) {
+			int idx = enemies.findAt(player.getX(), player.getY());
 
-			vector<bool> used(n, false);
-			vector<size_t> order;
-			order.reserve(n);
-			size_t cur = rand() % n;
-			used[cur] = true;
-			order.push_back(cur);
-			for (size_t step = 1; step < n; ++step) {
-				long long bestDist = LLONG_MAX;
-				size_t bestIdx = SIZE_MAX;
-				for (size_t j = 0; j < n; ++j) {
-					if (used[j]) continue;
-					long long dx = centers[cur].first - centers[j].first;
-					long long dy = centers[cur].second - centers[j].second;
-					long long sd = dx*dx + dy*dy;
-					if (sd < bestDist) { bestDist = sd; bestIdx = j; }
-				}
-				if (bestIdx == SIZE_MAX) {
-					// fallback: pick any unused
-					for (size_t j = 0; j < n; ++j) if (!used[j]) { bestIdx = j; break; }
-				}
-				used[bestIdx] = true;
-				order.push_back(bestIdx);
-				cur = bestIdx;
-			}
-
-			// Track connections and degrees, enforce max degree 2
-			unordered_set<uint64_t> connections;
-			connections.reserve(n * 2);
-			vector<int> degree(n, 0);
-
-			// Try to connect consecutive boxes along the path first
-			for (size_t k = 1; k < order.size(); ++k) {
-				size_t a = order[k - 1];
-				size_t b = order[k];
-				// ensure we don't exceed degree 2 for either endpoint
-				if (degree[a] >= 2 || degree[b] >= 2) continue;
-
-				uint64_t key = pairKey(a, b);
-				if (connections.find(key) != connections.end()) continue;
-
-				bool ok = false;
-				// try both directions (different preferred walls)
-				if (tryConnectBoxes(a, b)) ok = true;
-				else if (tryConnectBoxes(b, a)) ok = true;
-
-				if (ok) {
-					connections.insert(key);
-					degree[a] += 1;
-					degree[b] += 1;
-				}
-			}
+			if (idx >= 0) {
+				Combat combat(*session);
+				Enemy foe = enemies.toEnemy(static_cast<size_t>(idx));
+				activeFoe = &foe;
+				battlesFought++;
+				const bool escaped = combat.OpenBattle(player, foe, /*playerStarts=*/false, prevX, prevY);
+				activeFoe = nullptr;
+				enemies.setHealth(static_cast<size_t>(idx), foe.getCurrentHealth());
 
-			// Greedy: connect nearest pairs where both endpoints have degree < 2 until no progress
-			bool progress = true;
-			while (progress) {
-				progress = false;
-				// build list of candidate pairs (both deg < 2, not already connected)
-				vector<pair<long long, pair<size_t,size_t>>> cand;
-				cand.reserve(n*n/4);
-				for (size_t i = 0; i < n; ++i) {
-					if (degree[i] >= 2) continue;
-					for (size_t j = i + 1; j < n; ++j) {
-						if (degree[j] >= 2) continue;
-						uint64_t kkey = pairKey(i, j);
-						if (connections.find(kkey) != connections.end()) continue;
-						long long dx = centers[i].first - centers[j].first;
-						long long dy = centers[i].second - centers[j].second;
-						long long d2 = dx*dx + dy*dy;
-						cand.emplace_back(d2, make_pair(i,j));
-					}
-				}
-				if (cand.empty()) break;
-				sort(cand.begin(), cand.end());
-				for (auto &p : cand) {
-					size_t a = p.second.first;
-				 size_t b = p.second.second;
-					if (degree[a] >= 2 || degree[b] >= 2) continue;
-					uint64_t key = pairKey(a,b);
-					if (connections.find(key) != connections.end()) continue;
-					if (tryConnectBoxes(a,b) || tryConnectBoxes(b,a)) {
-						connections.insert(key);
-						degree[a] += 1;
-						degree[b] += 1;
-						progress = true;
-						break; // recompute candidates after change
-					}
+				if (escaped) {
+					dir = STOP;
+					Draw();
+					return;
 				}
-			}
 
-			// Final pass: ensure every box has degree >= 1 by trying nearest neighbours (respecting max degree 2).
-			for (size_t i = 0; i < n; ++i) {
-				if (degree[i] >= 1) continue;
-				vector<pair<long long, size_t>> neigh;
-				neigh.reserve(n-1);
-				for (size_t j = 0; j < n; ++j) {
-					if (j == i) continue;
-					long long dx = centers[i].first - centers[j].first;
-					long long dy = centers[i].second - centers[j].second;
-					neigh.emplace_back(dx*dx + dy*dy, j);
+				if (foe.isDead()) {
+					enemies.swapRemove(static_cast<size_t>(idx));
+					gold += session->rng.below(3) + 1; // reward for defeating enemy
 				}
-				sort(neigh.begin(), neigh.end());
-				for (auto &p : neigh) {
-					size_t j = p.second;
-					if (degree[j] >= 2) continue; // keep max degree 2
-					uint64_t key = pairKey(i, j);
-					if (connections.find(key) != connections.end()) continue;
-					if (tryConnectBoxes(i, j) || tryConnectBoxes(j, i)) {
-						connections.insert(key);
-						degree[i] += 1;
-						degree[j] += 1;
-						break; // i now has degree >=1
-					}
+
+				if (player.isDead()) {
+					gameOver = true;
+					return;
 				}
 			}
+		}
 
-			// Connectivity repair
-			auto buildAdj = [&]() {
-				vector<vector<size_t>> adj(n);
-				for (uint64_t key : connections) {
-					size_t a = static_cast<size_t>(key >> 32);
-					size_t b = static_cast<size_t>(key & 0xFFFFFFFFull);
-					if (a < n && b < n) {
-						adj[a].push_back(b);
-						adj[b].push_back(a);
-					}
-				}
-				return adj;
-			};
+		// Pick up gold if standing on it
+		if (goldItems.tryPickup(player.getX(), player.getY())) {
+			gold += 2;
+		}
 
-			auto computeComponents = [&]() {
-				vector<vector<size_t>> comps;
-				vector<int> vis(n, 0);
-				auto adj = buildAdj();
-				for (size_t i = 0; i < n; ++i) {
-					if (vis[i]) continue;
-					vector<size_t> st; st.push_back(i);
-					vis[i] = 1;
-					vector<size_t> comp;
-					while (!st.empty()) {
-						size_t u = st.back(); st.pop_back();
-						comp.push_back(u);
-						for (size_t v : adj[u]) if (!vis[v]) {
-							vis[v] = 1;
-							st.push_back(v);
-						}
-					}
-					comps.push_back(std::move(comp));
-				}
-				return comps;
-			};
+		// Stairs: down on the exit, up on '<'. Only a step onto them counts, not arriving there from another floor.
+		bool moved = player.getX() != prevX || player.getY() != prevY;
+		if (moved && exitTile.isAt(player.getX(), player.getY())) {
+			nextLevel();
+			Draw();
+			dir = STOP;
+			return;
+		}
+		if (moved && stairsUp.isAt(player.getX(), player.getY())) {
+			previousLevel();
+			Draw();
+			dir = STOP;
+			return;
+		}
 
-			auto comps = computeComponents();
-			// Try to connect components using the shortest feasible corridor between them,
-			// preferring endpoints with degree < 2 to preserve the degree constraint.
-			unordered_set<uint64_t> triedPairs;
-			auto addEdgeKey = [&](size_t a, size_t b) {
-				if (a > b) std::swap(a, b);
-				return (static_cast<uint64_t>(a) << 32) | static_cast<uint64_t>(b);
-			};
+		dir = STOP;
+		Draw();
+	}
 
-			while (comps.size() > 1) {
-				long long bestDist = LLONG_MAX;
-				size_t bestU = SIZE_MAX, bestV = SIZE_MAX;
-
-				// Search for the closest pair across different components with free degree slots.
-				for (size_t ca = 0; ca < comps.size(); ++ca) {
-					for (size_t cb = ca + 1; cb < comps.size(); ++cb) {
-						for (size_t u : comps[ca]) {
-							if (degree[u] >= 2) continue;
-							for (size_t v : comps[cb]) {
-								if (degree[v] >= 2) continue;
-								uint64_t k = addEdgeKey(u, v);
-								if (connections.find(k) != connections.end()) continue;
-								if (triedPairs.find(k) != triedPairs.end()) continue;
-								long long dx = centers[u].first - centers[v].first;
-								long long dy = centers[u].second - centers[v].second;
-								long long d2 = dx*dx + dy*dy;
-								if (d2 < bestDist) {
-									bestDist = d2; bestU = u; bestV = v;
-								}
-							}
-						}
-					}
-				}
+	// One enemy action; returns the delay to its next one, or -1 when it has settled and can sleep
+	int enemyTurn(int id, int playerBoxIdx) {
+		int slot = enemies.indexOf(id);
+		if (slot < 0) return -1;
+		size_t i = static_cast<size_t>(slot);
+		int ex = enemies.x(i);
+		int ey = enemies.y(i);
+		int delay = enemies.stats(i).actDelay;
+
+		// Enemies inside the field chase the player along it
+		int nx, ny;
+		if (chaseField().nextStep(ex, ey, nx, ny)) {
+			enemies.moveTo(i, nx, ny);
+			return delay;
+		}
 
-				// No pair with free degree slots; stop and let this generation retry.
-				if (bestU == SIZE_MAX) break;
-
-				bool ok = (tryConnectBoxes(bestU, bestV) || tryConnectBoxes(bestV, bestU));
-				if (ok) {
-					connections.insert(addEdgeKey(bestU, bestV));
-					degree[bestU] += 1;
-					degree[bestV] += 1;
-					comps = computeComponents(); // recompute components after change
-				} else {
-					triedPairs.insert(addEdgeKey(bestU, bestV));
-					// keep searching; if all candidates are tried, loop will terminate via bestU==SIZE_MAX
-				}
-			}
+		// Determine the enemy's box
+		int enemyBoxIdx = boxIndexAt(ex, ey);
 
-			// Check success: every box degree must be 1 or 2
-			success = true;
-			for (size_t i = 0; i < n; ++i) {
-				if (degree[i] < 1 || degree[i] > 2) { success = false; break; }
-			}
-			// Also require global connectivity (single component). If we couldn't connect with deg<=2,
-			// we mark as failure so the generator retries with a new layout.
-			if (success) {
-				auto compsFinal = computeComponents();
-			 if (compsFinal.size() != 1) success = false;
+		// Otherwise, if the enemy's box is discovered, drift toward its center
+		if (enemyBoxIdx >= 0 && boxDiscovered[static_cast<size_t>(enemyBoxIdx)]) {
+			const Box& b = boxes[static_cast<size_t>(enemyBoxIdx)];
+			int cx = b.x() + b.width() / 2;
+			int cy = b.y() + b.height() / 2;
+			Enemy::greedyStep(ex, ey, cx, cy, grid);
+			if (ex == enemies.x(i) && ey == enemies.y(i) && enemyBoxIdx != playerBoxIdx && boxIndexForInterior(ex, ey) == enemyBoxIdx) {
+				// Can't get any closer and the field can't reach it until the player comes into this box
+				sleepersByBox.edit()[static_cast<size_t>(enemyBoxIdx)].push_back(id);
+				return -1;
 			}
+			enemies.moveTo(i, ex, ey);
+		}
+		return delay;
+	}
 
-			// If failed this generation attempt, clear corridors and try again (next genAttempt).
-			if (!success) {
-				clearGrid(); // remove any corridors placed during failed attempt
-				// continue to next genAttempt
+	// Put a box's sleeping enemies back on the schedule for the coming move
+	void wakeBox(int boxIdx) {
+		if (sleepersByBox[static_cast<size_t>(boxIdx)].empty()) return; // the common case; no copy-on-write
+		pmr::vector<int>& sleepers = sleepersByBox.edit()[static_cast<size_t>(boxIdx)];
+		for (int id : sleepers) {
+			if (enemies.indexOf(id) >= 0 && scheduler.asleep(id)) scheduler.schedule(id, scheduler.now() + TurnScheduler::TURN);
+		}
+		sleepers.clear();
+	}
+
+	// Reveal event: rooms that now show any revealed tile become discovered and their dormant enemies wake
+	void discoverRevealedBoxes() {
+		for (size_t k = 0; k < undiscoveredBoxes.size();) {
+			int b = undiscoveredBoxes[k];
+			if (!isBoxDiscovered(boxes[static_cast<size_t>(b)])) {
+				++k;
+				continue;
 			}
+			boxDiscovered[static_cast<size_t>(b)] = 1;
+			wakeBox(b);
+			undiscoveredBoxes[k] = undiscoveredBoxes.back();
+			undiscoveredBoxes.pop_back();
 		}
+	}
 
-		// Place player in a random box center
-		int starterBox = rand() % static_cast<int>(boxes.size());
-		int px = boxes[starterBox].x() + boxes[starterBox].width() / 2;
-		int py = boxes[starterBox].y() + boxes[starterBox].height() / 2;
-		player.setPosition(px, py);
+	bool isBoxDiscovered(const Box& b) const {
+		return grid->anyRevealedInRect(b.x(), b.y(), b.x() + b.width() - 1, b.y() + b.height() - 1);
+	}
 
-		if (!isPassableCorridor(player.getX(), player.getY())) {
-			bool foundOpening = false;
-			for (int dy = 0; dy < boxes[starterBox].height() && !foundOpening; dy++) {
-				for (int dx = 0; dx < boxes[starterBox].width() && !foundOpening; dx++) {
-					int tx = boxes[starterBox].x() + dx;
-					int ty = boxes[starterBox].y() + dy;
-					if (tx >= 0 && tx < width && ty >= 0 && ty < height && isPassableCorridor(tx, ty)) {
-						player.setPosition(tx, ty);
-						foundOpening = true;
-					}
-				}
-			}
-			if (!foundOpening) {
-				for (int yy = 0; yy < height && !foundOpening; yy++)
-					for (int xx = 0; xx < width && !foundOpening; xx++)
-						if (isPassableCorridor(xx, yy)) { player.setPosition(xx, yy); foundOpening = true; }
+	// ---- Snapshots ----
+	// Everything needed to continue a run between moves: map, rooms, fog, enemies and their schedule, items, the
+	// player, levelling counters and the session's RNG. Plain-data objects are copied whole and the grid row by row.
+	static const uint32_t SAVE_VERSION = 4;
+	// Restored stats, gold and purchase counts must stay under this: far past anything a run reaches, and small enough
+	// that the arithmetic on them (FightPolicy's hp * 100, shop prices) can't overflow
+	static constexpr int MAX_SAVED_STAT = 1 << 20;
+
+	// Ties a snapshot to this build's object layouts
+	static uint32_t saveLayoutTag() {
+		return static_cast<uint32_t>(sizeof(Player) | sizeof(Enemy) << 8 | sizeof(Levelling) << 16 | sizeof(Box) << 24);
+	}
+
+	vector<char> snapshot() const {
+		static_assert(is_trivially_copyable<Player>::value && is_trivially_copyable<Enemy>::value &&
+		              is_trivially_copyable<Levelling>::value && is_trivially_copyable<Box>::value &&
+		              is_trivially_copyable<Exit>::value, "snapshot copies these objects whole");
+		SaveWriter out;
+		out.bytes.reserve(4096 + static_cast<size_t>(width) * height * 4);
+		uint32_t version = SAVE_VERSION;
+		out.putRaw("C3SV", 4);
+		out.put(version);
+		out.put(saveLayoutTag());
+
+		out.put(width);
+		out.put(height);
+		out.put(boxNumber);
+		out.put(level);
+		out.put(gold);
+		out.put(fovRadius);
+		out.putVec(*boxes);
+		grid->save(out);
+		out.putVec(*roomIds);
+
+		out.put(exitTile);
+		out.put(stairsUp);
+		out.put(deepest);
+		out.put(battlesFought);
+		out.put(startWidth);
+		out.put(startHeight);
+		out.put(startBoxNumber);
+		floors->save(out);
+		out.put(player);
+		out.put(enemy);
+		out.put(levelling);
+		goldItems.save(out);
+
+		enemies.save(out);
+		scheduler.save(out);
+		out.put(static_cast<uint32_t>(sleepersByBox.size()));
+		for (const auto& ids : sleepersByBox) out.putVec(ids);
+
+		fovCast->save(out);
+		out.putVec(roomLit);
+		out.putVec(boxDiscovered);
+		out.putVec(undiscoveredBoxes);
+
+		uint32_t rngState[4];
+		session->rng.getState(rngState);
+		out.put(rngState);
+		out.put(session->tick);
+		return out.bytes;
+	}
+
+	// After a restore: every cross-reference the level's lookups index with must point inside what was loaded. Room
+	// ids (and interior tiles, which boxIndexForInterior reads through them) must name a loaded box, and sleepers and
+	// the undiscovered list must name live enemies and boxes. Every stored position must be on the map: boxes whole,
+	// the stairs unless unplaced (-1, -1), gold and enemies. The player isn't part of a floor; restore checks it.
+	bool levelRefsValid() const {
+		size_t boxCount = boxes.size();
+		for (const Box& b : boxes) {
+			if (b.width() < 1 || b.height() < 1 || b.x() < 0 || b.y() < 0 || b.x() > width - b.width() || b.y() > height - b.height()) return false;
+		}
+		for (const Exit* e : { &exitTile, &stairsUp }) {
+			if (!(e->x() == -1 && e->y() == -1) && !grid->inBounds(e->x(), e->y())) return false;
+		}
+		for (const auto& g : goldItems.all()) {
+			if (!grid->inBounds(g.first, g.second)) return false;
+		}
+		for (size_t i = 0; i < enemies.size(); ++i) {
+			if (!grid->inBounds(enemies.x(i), enemies.y(i))) return false;
+		}
+		for (int y = 0; y < height; ++y) {
+			for (int x = 0; x < width; ++x) {
+				uint16_t r = roomIds[static_cast<size_t>(y * width + x)];
+				RoomKind kind = static_cast<RoomKind>(r >> ROOM_KIND_SHIFT);
+				bool boxTile = kind == ROOM_INTERIOR || kind == ROOM_WALL || grid->interior(x, y);
+				if (boxTile && static_cast<size_t>(r & ROOM_INDEX_MASK) >= boxCount) return false;
 			}
 		}
-
-		// Place exit at the center of a different box than the player's
-		if (!boxes.empty()) {
-			int exitBoxIdx = starterBox;
-			if (boxes.size() > 1) {
-				do {
-					exitBoxIdx = rand() % static_cast<int>(boxes.size());
-				} while (exitBoxIdx == starterBox);
+		for (const auto& ids : sleepersByBox) {
+			for (int id : ids) {
+				if (enemies.indexOf(id) < 0) return false;
 			}
-			int ex = boxes[exitBoxIdx].x() + boxes[exitBoxIdx].width() / 2;
-			int ey = boxes[exitBoxIdx].y() + boxes[exitBoxIdx].height() / 2;
-			exitTile.placeAt(ex, ey);
 		}
+		for (int b : undiscoveredBoxes) {
+			if (b < 0 || static_cast<size_t>(b) >= boxCount) return false;
+		}
+		return true;
+	}
 
-		// Place 'G' in centers of boxes with exactly one corridor (dead-ends), avoiding player and exit tiles
-		goldItems.placeForDeadEnds(boxes, grid, exitTile, player.getX(), player.getY());
+	// The player's and the enemy baseline's numbers, gold and the shop's counters after a restore
+	bool statsValid() const {
+		auto within = [](int v, int lo) { return v >= lo && v <= MAX_SAVED_STAT; };
+		return within(player.getMaxHealth(), 1) && within(player.getCurrentHealth(), 0) && player.getCurrentHealth() <= player.getMaxHealth() &&
+		       within(player.getDefense(), 0) && within(player.getStrength(), 0) && within(player.getPotions(), 0) &&
+		       within(enemy.getMaxHealth(), 1) && within(enemy.getDefense(), 0) && within(enemy.getStrength(), 0) &&
+		       within(gold, 0) && within(battlesFought, 0) && levelling.countersWithin(MAX_SAVED_STAT);
+	}
 
-		// NEW: Spawn an enemy in every box that does NOT contain Gold, Player, or Exit
-		enemies.clear();
-		for (const auto& b : boxes) {
-			int cx = b.x() + b.width() / 2;
-			int cy = b.y() + b.height() / 2;
+	// Replace this game's state with a snapshot; Run() then continues from it. On failure the game must not be run.
+	bool restore(const vector<char>& bytes) {
+		SaveReader in(bytes.data(), bytes.size());
+		char magic[4];
+		uint32_t version = 0, tag = 0;
+		if (!in.getRaw(magic, 4) || memcmp(magic, "C3SV", 4) != 0 || !in.get(version) || version != SAVE_VERSION ||
+		    !in.get(tag) || tag != saveLayoutTag()) {
+			return false;
+		}
 
-			// must be a valid floor center
-			if (cy < 0 || cy >= height || cx < 0 || cx >= width) continue;
-			if (grid[cy][cx] != TILE_FLOOR) continue;
+		if (!in.get(width) || !in.get(height) || width < 1 || height < 1 || width > MAX_WIDTH || height > MAX_HEIGHT) return false;
+		in.get(boxNumber);
+		in.get(level);
+		in.get(gold);
+		if (!in.get(fovRadius) || fovRadius < 1 || fovRadius > MAX_WIDTH + MAX_HEIGHT) return false;
+		// Fresh shared parts, so copies of this game that still share the old ones are left alone
+		pmr::memory_resource* mem = beginLevelData();
+		boxes.assign(pmr::vector<Box>(mem));
+		in.getVec(boxes.edit());
+		grid.assign(TileGrid());
+		if (!grid.edit().load(in, width, height)) return false;
+		roomIds.assign(pmr::vector<uint16_t>(mem));
+		if (!in.getVec(roomIds.edit()) || roomIds.size() != static_cast<size_t>(width) * height) return false;
+
+		in.get(exitTile);
+		in.get(stairsUp);
+		in.get(deepest);
+		in.get(battlesFought);
+		in.get(startWidth);
+		in.get(startHeight);
+		in.get(startBoxNumber);
+		// The later floors are sized from these (sizeForFloor)
+		if (level < 1 || deepest < level || startWidth < 1 || startWidth > MAX_WIDTH || startHeight < 1 || startHeight > MAX_HEIGHT ||
+		    startBoxNumber < 0 || startBoxNumber > MAX_BOXES) {
+			return false;
+		}
+		floors.assign(FloorArchive());
+		if (!floors.edit().load(in)) return false;
+		in.get(player);
+		in.get(enemy);
+		in.get(levelling);
+		if (!statsValid()) return false;
+		if (!goldItems.load(in) || !enemies.load(in) || !scheduler.load(in)) return false;
+
+		uint32_t boxLists = 0;
+		if (!in.get(boxLists) || boxLists != boxes.size()) return false;
+		sleepersByBox.assign(pmr::vector<pmr::vector<int>>(boxLists, mem));
+		for (auto& ids : sleepersByBox.edit()) in.getVec(ids);
+		endLevelData();
+
+		fovCast.assign(FogMask());
+		if (!fovCast.edit().load(in, width, height)) return false;
+		in.getVec(roomLit);
+		in.getVec(boxDiscovered);
+		in.getVec(undiscoveredBoxes);
+		if (roomLit.size() != boxes.size() || boxDiscovered.size() != boxes.size()) return false;
+
+		uint32_t rngState[4];
+		in.get(rngState);
+		in.get(session->tick);
+		if (!in.good() || !in.atEnd() || !levelRefsValid() || !grid->inBounds(player.getX(), player.getY())) return false;
+		session->rng.setState(rngState);
 
-			// exclude player's box center position, exit, and gold
-			if (b.contains(player.getX(), player.getY()) && (player.getX() == cx && player.getY() == cy)) continue;
-			if (exitTile.isAt(cx, cy)) continue;
-			if (goldItems.isAt(cx, cy)) continue;
+		gameOver = false;
+		dir = STOP;
+		activeFoe = nullptr;
+		restored = true;
+		return true;
+	}
 
-			Enemy e;
-			// Apply baseline scaled stats so difficulty increases across levels
-			e.setMaxHealth(enemy.getMaxHealth());
-			e.healToFull();
-			e.setDefense(enemy.getDefense());
-			e.setStrength(enemy.getStrength());
+	// A copy of this game that carries on under another session (its own keys and RNG stream). The RNG state and
+	// tick are copied into that session, so with the same keys the copy plays out exactly as this game would. The
+	// map, fog and sleeper lists stay shared until one side changes them, so a fork costs a few small vectors;
+	// lookahead can fork, feed the copy scripted keys, score the result and throw it away.
+	Game fork(Session& into) const {
+		into.rng = session->rng;
+		into.tick = session->tick;
+		Game copy(*this);
+		copy.session = &into;
+		copy.activeFoe = nullptr;
+		copy.restored = true; // Run() carries on instead of generating a new level
+		return copy;
+	}
 
-		 e.placeAt(cx, cy);
-			enemies.push_back(e);
-		}
+	// Single buffered write / single read of the snapshot
+	bool saveToFile(const string& path) const {
+		vector<char> bytes = snapshot();
+		ofstream out(path, ios::binary | ios::trunc);
+		if (!out) return false;
+		out.write(bytes.data(), static_cast<streamsize>(bytes.size()));
+		return static_cast<bool>(out);
+	}
 
-		revealedAreas.assign(height, vector<bool>(width, false));
-		revealCurrentSection();
+	static bool readSnapshotFile(const string& path, vector<char>& bytes) {
+		ifstream in(path, ios::binary | ios::ate);
+		if (!in) return false;
+		streamoff size = in.tellg();
+		if (size <= 0) return false;
+		bytes.resize(static_cast<size_t>(size));
+		in.seekg(0);
+		return static_cast<bool>(in.read(bytes.data(), size));
 	}
 
-	// Remove any enemy at x,y. Returns how many were removed.
-	int removeEnemiesAt(int x, int y) {
-		size_t before = enemies.size();
-		enemies.erase(
-			remove_if(enemies.begin(), enemies.end(),
-				[&](const Enemy& e) { return e.isAt(x, y); }),
-			enemies.end());
-		return static_cast<int>(before - enemies.size());
+	bool loadFromFile(const string& path) {
+		vector<char> bytes;
+		return readSnapshotFile(path, bytes) && restore(bytes);
 	}
 
-	// Helper: any enemy at x,y
-	bool anyEnemyAt(int x, int y) const {
-		for (const auto& e : enemies) {
-			if (e.isAt(x, y)) {
-				return true;
-				}
+	void setSavePath(const string& path) { savePath = path; }
+	void setPlayStyle(const FightPolicy& style) { playStyle = style; }
+
+	// Run the main game loop
+	void Run() {
+		if (!restored) Setup();
+		Draw();
+		while (!gameOver) {
+			TRACE_SCOPE("Frame");
+			Input();
+			Logic();
+			if (!session->headless) Sleep(50);
+			session->tick++;
 		}
-		return false;
 	}
 
-	void Draw() const {
-		// Build the entire frame in memory and write once to the console to avoid excessive flushing.
-		std::string frame;
-		frame.reserve(static_cast<size_t>((height + 8) * (width + 4)));
-
-		// HUD
-		string hudLeft = "Level " + to_string(level);
-		string hudMiddleLeft = "Health: " + to_string(player.getCurrentHealth()) + "/" + to_string(player.getMaxHealth());
-		string hudMiddleRight = "Potions: " + to_string(player.getPotions());
-		string hudRight = "Gold: " + to_string(gold);
-		int total = width + 2;
-		int spaces = total - static_cast<int>(hudLeft.size()) - static_cast<int>(hudRight.size()) - static_cast<int>(hudMiddleLeft.size());
-		int leftOverSpaces = (spaces / 2) - static_cast<int>(hudMiddleRight.size());
-		if (spaces < 2) spaces = 2;
-		frame += hudLeft;
-		frame.append(spaces / 2, ' ');
-		frame+= hudMiddleLeft;
-		frame.append(leftOverSpaces / 2, ' ');
-		frame += hudMiddleRight;
-		frame.append(leftOverSpaces / 2, ' ');
-		frame += hudRight;
-		frame += '\n';
+	// LevelValidator failure bits for the level as it stands (call right after Setup to check the enemy spawns)
+	unsigned validateLevel() const {
+		vector<pair<int, int>>& spawns = validatorSpawns();
+		spawns.clear();
+		for (size_t e = 0; e < enemies.size(); ++e) spawns.emplace_back(enemies.x(e), enemies.y(e));
+		return levelValidator().check(*grid, *boxes, make_pair(player.getX(), player.getY()), make_pair(exitTile.x(), exitTile.y()),
+		                       goldItems.all(), spawns);
+	}
+	int droppedBoxes() const { return boxesDropped; }
 
-		// Top border
-		frame.append(width + 2, '#');
-		frame += '\n';
+	int getLevel() const { return level; }
+	int getGold() const { return gold; }
+	const Player& getPlayer() const { return player; }
+};
 
-		for (int i = 0; i < height; i++) {
-			for (int j = 0; j < width; j++) {
-				if (j == 0) frame += '#'; // Left border
+// Built-in bot for headless runs. Explores by BFS toward the nearest unrevealed floor tile, collects gold it has
+// seen, heads for the exit once it is revealed, fights with a FightPolicy and shops with a simple buying policy
+// or the shop's auto-buy planner.
+// It gives up (Esc) when it reaches the level cap, runs out of moves for a level or has nowhere left to go.
+class AutoPlayer : public KeySource {
+public:
+	enum ShopPolicy { SHOP_NONE, SHOP_BALANCED, SHOP_POTIONS, SHOP_PLAN };
+
+	struct Config {
+		FightPolicy fight;
+		ShopPolicy shop = SHOP_BALANCED;
+		int maxLevel = 20;
+		int maxMovesPerLevel = 5000;
+	};
+
+private:
+	const Game* game = nullptr;
+	Config config;
+	int movesThisLevel = 0;
+	int lastLevel = 0;
+	bool stuck = false;
+	bool plannedThisVisit = false;
+
+	vector<int> parent;     // BFS scratch, reused between moves
+	vector<int> frontier;
+	vector<uint32_t> seen;
+	uint32_t generation = 0;
+
+	// BFS over floor tiles from the player; returns the first move key toward the chosen target, or 0.
+	int nextMoveKey() {
+		const Game& g = *game;
+		int w = g.width, h = g.height;
+		size_t cells = static_cast<size_t>(w) * static_cast<size_t>(h);
+		if (seen.size() != cells) {
+			seen.assign(cells, 0);
+			parent.assign(cells, -1);
+			generation = 0;
+		}
+		if (++generation == 0) {
+			fill(seen.begin(), seen.end(), 0u);
+			generation = 1;
+		}
 
-				if (i == player.getY() && j == player.getX()) {
-					frame += 'O'; // Player position
-				}
-				else if (!revealedAreas[i][j]) {
-					frame += ' '; // Unrevealed area
-				}
-				else if (anyEnemyAt(j, i)) {
-					frame += 'A'; // Enemy
-				}
-				else if (exitTile.isAt(j, i)) {
-					frame += 'X'; // Exit tile (center of a different box)
-				}
-				else if (goldItems.isAt(j, i)) {
-					frame += 'G'; // Gold in dead-end rooms
-				}
-				else {
-					char c = grid[i][j];
-					if (c == TILE_FLOOR || c == TILE_BOX_WALL || c == TILE_CORRIDOR_WALL)
-						frame += c; // Corridor floor, box wall, corridor boundary
-					else
-						frame += ' '; // Empty space
-				}
+		int start = g.player.getY() * w + g.player.getX();
+		frontier.clear();
+		frontier.push_back(start);
+		seen[static_cast<size_t>(start)] = generation;
+		parent[static_cast<size_t>(start)] = -1;
 
-				if (j == width - 1) frame += '#'; // Right border
+		int goldTarget = -1, exitTarget = -1, exploreTarget = -1;
+		static const int dx[4] = { -1, 1, 0, 0 };
+		static const int dy[4] = { 0, 0, -1, 1 };
+		for (size_t head = 0; head < frontier.size() && goldTarget < 0; ++head) {
+			int cur = frontier[head];
+			int cx = cur % w, cy = cur / w;
+			if (cur != start) {
+				bool revealed = g.grid->revealed(cx, cy);
+				if (revealed && g.goldItems.isAt(cx, cy)) goldTarget = cur;
+				else if (revealed && exitTarget < 0 && g.exitTile.isAt(cx, cy)) exitTarget = cur;
+				else if (!revealed && exploreTarget < 0) exploreTarget = cur;
+			}
+			for (int k = 0; k < 4; ++k) {
+				int nx = cx + dx[k], ny = cy + dy[k];
+				if (nx < 0 || ny < 0 || nx >= w || ny >= h) continue;
+				int n = ny * w + nx;
+				if (seen[static_cast<size_t>(n)] == generation) continue;
+				if (!g.grid->isFloor(nx, ny) || g.stairsUp.isAt(nx, ny)) continue; // never climbs back up
+				seen[static_cast<size_t>(n)] = generation;
+				parent[static_cast<size_t>(n)] = cur;
+				frontier.push_back(n);
 			}
-			frame += '\n';
 		}
 
-		// Bottom border
-		frame.append(width + 2, '#');
-		frame += '\n';
+		int target = goldTarget >= 0 ? goldTarget : (exitTarget >= 0 ? exitTarget : exploreTarget);
+		if (target < 0) return 0;
+
+		// Walk back to the tile right next to the player
+		int step = target;
+		while (parent[static_cast<size_t>(step)] != start) step = parent[static_cast<size_t>(step)];
+		int sx = step % w, sy = step / w;
+		if (sx < g.player.getX()) return 'a';
+		if (sx > g.player.getX()) return 'd';
+		if (sy < g.player.getY()) return 'w';
+		return 's';
+	}
 
-		if (level == 1) {
-			frame += "Controls: W/A/S/D to move, P to use a potion and Esc to exit\n";
-			frame += "Reach the exit (X) to advance levels and earn more gold!\n";
-			frame += "Be on the lookout for adversaries (A) in your way and don't forget to pick up any gold (G) you find!\n";
+	int shopKey() {
+		const Game& g = *game;
+		const Levelling& l = g.levelling;
+		int gold = g.gold;
+		if (config.shop == SHOP_NONE) return 13;
+		if (config.shop == SHOP_PLAN) {
+			// Auto-buy once per visit, then leave
+			plannedThisVisit = !plannedThisVisit;
+			return plannedThisVisit ? '5' : 13;
 		}
-
-		// Write to console at the top-left without clearing the screen (avoids slow system(\"cls\"))
-		HANDLE hOut = GetStdHandle(STD_OUTPUT_HANDLE);
-		COORD origin{}; origin.X = 0; origin.Y = 0;
-		SetConsoleCursorPosition(hOut, origin);
-		DWORD written = 0;
-		// Use WriteConsoleA for speed and to avoid iostream flushing costs
-		WriteConsoleA(hOut, frame.c_str(), static_cast<DWORD>(frame.size()), &written, nullptr);
+		if (config.shop == SHOP_POTIONS && g.player.getPotions() < 3 && gold >= Levelling::potionCost()) return '4';
+
+		// Cheapest stat upgrade first (ties: strength, health, defense)
+		int best = 0, bestCost = INT_MAX;
+		if (l.strengthCost() < bestCost) { best = '3'; bestCost = l.strengthCost(); }
+		if (l.healthCost() < bestCost) { best = '1'; bestCost = l.healthCost(); }
+		if (l.defenseCost() < bestCost) { best = '2'; bestCost = l.defenseCost(); }
+		return (gold >= bestCost) ? best : 13;
 	}
 
-	void Input() {
-		if(_kbhit()) {
-			switch(_getch()) {
-				case 'a':
-					dir = LEFT;
-					break;
-				case 'd':
-					dir = RIGHT;
-					break;
-				case 'w':
-					dir = UP;
-					break;
-				case 's':
-					dir = DOWN;
-					break;
-				case 'p': 
-					// If a potion was used, redraw immediately so HUD updates without waiting for movement.
-					if (player.usePotion()) {
-						Draw();
-					}
-					break;
-				
-				case 27:
-					gameOver = true;
-					break;
-			}
-			while (_kbhit()) { volatile int ch = _getch(); (void)ch; }
+public:
+	AutoPlayer(const Config& cfg) : config(cfg) {}
+
+	void attach(const Game& g) { game = &g; }
+	bool gotStuck() const { return stuck; }
+
+	bool poll(KeyContext, int& ch) override {
+		const Game& g = *game;
+		if (g.level != lastLevel) {
+			lastLevel = g.level;
+			movesThisLevel = 0;
+		}
+		if (g.level >= config.maxLevel) {
+			ch = 27;
+			return true;
+		}
+		if (++movesThisLevel > config.maxMovesPerLevel) {
+			stuck = true;
+			ch = 27;
+			return true;
+		}
+
+		const Player& p = g.player;
+		if (config.fight.choose(p.getCurrentHealth(), p.getMaxHealth(), p.getPotions()) == ACT_POTION && p.canUsePotion()) {
+			ch = 'p';
+			return true;
+		}
+
+		ch = nextMoveKey();
+		if (ch == 0) {
+			stuck = true;
+			ch = 27;
 		}
+		return true;
 	}
 
-	void nextLevel() {
-		// Increase level and gold and grow the map size up to the configured maximums.
-		gold++; // reward for reaching exit (gain gold first)
-		level++;
-		width  = min(MAX_WIDTH,  width  + 5);
-		height = min(MAX_HEIGHT, height + 1);
-		boxNumber = min(MAX_BOXES, boxNumber + 1);
+	int read(KeyContext ctx) override {
+		if (ctx == KEY_BATTLE) {
+			const Player& p = game->player;
+			BattleAction a = config.fight.choose(p.getCurrentHealth(), p.getMaxHealth(), p.getPotions());
+			if (a == ACT_POTION && !p.canUsePotion()) a = ACT_ATTACK;
+			return '0' + a;
+		}
+		if (ctx == KEY_SHOP) return shopKey();
+		return 13;
+	}
+};
 
-		// Player upgrades first
-		levelling.Open(player, gold);             // allow spending gold to upgrade player
+// Plays many headless games with the built-in bot across all cores and prints throughput and aggregate results.
+// With a start snapshot every game forks from that mid-run state (restored once, then forked per game), reseeded
+// per game so the runs diverge.
+static int RunAutoplay(int games, int threads, uint64_t baseSeed, const AutoPlayer::Config& config,
+                       const vector<char>* start = nullptr) {
+	struct Totals {
+		int games = 0;
+		int deaths = 0;
+		int stuck = 0;
+		long long levels = 0;
+		long long gold = 0;
+		int maxLevel = 0;
+		map<int, int> reached;     // level -> games that ended there
+		map<int, int> deathsAt;    // level -> deaths on that level
+	};
+
+	if (threads <= 0) threads = max(1, static_cast<int>(thread::hardware_concurrency()));
+	atomic<int> nextGame(0);
+	Totals totals;
+	mutex totalsMutex;
+
+	// Forks only read the origin, so every worker can fork from it at once
+	ConsoleKeys noKeys;
+	Session originSession(noKeys, baseSeed);
+	originSession.headless = true;
+	Game origin(originSession);
+	if (start && !origin.restore(*start)) start = nullptr;
+
+	auto worker = [&]() {
+		Totals local;
+		for (;;) {
+			int index = nextGame.fetch_add(1);
+			if (index >= games) break;
+
+			AutoPlayer bot(config);
+			Session session(bot, baseSeed + static_cast<uint64_t>(index));
+			session.headless = true;
+			Game game = start ? origin.fork(session) : Game(session);
+			if (start) session.rng.reseed(baseSeed + static_cast<uint64_t>(index));
+			bot.attach(game);
+			game.setPlayStyle(config.fight);
+			game.Run();
+
+			int lvl = game.getLevel();
+			bool died = game.getPlayer().isDead();
+			local.games++;
+			local.levels += lvl;
+			local.gold += game.getGold();
+			local.maxLevel = max(local.maxLevel, lvl);
+			local.reached[lvl]++;
+			if (died) {
+				local.deaths++;
+				local.deathsAt[lvl]++;
+			}
+			if (bot.gotStuck()) local.stuck++;
+		}
 
-		// Then scale enemies (so they level up after the player)
-		levelling.enemyDifficultyIncrease(enemy); // scale future enemies
+		lock_guard<mutex> lock(totalsMutex);
+		totals.games += local.games;
+		totals.deaths += local.deaths;
+		totals.stuck += local.stuck;
+		totals.levels += local.levels;
+		totals.gold += local.gold;
+		totals.maxLevel = max(totals.maxLevel, local.maxLevel);
+		for (const auto& kv : local.reached) totals.reached[kv.first] += kv.second;
+		for (const auto& kv : local.deathsAt) totals.deathsAt[kv.first] += kv.second;
+	};
+
+	auto t0 = chrono::steady_clock::now();
+	vector<thread> pool;
+	for (int t = 0; t < threads; ++t) pool.emplace_back(worker);
+	for (auto& t : pool) t.join();
+	double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+
+	int n = max(1, totals.games);
+	cout << "Autoplay: " << totals.games << " games on " << threads << " threads in " << secs << " s ("
+	     << (secs > 0 ? totals.games / secs : 0.0) << " games/sec), seeds " << baseSeed << ".." << (baseSeed + games - 1) << "\n"
+	     << "  mean level reached: " << static_cast<double>(totals.levels) / n << " (max " << totals.maxLevel << ")\n"
+	     << "  mean final gold:    " << static_cast<double>(totals.gold) / n << "\n"
+	     << "  deaths:             " << totals.deaths << " (" << 100.0 * totals.deaths / n << "%)\n"
+	     << "  stuck/gave up:      " << totals.stuck << "\n"
+	     << "  level  games-ended  deaths\n";
+	for (const auto& kv : totals.reached) {
+		auto d = totals.deathsAt.find(kv.first);
+		cout << "  " << kv.first << "\t" << kv.second << "\t" << (d == totals.deathsAt.end() ? 0 : d->second) << "\n";
+	}
+	return 0;
+}
+
+// ---- Reinforcement-learning environment ----
+// N independent headless games stepped in lockstep so agents can be trained against the game. Every screen that
+// waits for a key (moving, battle, shop) becomes a decision point: the game's worker thread publishes an
+// observation and blocks until the agent's action arrives, so Combat and Levelling run unchanged and their choices
+// are ordinary actions. "Press any key" modals are answered automatically.
+//
+// All envs share one contiguous buffer, laid out so it can live in shared memory as is:
+//   RlBufferHeader (64 bytes) | actions u8[N] | rewards float[N] | dones u8[N] | N observation records
+// (each section 64-byte aligned). An observation record is an RlObsHeader followed by three byte planes of
+// PLANE_H x PLANE_W, row-major: tiles (0 unknown/rock, 1 floor, 2 box wall, 3 corridor wall), fog (1 revealed)
+// and entities (1 player, 2 enemy, 3 gold, 4 exit, 5 stairs up). Unrevealed tiles read as 0 in the tile and entity planes.
+//
+// Actions by phase:  move:   0 wait, 1 up, 2 left, 3 down, 4 right, 5 drink a potion
+//                    battle: 1 attack, 2 defend, 3 potion, 4 run (anything else is ignored and asked again)
+//                    shop:   1 health, 2 defense, 3 strength, 4 potion, 0 or 5 leave
+// Reward: +1 per level reached, +0.1 per gold picked up, -1 for dying.
+struct RlBufferHeader {
+	char magic[4];          // "C3RL"
+	uint32_t version;
+	uint32_t envs;
+	uint32_t recordBytes;   // size of one observation record
+	uint32_t planeWidth;
+	uint32_t planeHeight;
+	uint32_t actionsOffset;
+	uint32_t rewardsOffset;
+	uint32_t donesOffset;
+	uint32_t obsOffset;
+	uint32_t totalBytes;
+	uint32_t reserved[5];
+};
 
-		// Ensure the leveling screen is cleared before rendering the next level frame
-		system("cls");
+struct RlObsHeader {
+	int32_t phase;          // RlEnv::Phase
+	int32_t level;
+	int32_t gold;
+	int32_t health;
+	int32_t maxHealth;
+	int32_t defense;
+	int32_t strength;
+	int32_t potions;
+	int32_t foeHealth;      // the enemy in the current battle, 0 outside battles
+	int32_t foeMaxHealth;
+	int32_t foeDefense;
+	int32_t foeStrength;
+	int32_t width;          // current map size; the planes are padded to PLANE_W x PLANE_H
+	int32_t height;
+	int32_t playerX;
+	int32_t playerY;
+};
 
-		Setup(); // build the next level with upgraded player and scaled enemies
+class RlEnv {
+public:
+	enum Phase { PHASE_MOVE = KEY_MOVE, PHASE_BATTLE = KEY_BATTLE, PHASE_SHOP = KEY_SHOP, PHASE_OVER = 3 };
+	enum Done : uint8_t { RUNNING = 0, TERMINATED = 1, TRUNCATED = 2 };
+
+	static const uint32_t VERSION = 1;
+	static const int PLANE_W = Game::MAX_WIDTH;
+	static const int PLANE_H = Game::MAX_HEIGHT;
+
+	static size_t align64(size_t n) { return (n + 63) & ~static_cast<size_t>(63); }
+	static size_t recordBytes() { return align64(sizeof(RlObsHeader) + 3 * static_cast<size_t>(PLANE_W) * PLANE_H); }
+
+	static RlBufferHeader layout(int envs) {
+		RlBufferHeader h;
+		memset(&h, 0, sizeof(h));
+		memcpy(h.magic, "C3RL", 4);
+		h.version = VERSION;
+		h.envs = static_cast<uint32_t>(envs);
+		h.recordBytes = static_cast<uint32_t>(recordBytes());
+		h.planeWidth = PLANE_W;
+		h.planeHeight = PLANE_H;
+		size_t at = align64(sizeof(RlBufferHeader));
+		h.actionsOffset = static_cast<uint32_t>(at);
+		at = align64(at + static_cast<size_t>(envs));
+		h.rewardsOffset = static_cast<uint32_t>(at);
+		at = align64(at + sizeof(float) * static_cast<size_t>(envs));
+		h.donesOffset = static_cast<uint32_t>(at);
+		at = align64(at + static_cast<size_t>(envs));
+		h.obsOffset = static_cast<uint32_t>(at);
+		h.totalBytes = static_cast<uint32_t>(at + recordBytes() * static_cast<size_t>(envs));
+		return h;
 	}
 
-	void Logic() {
-		int prevX = player.getX();
-		int prevY = player.getY();
+private:
+	struct EpisodeAborted {};
+
+	// One env: a worker thread that owns a Game and acts as its KeySource
+	class Slot : public KeySource {
+	public:
+		enum Command { CMD_NONE, CMD_ACT, CMD_RESET, CMD_QUIT };
+
+		RlEnv& env;
+		int index;
+		mutex m;
+		condition_variable cv;
+		Command command = CMD_NONE;
+		uint8_t action = 0;
+		uint64_t seed = 0;
+		bool published = false;
+		thread worker;
+
+		Slot(RlEnv& e, int i) : env(e), index(i) { worker = thread([this]() { run(); }); }
+
+		// Controller side
+		void send(Command c, uint8_t a = 0, uint64_t s = 0) {
+			lock_guard<mutex> lock(m);
+			command = c;
+			action = a;
+			seed = s;
+			published = false;
+			cv.notify_all();
+		}
 
-		int newX = prevX;
-		int newY = prevY;
+		void waitPublished() {
+			unique_lock<mutex> lock(m);
+			cv.wait(lock, [this]() { return published; });
+		}
 
-		switch (dir) {
-			case LEFT:
-				newX = prevX - 1;
-				break;
-			case RIGHT:
-				newX = prevX + 1;
-				break;
-			case UP:
-				newY = prevY - 1;
-				break;
-			case DOWN:
-				newY = prevY + 1;
-				break;
-			default:
-				return;
+		// KeySource: each decision point is one env step
+		bool poll(KeyContext ctx, int& ch) override {
+			static const char keys[6] = { 0, 'w', 'a', 's', 'd', 'p' };
+			uint8_t a = awaitAction(ctx);
+			if (a == 0 || a > 5) return false;
+			ch = keys[a];
+			return true;
 		}
 
-		if (isPassableCorridor(newX, newY)) {
-			player.setX(newX);
-			player.setY(newY);
+		int read(KeyContext ctx) override {
+			if (ctx == KEY_MODAL) return 13;
+			uint8_t a = awaitAction(ctx);
+			if (ctx == KEY_SHOP) return (a >= 1 && a <= 4) ? '0' + a : 13;
+			return '0' + a;
 		}
 
-		if (player.getX() != prevX || player.getY() != prevY) {
-			revealCurrentSection();
+	private:
+		Game* game = nullptr;
+		Command pending = CMD_NONE;
+		int steps = 0;
+		int lastLevel = 1;
+		int lastGold = 0;
+
+		Command waitCommand() {
+			unique_lock<mutex> lock(m);
+			cv.wait(lock, [this]() { return command != CMD_NONE; });
+			Command c = command;
+			command = CMD_NONE;
+			return c;
 		}
 
-		bool playerMoved = (player.getX() != prevX) || (player.getY() != prevY);
+		void publish(Phase phase, Done done) {
+			const Game& g = *game;
+			float reward = static_cast<float>(g.level - lastLevel) + 0.1f * static_cast<float>(max(0, g.gold - lastGold));
+			if (phase == PHASE_OVER && g.player.isDead()) reward -= 1.0f;
+			lastLevel = g.level;
+			lastGold = g.gold;
+			env.write(index, g, phase, reward, done);
+
+			lock_guard<mutex> lock(m);
+			published = true;
+			cv.notify_all();
+		}
 
-		// Combat if player walked into an enemy (player goes first)
-		if (playerMoved && anyEnemyAt(player.getX(), player.getY())) {
-			int idx = -1;
-			for (size_t i = 0; i < enemies.size(); ++i) {
-				if (enemies[i].isAt(player.getX(), player.getY())) { idx = static_cast<int>(i); break; }
+		uint8_t awaitAction(KeyContext ctx) {
+			++steps;
+			publish(static_cast<Phase>(ctx), steps >= env.maxSteps ? TRUNCATED : RUNNING);
+			Command c = waitCommand();
+			if (c != CMD_ACT) {
+				pending = c;
+				throw EpisodeAborted(); // unwinds the blocked screens and the Game
 			}
+			return action;
+		}
 
-			if (idx >= 0) {
-				Combat combat;
-				const bool escaped = combat.OpenBattle(player, enemies[static_cast<size_t>(idx)], /*playerStarts=*/true, prevX, prevY);
-
-				if (escaped) {
-					// Stop processing this tick after escape (avoid immediate re-trigger)
-					dir = STOP;
-					Draw();
-					return;
+		void run() {
+			for (;;) {
+				Command c = pending != CMD_NONE ? pending : waitCommand();
+				pending = CMD_NONE;
+				if (c == CMD_QUIT) return;
+				if (c != CMD_RESET) {
+					// Finished game still waiting for its reset; repeat the last observation
+					lock_guard<mutex> lock(m);
+					published = true;
+					cv.notify_all();
+					continue;
 				}
 
-				if (enemies[static_cast<size_t>(idx)].isDead()) {
-					removeEnemiesAt(player.getX(), player.getY());
-					gold += rand() % 3 + 1; // reward for defeating enemy
+				Session session(*this, seed);
+				session.headless = true;
+				Game g(session);
+				game = &g;
+				steps = 0;
+				lastLevel = 1;
+				lastGold = 0;
+				try {
+					g.Run();
+					publish(PHASE_OVER, g.player.isDead() ? TERMINATED : TRUNCATED);
 				}
-
-				// If player died, end the game immediately
-				if (player.isDead()) {
-					gameOver = true;
-					return;
+				catch (const EpisodeAborted&) {
 				}
+				game = nullptr;
 			}
 		}
+	};
+
+	vector<uint8_t> ownBuffer;
+	uint8_t* buf;
+	RlBufferHeader head;
+	vector<unique_ptr<Slot>> slots;
+	vector<uint64_t> episodes;
+	uint64_t baseSeed = 0;
+	int maxSteps;
+
+	uint64_t episodeSeed(int i) const {
+		return baseSeed + static_cast<uint64_t>(i) + static_cast<uint64_t>(slots.size()) * episodes[static_cast<size_t>(i)];
+	}
 
-		// Enemy movement
-		if (playerMoved) {
-			// Determine the player's current box, if any
-			int playerBoxIdx = -1;
-			for (size_t i = 0; i < boxes.size(); ++i) {
-				if (boxes[i].contains(player.getX(), player.getY())) { playerBoxIdx = static_cast<int>(i); break; }
+	// Called on the env's own worker thread while its game is paused
+	void write(int i, const Game& g, Phase phase, float reward, Done done) {
+		memcpy(buf + head.rewardsOffset + sizeof(float) * static_cast<size_t>(i), &reward, sizeof(float));
+		buf[head.donesOffset + static_cast<size_t>(i)] = done;
+
+		uint8_t* rec = buf + head.obsOffset + head.recordBytes * static_cast<size_t>(i);
+		RlObsHeader h;
+		const Player& p = g.player;
+		h.phase = phase;
+		h.level = g.level;
+		h.gold = g.gold;
+		h.health = p.getCurrentHealth();
+		h.maxHealth = p.getMaxHealth();
+		h.defense = p.getDefense();
+		h.strength = p.getStrength();
+		h.potions = p.getPotions();
+		const Enemy* foe = (phase == PHASE_BATTLE) ? g.activeFoe : nullptr;
+		h.foeHealth = foe ? foe->getCurrentHealth() : 0;
+		h.foeMaxHealth = foe ? foe->getMaxHealth() : 0;
+		h.foeDefense = foe ? foe->getDefense() : 0;
+		h.foeStrength = foe ? foe->getStrength() : 0;
+		h.width = g.width;
+		h.height = g.height;
+		h.playerX = p.getX();
+		h.playerY = p.getY();
+		memcpy(rec, &h, sizeof(h));
+
+		size_t plane = static_cast<size_t>(PLANE_W) * PLANE_H;
+		uint8_t* tiles = rec + sizeof(RlObsHeader);
+		uint8_t* fog = tiles + plane;
+		uint8_t* ents = fog + plane;
+		memset(tiles, 0, 3 * plane);
+		int w = min(g.width, static_cast<int>(PLANE_W)), hgt = min(g.height, static_cast<int>(PLANE_H));
+		for (int y = 0; y < hgt; ++y) {
+			for (int x = 0; x < w; ++x) {
+				if (!g.grid->revealed(x, y)) continue;
+				size_t at = static_cast<size_t>(y) * PLANE_W + x;
+				tiles[at] = g.grid->kind(x, y); // plane codes are the tile kinds
+				fog[at] = 1;
+				if (g.exitTile.isAt(x, y)) ents[at] = 4;
+				else if (g.stairsUp.isAt(x, y)) ents[at] = 5;
+				else if (g.goldItems.isAt(x, y)) ents[at] = 3;
 			}
+		}
+		for (size_t e = 0; e < g.enemies.size(); ++e) {
+			int ex = g.enemies.x(e), ey = g.enemies.y(e);
+			if (ex >= 0 && ey >= 0 && ex < w && ey < hgt && g.grid->revealed(ex, ey)) ents[static_cast<size_t>(ey) * PLANE_W + ex] = 2;
+		}
+		if (p.getX() >= 0 && p.getY() >= 0 && p.getX() < w && p.getY() < hgt) ents[static_cast<size_t>(p.getY()) * PLANE_W + p.getX()] = 1;
+	}
 
-			for (auto& e : enemies) {
-				if (!e.isPlaced()) continue;
+public:
+	// externalBuffer, if given, must hold layout(envs).totalBytes (e.g. a shared-memory view)
+	RlEnv(int envs, uint8_t* externalBuffer = nullptr, int maxStepsPerEpisode = 20000)
+		: buf(externalBuffer), head(layout(envs)), episodes(static_cast<size_t>(envs), 0), maxSteps(maxStepsPerEpisode) {
+		if (!buf) {
+			ownBuffer.assign(head.totalBytes, 0);
+			buf = ownBuffer.data();
+		}
+		memset(buf, 0, head.totalBytes);
+		memcpy(buf, &head, sizeof(head));
+		for (int i = 0; i < envs; ++i) slots.emplace_back(new Slot(*this, i));
+	}
 
-				// Determine the enemy's box
-				int enemyBoxIdx = -1;
-				for (size_t i = 0; i < boxes.size(); ++i) {
-					if (boxes[i].contains(e.x(), e.y())) { enemyBoxIdx = static_cast<int>(i); break; }
-				}
+	~RlEnv() {
+		for (auto& s : slots) s->send(Slot::CMD_QUIT);
+		for (auto& s : slots) s->worker.join();
+	}
 
-				// If in the same box as the player, chase the player
-				if (enemyBoxIdx >= 0 && enemyBoxIdx == playerBoxIdx) {
-					e.stepToward(player.getX(), player.getY(), grid);
-				}
-				// Otherwise, if the enemy's box is discovered, drift toward its center
-				else if (enemyBoxIdx >= 0 && isBoxDiscovered(boxes[static_cast<size_t>(enemyBoxIdx)])) {
-					const Box& b = boxes[static_cast<size_t>(enemyBoxIdx)];
-					int cx = b.x() + b.width() / 2;
-					int cy = b.y() + b.height() / 2;
-					e.stepToward(cx, cy, grid);
-				}
+	int size() const { return static_cast<int>(slots.size()); }
+	const RlBufferHeader& header() const { return head; }
+	uint8_t* buffer() { return buf; }
+	uint8_t* actions() { return buf + head.actionsOffset; }
+
+	// Start a new episode in every env (env i gets seed + i) and fill in the first observations
+	void reset(uint64_t seed) {
+		baseSeed = seed;
+		fill(episodes.begin(), episodes.end(), 0);
+		for (size_t i = 0; i < slots.size(); ++i) slots[i]->send(Slot::CMD_RESET, 0, episodeSeed(static_cast<int>(i)));
+		for (auto& s : slots) s->waitPublished();
+	}
+
+	// Apply actions() to every env and wait for all the next observations. An env that reported done is reset
+	// instead (its action is ignored) and returns the new episode's first observation.
+	void step() {
+		const uint8_t* act = actions();
+		const uint8_t* done = buf + head.donesOffset;
+		for (size_t i = 0; i < slots.size(); ++i) {
+			if (done[i] != RUNNING) {
+				episodes[i]++;
+				slots[i]->send(Slot::CMD_RESET, 0, episodeSeed(static_cast<int>(i)));
+			}
+			else {
+				slots[i]->send(Slot::CMD_ACT, act[i]);
 			}
 		}
+		for (auto& s : slots) s->waitPublished();
+	}
+};
+
+// Serves an RlEnv over a local Unix-domain socket. Requests are { u32 command, u32 length, payload } and
+// replies { u32 status (0 ok), u32 length, payload }:
+//   1 INFO             -> the RlBufferHeader
+//   2 RESET (u64 seed) -> rewards, dones and observations (the buffer from rewardsOffset to the end)
+//   3 STEP (u8[N])     -> same as RESET
+//   4 CLOSE
+// With a shared-memory name the whole buffer is a named file mapping instead: the client writes actions into it,
+// sends STEP with no payload and reads the results in place; RESET and STEP replies then carry no payload.
+static int RunRlServer(const string& socketPath, int envs, const string& shmName, int maxSteps) {
+	RlBufferHeader head = RlEnv::layout(envs);
+	HANDLE mapping = nullptr;
+	uint8_t* shared = nullptr;
+	if (!shmName.empty()) {
+		mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, head.totalBytes, shmName.c_str());
+		if (mapping) shared = static_cast<uint8_t*>(MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, head.totalBytes));
+		if (!shared) {
+			cerr << "Could not map shared memory '" << shmName << "'\n";
+			if (mapping) CloseHandle(mapping);
+			return 1;
+		}
+	}
 
-		// Combat if an enemy walked into the player (enemy goes first)
-		if (anyEnemyAt(player.getX(), player.getY())) {
-			int idx = -1;
-			for (size_t i = 0; i < enemies.size(); ++i) {
-				if (enemies[i].isAt(player.getX(), player.getY())) { idx = static_cast<int>(i); break; }
+	WSADATA wsa;
+	if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+		cerr << "Winsock startup failed\n";
+		return 1;
+	}
+	SOCKET listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	SOCKADDR_UN addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+	DeleteFileA(socketPath.c_str());
+	if (listener == INVALID_SOCKET || ::bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == SOCKET_ERROR ||
+	    listen(listener, 1) == SOCKET_ERROR) {
+		cerr << "Could not listen on " << socketPath << "\n";
+		if (listener != INVALID_SOCKET) closesocket(listener);
+		WSACleanup();
+		return 1;
+	}
+
+	RlEnv env(envs, shared, maxSteps);
+	cout << "RL server: " << envs << " envs on " << socketPath << (shared ? " with shared memory '" + shmName + "'" : string())
+	     << ", " << head.totalBytes << " byte buffer\n";
+	cout.flush();
+
+	auto recvAll = [](SOCKET s, void* dst, size_t n) {
+		char* p = static_cast<char*>(dst);
+		while (n > 0) {
+			int got = recv(s, p, static_cast<int>(n), 0);
+			if (got <= 0) return false;
+			p += got;
+			n -= static_cast<size_t>(got);
+		}
+		return true;
+	};
+	auto sendAll = [](SOCKET s, const void* src, size_t n) {
+		const char* p = static_cast<const char*>(src);
+		while (n > 0) {
+			int put = send(s, p, static_cast<int>(n), 0);
+			if (put <= 0) return false;
+			p += put;
+			n -= static_cast<size_t>(put);
+		}
+		return true;
+	};
+
+	vector<uint8_t> payload;
+	bool closing = false;
+	while (!closing) {
+		SOCKET client = accept(listener, nullptr, nullptr);
+		if (client == INVALID_SOCKET) break;
+		for (;;) {
+			uint32_t req[2];
+			if (!recvAll(client, req, sizeof(req))) break;
+			payload.resize(req[1]);
+			if (req[1] > 0 && !recvAll(client, payload.data(), req[1])) break;
+
+			uint32_t status = 0;
+			const uint8_t* body = nullptr;
+			size_t bodyLen = 0;
+			if (req[0] == 1) {
+				body = reinterpret_cast<const uint8_t*>(&env.header());
+				bodyLen = sizeof(RlBufferHeader);
+			}
+			else if (req[0] == 2 && req[1] == sizeof(uint64_t)) {
+				uint64_t seed;
+				memcpy(&seed, payload.data(), sizeof(seed));
+				env.reset(seed);
+			}
+			else if (req[0] == 3 && (req[1] == static_cast<uint32_t>(envs) || (shared && req[1] == 0))) {
+				if (req[1] > 0) memcpy(env.actions(), payload.data(), req[1]);
+				env.step();
+			}
+			else if (req[0] == 4) {
+				closing = true;
+			}
+			else {
+				status = 1;
+			}
+			if ((req[0] == 2 || req[0] == 3) && status == 0 && !shared) {
+				body = env.buffer() + head.rewardsOffset;
+				bodyLen = head.totalBytes - head.rewardsOffset;
 			}
 
-			if (idx >= 0) {
-				Combat combat;
-				const bool escaped = combat.OpenBattle(player, enemies[static_cast<size_t>(idx)], /*playerStarts=*/false, prevX, prevY);
+			uint32_t reply[2] = { status, static_cast<uint32_t>(bodyLen) };
+			if (!sendAll(client, reply, sizeof(reply)) || (bodyLen > 0 && !sendAll(client, body, bodyLen))) break;
+			if (closing) break;
+		}
+		closesocket(client);
+	}
 
-				if (escaped) {
-					dir = STOP;
-					Draw();
-					return;
-				}
+	closesocket(listener);
+	DeleteFileA(socketPath.c_str());
+	WSACleanup();
+	if (shared) {
+		UnmapViewOfFile(shared);
+		CloseHandle(mapping);
+	}
+	return 0;
+}
+
+// Replays a recorded session headlessly at maximum speed and prints a summary (used to re-time real sessions).
+static int RunReplay(const string& path, bool show) {
+	ReplayLog log;
+	if (!log.load(path)) {
+		cerr << "Could not read replay file: " << path << "\n";
+		return 1;
+	}
 
-				if (enemies[static_cast<size_t>(idx)].isDead()) {
-					removeEnemiesAt(player.getX(), player.getY());
-					gold += rand() % 3 + 1; // reward for defeating enemy
-				}
+	ReplayKeys keys(log);
+	Session session(keys, log.seed);
+	session.headless = !show;
 
-				if (player.isDead()) {
-					gameOver = true;
-					return;
-				}
+	auto t0 = chrono::steady_clock::now();
+	Game game(session);
+	game.Run();
+	double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+
+	const Player& p = game.getPlayer();
+	cout << "Replay " << path << " (seed " << log.seed << ")\n"
+	     << "  keys replayed:  " << keys.consumed() << "/" << log.events.size() << "\n"
+	     << "  level reached:  " << game.getLevel() << "\n"
+	     << "  gold:           " << game.getGold() << "\n"
+	     << "  health:         " << p.getCurrentHealth() << "/" << p.getMaxHealth() << "\n"
+	     << "  wall time:      " << ms << " ms\n";
+	if (keys.contextMismatches() > 0) {
+		cout << "  WARNING: " << keys.contextMismatches() << " keys landed on a different screen than when recorded (session diverged)\n";
+	}
+	return 0;
+}
+
+// Generates layouts across every map size the game grows through (one per level until the size caps) and checks
+// each with the LevelValidator. Prints how many failed each check, how many Setup had to build with fewer boxes than
+// asked for, and the seeds of the first few failures so they can be replayed with --seed.
+static int RunValidate(int layouts, int threads, uint64_t baseSeed) {
+	const int SIZES = 11; // level 11 reaches the largest map
+	struct Totals {
+		long long layouts = 0;
+		long long failed = 0;
+		long long dropped = 0;
+		long long kinds[LevelValidator::FAILURE_KINDS] = {};
+		double validateSecs = 0.0;
+		vector<pair<uint64_t, unsigned>> examples; // seed, failure bits
+	};
+
+	if (threads <= 0) threads = max(1, static_cast<int>(thread::hardware_concurrency()));
+	atomic<int> next(0);
+	Totals totals;
+	mutex totalsMutex;
+	ConsoleKeys noKeys;
+
+	auto worker = [&]() {
+		Totals local;
+		for (;;) {
+			int index = next.fetch_add(1);
+			if (index >= layouts) break;
+			int step = index % SIZES;
+			uint64_t seed = baseSeed + static_cast<uint64_t>(index);
+			Session session(noKeys, seed);
+			session.headless = true;
+			Game game(session, min(109, 59 + 5 * step), min(25, 15 + step), min(14, 4 + step));
+			game.Setup();
+
+			auto t0 = chrono::steady_clock::now();
+			unsigned failures = game.validateLevel();
+			local.validateSecs += chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+
+			local.layouts++;
+			if (game.droppedBoxes() > 0) local.dropped++;
+			if (failures) {
+				local.failed++;
+				for (int k = 0; k < LevelValidator::FAILURE_KINDS; ++k) if (failures & (1u << k)) local.kinds[k]++;
+				if (local.examples.size() < 5) local.examples.emplace_back(seed, failures);
 			}
 		}
 
-		// Pick up gold if standing on it
-		if (goldItems.tryPickup(player.getX(), player.getY())) {
-			gold += 2;
+		lock_guard<mutex> lock(totalsMutex);
+		totals.layouts += local.layouts;
+		totals.failed += local.failed;
+		totals.dropped += local.dropped;
+		for (int k = 0; k < LevelValidator::FAILURE_KINDS; ++k) totals.kinds[k] += local.kinds[k];
+		totals.validateSecs += local.validateSecs;
+		totals.examples.insert(totals.examples.end(), local.examples.begin(), local.examples.end());
+	};
+
+	auto t0 = chrono::steady_clock::now();
+	vector<thread> pool;
+	for (int t = 0; t < threads; ++t) pool.emplace_back(worker);
+	for (thread& t : pool) t.join();
+	double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+
+	cout << "Validate: " << totals.layouts << " layouts on " << threads << " threads in " << secs << " s ("
+	     << totals.layouts / max(secs, 1e-9) << " layouts/sec), seeds " << baseSeed << ".." << baseSeed + layouts - 1 << "\n";
+	cout << "  validator:        " << 1e9 * totals.validateSecs / max(1LL, totals.layouts) << " ns per layout\n";
+	cout << "  invalid layouts:  " << totals.failed << "\n";
+	cout << "  fewer boxes:      " << totals.dropped << "\n";
+	for (int k = 0; k < LevelValidator::FAILURE_KINDS; ++k) {
+		if (totals.kinds[k]) cout << "    " << LevelValidator::failureName(k) << ": " << totals.kinds[k] << "\n";
+	}
+	sort(totals.examples.begin(), totals.examples.end());
+	for (size_t i = 0; i < totals.examples.size() && i < 5; ++i) {
+		uint64_t seed = totals.examples[i].first;
+		cout << "  e.g. seed " << seed << " (map size step " << (seed - baseSeed) % SIZES << "):";
+		for (int k = 0; k < LevelValidator::FAILURE_KINDS; ++k) {
+			if (totals.examples[i].second & (1u << k)) cout << " " << LevelValidator::failureName(k) << ";";
 		}
+		cout << "\n";
+	}
+	return totals.failed == 0 ? 0 : 1;
+}
+
+// Settings for the Monte Carlo combat tables
+struct CombatSimConfig {
+	int battlesPerCell = 100000;
+	int threads = 0;
+	uint64_t seed = 1;
+	FightPolicy fight;
+	bool playerStarts = true;
+	int playerHealth = 20;   // Player defaults
+	int playerDefense = 2;
+	int potions = 0;
+	int minStrength = 4;     // rows: player strength
+	int maxStrength = 14;
+	int maxEnemyLevel = 12;  // columns: enemy level (base 10/5/5, +1 to each stat per level on average)
+	bool exact = false;      // use BattleSolver instead of sampling
+	bool simd = true;        // sample on AVX2 lanes when the CPU has them (same numbers either way)
+};
 
-		// Level up on exit
-		if (exitTile.isAt(player.getX(), player.getY())) {
-			nextLevel();
-			Draw();
-			dir = STOP;
-			return;
+// Runs millions of resolveBattle calls across all cores and prints win-rate and mean HP-loss tables over a
+// (player strength x enemy level) grid. Each cell has its own seed so the tables don't depend on the thread count.
+static int RunCombatSim(const CombatSimConfig& cfg) {
+	int rows = cfg.maxStrength - cfg.minStrength + 1;
+	int cols = cfg.maxEnemyLevel;
+	int cells = rows * cols;
+	vector<double> winRate(static_cast<size_t>(cells), 0.0);
+	vector<double> hpLoss(static_cast<size_t>(cells), 0.0);
+
+	int threads = cfg.threads > 0 ? cfg.threads : max(1, static_cast<int>(thread::hardware_concurrency()));
+	atomic<int> nextCell(0);
+	auto worker = [&]() {
+		for (;;) {
+			int cell = nextCell.fetch_add(1);
+			if (cell >= cells) break;
+			int str = cfg.minStrength + cell / cols;
+			int lvl = 1 + cell % cols;
+
+			Fighter p = { cfg.playerHealth, cfg.playerHealth, cfg.playerDefense, str };
+			Fighter e = { 10 + lvl - 1, 10 + lvl - 1, 5 + lvl - 1, 5 + lvl - 1 };
+			if (cfg.exact) {
+				static thread_local BattleSolver solver;
+				const BattleOdds& odds = solver.solve(p, e, cfg.potions,
+					cfg.playerStarts ? BattleSolver::PLAYER_TURN : BattleSolver::ENEMY_TURN, cfg.fight);
+				winRate[static_cast<size_t>(cell)] = 100.0 * odds.win;
+				hpLoss[static_cast<size_t>(cell)] = p.health - odds.expectedHealthLeft;
+				continue;
+			}
+			Rng lanes[BattleBatch::LANES];
+			for (int k = 0; k < BattleBatch::LANES; ++k) {
+				lanes[k].reseed((cfg.seed * 1000003ull + static_cast<uint64_t>(cell)) * BattleBatch::LANES + static_cast<uint64_t>(k));
+			}
+			BattleJob job = { p, e, cfg.potions, cfg.playerStarts };
+			long long wins = 0, lost = 0;
+			BattleBatch::run(cfg.battlesPerCell, lanes, cfg.fight,
+				[&](int) { return job; },
+				[&](int, const BattleOutcome& o) {
+					wins += o.won ? 1 : 0;
+					lost += p.health - o.playerHealth;
+				}, cfg.simd);
+			winRate[static_cast<size_t>(cell)] = 100.0 * static_cast<double>(wins) / cfg.battlesPerCell;
+			hpLoss[static_cast<size_t>(cell)] = static_cast<double>(lost) / cfg.battlesPerCell;
 		}
+	};
 
-		dir = STOP;
-		Draw();
+	auto t0 = chrono::steady_clock::now();
+	vector<thread> pool;
+	for (int t = 0; t < threads; ++t) pool.emplace_back(worker);
+	for (auto& t : pool) t.join();
+	double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+	double total = static_cast<double>(cells) * cfg.battlesPerCell;
+
+	if (cfg.exact) {
+		cout << "Combat odds (exact): " << cells << " cells on " << threads << " threads in " << secs * 1000.0 << " ms\n";
+	}
+	else {
+		bool lanes = cfg.simd && BattleBatch::simdAvailable();
+		cout << "Combat sim: " << total << " battles on " << threads << " threads" << (lanes ? " x 8 AVX2 lanes" : " (scalar)")
+		     << " in " << secs << " s (" << (secs > 0 ? total / secs / 1e6 : 0.0) << " M battles/sec)\n";
+	}
+	cout
+	     << "Player HP " << cfg.playerHealth << ", DEF " << cfg.playerDefense << ", potions " << cfg.potions
+	     << (cfg.playerStarts ? ", player starts" : ", enemy starts") << "\n";
+
+	auto printTable = [&](const char* title, const vector<double>& values) {
+		cout << "\n" << title << " (rows: player STR, columns: enemy level)\nSTR";
+		for (int c = 1; c <= cols; ++c) cout << "\t" << c;
+		cout << "\n";
+		char buf[32];
+		for (int r = 0; r < rows; ++r) {
+			cout << (cfg.minStrength + r);
+			for (int c = 0; c < cols; ++c) {
+				snprintf(buf, sizeof(buf), "\t%.1f", values[static_cast<size_t>(r * cols + c)]);
+				cout << buf;
+			}
+			cout << "\n";
+		}
+	};
+	printTable("Win rate %", winRate);
+	printTable("Mean HP lost", hpLoss);
+	return 0;
+}
+
+// Self-check for BattleBatch: resolves the same random battles on the AVX2 lanes and on the scalar path from
+// identical seeds and requires every outcome and every final Rng state to match bit for bit.
+static int RunCombatVerify(int battles, uint64_t seed) {
+	if (!BattleBatch::simdAvailable()) {
+		cout << "Combat verify: no AVX2 on this CPU, only the scalar path is in use\n";
+		return 0;
+	}
+	Rng gen(seed);
+	vector<BattleJob> jobs(static_cast<size_t>(max(0, battles)));
+	for (auto& j : jobs) {
+		int pMax = 1 + gen.below(40), eMax = 1 + gen.below(40);
+		j.player = { 1 + gen.below(pMax), pMax, gen.below(12), gen.below(16) };
+		j.enemy = { 1 + gen.below(eMax), eMax, gen.below(12), gen.below(16) };
+		j.potions = gen.below(4);
+		j.playerStarts = gen.chance(50);
 	}
 
-	bool isBoxDiscovered(const Box& b) const {
-		int x0 = b.x();
-		int y0 = b.y();
-		int x1 = x0 + b.width() - 1;
-		int y1 = y0 + b.height() - 1;
-		for (int y = max(0, y0); y <= min(height - 1, y1); ++y) {
-			for (int x = max(0, x0); x <= min(width - 1, x1); ++x) {
-				if (revealedAreas[y][x]) return true;
+	long long mismatches = 0;
+	for (int kind = 0; kind < 2; ++kind) {
+		FightPolicy policy;
+		policy.kind = kind ? FightPolicy::CAUTIOUS : FightPolicy::ATTACK;
+		vector<BattleOutcome> results[2];
+		uint32_t states[2][BattleBatch::LANES][4];
+		for (int path = 0; path < 2; ++path) {
+			results[path].resize(jobs.size());
+			Rng lanes[BattleBatch::LANES];
+			for (int k = 0; k < BattleBatch::LANES; ++k) lanes[k].reseed(seed * 31 + static_cast<uint64_t>(k));
+			BattleBatch::run(battles, lanes, policy,
+				[&](int i) { return jobs[static_cast<size_t>(i)]; },
+				[&](int i, const BattleOutcome& o) { results[path][static_cast<size_t>(i)] = o; },
+				path == 1);
+			for (int k = 0; k < BattleBatch::LANES; ++k) lanes[k].getState(states[path][k]);
+		}
+		for (size_t i = 0; i < jobs.size(); ++i) {
+			const BattleOutcome& a = results[0][i];
+			const BattleOutcome& b = results[1][i];
+			if (a.won != b.won || a.escaped != b.escaped || a.playerHealth != b.playerHealth || a.enemyHealth != b.enemyHealth ||
+			    a.potionsLeft != b.potionsLeft || a.turns != b.turns) {
+				if (mismatches++ == 0) {
+					cout << "Mismatch in battle " << i << (kind ? " (cautious)" : " (attack)") << ": scalar HP " << a.playerHealth
+					     << "/" << a.enemyHealth << " in " << a.turns << " turns, lanes HP " << b.playerHealth << "/"
+					     << b.enemyHealth << " in " << b.turns << " turns\n";
+				}
 			}
 		}
-		return false;
+		if (memcmp(states[0], states[1], sizeof(states[0])) != 0) {
+			mismatches++;
+			cout << "Rng states differ after the run" << (kind ? " (cautious)" : " (attack)") << "\n";
+		}
+	}
+	cout << "Combat verify: " << 2LL * battles << " battles, " << mismatches << " mismatches\n";
+	return mismatches == 0 ? 0 : 1;
+}
+
+// Microbenchmarks for the hot kernels on fixed-seed fixtures. Each kernel runs in batches of at least
+// BATCH_MS; the best batch gives ns/op and the allocation counter gives allocs/op. The whole set runs RUNS times
+// and each kernel reports its median run, so one slow pass can't flag a regression on its own. Results can be
+// saved as a baseline file (one "name ns allocs" line per kernel) and later runs compared against it: a kernel
+// regresses when its median time grows by more than the threshold or it allocates more per op.
+class Bench {
+public:
+	struct Result {
+		string name;
+		double ns = 0.0;
+		double allocs = 0.0;
+	};
+
+	static constexpr int BATCH_MS = 40;
+	static constexpr int BATCHES = 5;
+	static constexpr int RUNS = 3; // odd, so a median over the threshold means most runs were
+	static const uint64_t SEED = 20240101; // fixtures don't follow --seed, so baselines stay comparable
+
+	Bench() : keys(), session(keys, SEED) { session.headless = true; }
+
+	vector<Result> runAll() {
+		vector<Result> results;
+		sink = 0;
+
+		// Box geometry on a fixed spread of boxes
+		Rng rng(session.rng.next());
+		vector<Box> spread;
+		for (int i = 0; i < 64; ++i) {
+			Box b(7 + rng.below(6), 5 + rng.below(4));
+			b.placeRandom(109, 25, rng);
+			spread.push_back(b);
+		}
+		size_t at = 0;
+		results.push_back(time("Box::intersects", [&]() {
+			const Box& a = spread[at & 63];
+			const Box& b = spread[(at * 7 + 3) & 63];
+			at++;
+			sink += a.intersects(b, 2);
+		}));
+		results.push_back(time("Box::closestEdge", [&]() {
+			const Box& a = spread[at & 63];
+			at++;
+			sink += a.closestEdge(static_cast<int>(at % 109), static_cast<int>(at % 25)).size();
+		}));
+
+		// Corridor kernels on a generated full-size map, between its first two boxes
+		Game map(session, 109, 25, 14);
+		map.Setup();
+		pair<int, int> sWall, eWall;
+		Game::CorridorPath corridor = fixtureCorridor(map, sWall, eWall);
+		pair<int, int> from = corridor.front(), to = corridor.back();
+		Game::CorridorPath centers;
+		results.push_back(time("Game::pathFits", [&]() { sink += map.pathFits(corridor, 0, 1, sWall, eWall); }));
+		results.push_back(time("Game::lShapedCorridor", [&]() {
+			map.lShapedCorridor(from.first, from.second, to.first, to.second, (at++ & 1) != 0, centers);
+			sink += centers.size();
+		}));
+		results.push_back(time("Game::writeCentersAsCorridor", [&]() { map.writeCentersAsCorridor(corridor); }));
+
+		// Level generation at the starting, a middle and the largest map size; every op builds the same layout
+		const int sizes[3][3] = { { 59, 15, 4 }, { 84, 20, 9 }, { 109, 25, 14 } };
+		for (const auto& size : sizes) {
+			Session setupSession(keys, SEED);
+			setupSession.headless = true;
+			Game game(setupSession, size[0], size[1], size[2]);
+			string name = "Game::Setup " + to_string(size[0]) + "x" + to_string(size[1]) + "/" + to_string(size[2]);
+			results.push_back(time(name, [&]() {
+				setupSession.rng = Rng(SEED);
+				game.Setup();
+			}));
+		}
+
+		// The room graph for far more rooms than a map holds today: triangulation plus the spanning tree
+		pmr::vector<pair<int, int>> rooms;
+		for (int i = 0; i < 500; ++i) rooms.emplace_back(rng.below(2000), rng.below(500));
+		results.push_back(time("RoomGraph 500 rooms", [&]() {
+			pmr::vector<RoomGraph::Edge> edges = RoomGraph::delaunay(rooms);
+			RoomGraph::Forest forest(rooms.size());
+			for (const RoomGraph::Edge& e : edges) forest.unite(e.a, e.b);
+			sink += edges.size() + static_cast<uint64_t>(forest.components());
+		}));
+
+		// Frame composition with the whole map revealed
+		map.grid.edit().revealRect(0, 0, map.width - 1, map.height - 1);
+		results.push_back(time("Game::composeFrame", [&]() { sink += map.composeFrame().size(); }));
+
+		// An enemy walking toward the player from a fixed floor tile
+		Enemy walker;
+		int wx = 0, wy = 0;
+		map.grid->nthFloor(map.grid->countFloor(0, 0, map.width - 1) + map.grid->countFloor(1, 0, map.width - 1), wx, wy);
+		int px = map.player.getX(), py = map.player.getY();
+		results.push_back(time("Enemy::stepToward", [&]() {
+			walker.placeAt(wx, wy);
+			walker.stepToward(px, py, *map.grid);
+			sink += walker.x();
+		}));
+
+		// The combat kernel: one battle at a mid-game matchup
+		Fighter p = { 20, 20, 2, 8 };
+		Fighter e = { 14, 14, 9, 9 };
+		FightPolicy policy;
+		policy.kind = FightPolicy::CAUTIOUS;
+		Rng battleRng(session.rng.next());
+		results.push_back(time("resolveBattle", [&]() {
+			sink += resolveBattle(p, e, 2, true, policy, battleRng).turns;
+		}));
+		return results;
 	}
 
-	// Run the main game loop
-	void Run() {
-		Setup();
-		Draw();
-		while (!gameOver) {
-			Input();
-			Logic();
-			Sleep(50);
+	// Per kernel, the run with the median time (runAll yields the kernels in the same order every time)
+	static vector<Result> median(const vector<vector<Result>>& runs) {
+		vector<Result> results = runs.front();
+		vector<Result> column(runs.size());
+		for (size_t k = 0; k < results.size(); ++k) {
+			for (size_t r = 0; r < runs.size(); ++r) column[r] = runs[r][k];
+			nth_element(column.begin(), column.begin() + column.size() / 2, column.end(),
+				[](const Result& a, const Result& b) { return a.ns < b.ns; });
+			results[k] = column[column.size() / 2];
+		}
+		return results;
+	}
+
+	static bool saveBaseline(const string& path, const vector<Result>& results) {
+		ofstream out(path, ios::trunc);
+		if (!out) return false;
+		out << "# name ns/op allocs/op\n";
+		char line[160];
+		for (const Result& r : results) {
+			snprintf(line, sizeof(line), "%s\t%.3f\t%.3f\n", r.name.c_str(), r.ns, r.allocs);
+			out << line;
+		}
+		return static_cast<bool>(out);
+	}
+
+	static bool loadBaseline(const string& path, map<string, Result>& baseline) {
+		ifstream in(path);
+		if (!in) return false;
+		string line;
+		while (getline(in, line)) {
+			if (line.empty() || line[0] == '#') continue;
+			size_t tab2 = line.rfind('\t');
+			size_t tab1 = tab2 == string::npos || tab2 == 0 ? string::npos : line.rfind('\t', tab2 - 1);
+			if (tab1 == string::npos) continue;
+			Result r;
+			r.name = line.substr(0, tab1);
+			r.ns = atof(line.c_str() + tab1 + 1);
+			r.allocs = atof(line.c_str() + tab2 + 1);
+			baseline[r.name] = r;
 		}
+		return true;
+	}
+
+private:
+	ConsoleKeys keys; // never read: the session is headless and nothing here asks for input
+	Session session;
+	volatile uint64_t sink = 0; // results land here so the kernels can't be optimised away
+
+	template<class Op>
+	static Result time(const string& name, Op op) {
+		// Grow the batch until it takes BATCH_MS, then keep the best of BATCHES batches
+		uint64_t iterations = 1;
+		for (;;) {
+			auto t0 = chrono::steady_clock::now();
+			for (uint64_t i = 0; i < iterations; ++i) op();
+			if (chrono::steady_clock::now() - t0 >= chrono::milliseconds(BATCH_MS) || iterations >= (1ull << 40)) break;
+			iterations *= 2;
+		}
+		Result r;
+		r.name = name;
+		r.ns = 1e300;
+		for (int b = 0; b < BATCHES; ++b) {
+			uint64_t allocs = threadAllocations;
+			auto t0 = chrono::steady_clock::now();
+			for (uint64_t i = 0; i < iterations; ++i) op();
+			double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - t0).count();
+			r.ns = min(r.ns, ns / static_cast<double>(iterations));
+			r.allocs = static_cast<double>(threadAllocations - allocs) / static_cast<double>(iterations);
+		}
+		return r;
+	}
+
+	// The corridor tryConnectBoxes would try first between boxes 0 and 1 with an L shape
+	static Game::CorridorPath fixtureCorridor(const Game& game, pair<int, int>& sWall, pair<int, int>& eWall) {
+		const Box& a = (*game.boxes)[0];
+		const Box& b = (*game.boxes)[1];
+		pair<int, int> ac(a.x() + a.width() / 2, a.y() + a.height() / 2);
+		pair<int, int> bc(b.x() + b.width() / 2, b.y() + b.height() / 2);
+		sWall = a.closestEdge(bc.first, bc.second)[1];
+		eWall = b.closestEdge(ac.first, ac.second)[1];
+		pair<int, int> s = game.outsideCenterFromWall(a, sWall, bc);
+		pair<int, int> e = game.outsideCenterFromWall(b, eWall, ac);
+		Game::CorridorPath centers;
+		game.lShapedCorridor(s.first, s.second, e.first, e.second, true, centers);
+		return centers;
 	}
 };
 
-int main() {
+// Runs the microbenchmarks, optionally compares them with a baseline file and/or saves them as the new baseline.
+// Returns 1 when any kernel regressed past the threshold (median percent slower, or more allocations per op).
+static int RunBench(const string& baselinePath, const string& savePath, double thresholdPercent) {
+	map<string, Bench::Result> baseline;
+	bool compare = !baselinePath.empty();
+	if (compare && !Bench::loadBaseline(baselinePath, baseline)) {
+		cerr << "Could not read the baseline " << baselinePath << "\n";
+		return 1;
+	}
+
+	Bench bench;
+	vector<vector<Bench::Result>> runs;
+	for (int r = 0; r < Bench::RUNS; ++r) runs.push_back(bench.runAll());
+	vector<Bench::Result> results = Bench::median(runs);
+
+	int regressions = 0;
+	char line[200];
+	snprintf(line, sizeof(line), "%-32s %12s %10s", "kernel", "ns/op", "allocs/op");
+	cout << line << (compare ? "   vs baseline" : "") << "\n";
+	for (const Bench::Result& r : results) {
+		snprintf(line, sizeof(line), "%-32s %12.1f %10.2f", r.name.c_str(), r.ns, r.allocs);
+		cout << line;
+		auto base = baseline.find(r.name);
+		if (base != baseline.end()) {
+			double change = base->second.ns > 0.0 ? 100.0 * (r.ns / base->second.ns - 1.0) : 0.0;
+			bool slower = change > thresholdPercent;
+			bool moreAllocs = r.allocs > base->second.allocs + 0.005;
+			snprintf(line, sizeof(line), "   %+7.1f%%", change);
+			cout << line;
+			if (slower || moreAllocs) {
+				regressions++;
+				cout << "  REGRESSION" << (moreAllocs ? " (allocs)" : "");
+			}
+		}
+		else if (compare) cout << "   (new)";
+		cout << "\n";
+	}
+	if (compare) cout << regressions << " regression(s) at a " << thresholdPercent << "% threshold\n";
+
+	if (!savePath.empty() && !Bench::saveBaseline(savePath, results)) {
+		cerr << "Could not write the baseline " << savePath << "\n";
+		return 1;
+	}
+	return regressions == 0 ? 0 : 1;
+}
+
+int main(int argc, char* argv[]) {
 	// Speed up iostreams for faster rendering path (we use WriteConsoleA for frames anyway)
 	std::ios::sync_with_stdio(false);
 	std::cin.tie(nullptr);
 	std::wcin.tie(nullptr);
 
-	Game game;
+	// Command line:
+	//   --replay <file> [--show]   play a recorded session back headlessly (or rendered with --show) at full speed
+	//   --record <file>            where to write this session's replay (default: last_session.replay)
+	//   --seed <n>                 fixed RNG seed instead of the clock
+	//   --autoplay <games>         run headless bot games on all cores; tune with --threads <n>, --max-level <n>,
+	//                              --fight attack|cautious, --shop none|balanced|potions|plan (plan = the auto-buy key)
+	//   --combat-sim <battles>     Monte Carlo win-rate/HP-loss tables over player STR x enemy level, per cell;
+	//                              also --player-hp <n>, --player-def <n>, --potions <n>, --enemy-starts, --fight, --threads
+	//   --combat-odds              the same tables computed exactly by the Markov-chain solver
+	//   --scalar                   sample combat without the AVX2 lanes
+	//   --combat-verify <battles>  check that the AVX2 lanes and the scalar path agree bit for bit
+	//   --load <file>              resume a run saved with K (savegame.c3s); with --autoplay, fork every bot game from it
+	//   --rl-server <socket>       serve a vectorized RL environment on a Unix-domain socket; --envs <n> (default 8),
+	//                              --shm <name> to share the observation buffer, --max-steps <n> per episode
+	//   --bench                    time the hot kernels (ns/op, allocs/op); --baseline <file> to compare against,
+	//                              --save-baseline <file> to store this run, --threshold <percent> (default 20)
+	//   --validate <layouts>       generate layouts at every map size and check them with the level validator
+	//   --trace <file>             record scope timings in any mode and write them as Chrome/Perfetto trace JSON
+	string replayPath;
+	string recordPath = "last_session.replay";
+	bool show = false;
+	uint64_t seed = static_cast<uint64_t>(time(nullptr));
+	int autoplayGames = 0;
+	int threads = 0;
+	AutoPlayer::Config botConfig;
+	CombatSimConfig simConfig;
+	bool combatSim = false;
+	int verifyBattles = 0;
+	string loadPath;
+	string rlSocket;
+	string rlShm;
+	int rlEnvs = 8;
+	int rlMaxSteps = 20000;
+	string tracePath;
+	bool bench = false;
+	int validateLayouts = 0;
+	string baselinePath;
+	string saveBaselinePath;
+	double benchThreshold = 20.0;
+	for (int i = 1; i < argc; ++i) {
+		string arg = argv[i];
+		if (arg == "--replay" && i + 1 < argc) replayPath = argv[++i];
+		else if (arg == "--record" && i + 1 < argc) recordPath = argv[++i];
+		else if (arg == "--seed" && i + 1 < argc) seed = strtoull(argv[++i], nullptr, 10);
+		else if (arg == "--show") show = true;
+		else if (arg == "--autoplay" && i + 1 < argc) autoplayGames = atoi(argv[++i]);
+		else if (arg == "--threads" && i + 1 < argc) threads = atoi(argv[++i]);
+		else if (arg == "--max-level" && i + 1 < argc) botConfig.maxLevel = atoi(argv[++i]);
+		else if (arg == "--fight" && i + 1 < argc) {
+			string v = argv[++i];
+			botConfig.fight.kind = (v == "cautious") ? FightPolicy::CAUTIOUS : FightPolicy::ATTACK;
+		}
+		else if (arg == "--combat-sim" && i + 1 < argc) { combatSim = true; simConfig.battlesPerCell = atoi(argv[++i]); }
+		else if (arg == "--combat-odds") { combatSim = true; simConfig.exact = true; }
+		else if (arg == "--scalar") simConfig.simd = false;
+		else if (arg == "--load" && i + 1 < argc) loadPath = argv[++i];
+		else if (arg == "--rl-server" && i + 1 < argc) rlSocket = argv[++i];
+		else if (arg == "--envs" && i + 1 < argc) rlEnvs = max(1, atoi(argv[++i]));
+		else if (arg == "--shm" && i + 1 < argc) rlShm = argv[++i];
+		else if (arg == "--max-steps" && i + 1 < argc) rlMaxSteps = max(1, atoi(argv[++i]));
+		else if (arg == "--trace" && i + 1 < argc) tracePath = argv[++i];
+		else if (arg == "--bench") bench = true;
+		else if (arg == "--validate" && i + 1 < argc) validateLayouts = atoi(argv[++i]);
+		else if (arg == "--baseline" && i + 1 < argc) baselinePath = argv[++i];
+		else if (arg == "--save-baseline" && i + 1 < argc) saveBaselinePath = argv[++i];
+		else if (arg == "--threshold" && i + 1 < argc) benchThreshold = atof(argv[++i]);
+		else if (arg == "--combat-verify" && i + 1 < argc) verifyBattles = atoi(argv[++i]);
+		else if (arg == "--player-hp" && i + 1 < argc) simConfig.playerHealth = atoi(argv[++i]);
+		else if (arg == "--player-def" && i + 1 < argc) simConfig.playerDefense = atoi(argv[++i]);
+		else if (arg == "--potions" && i + 1 < argc) simConfig.potions = atoi(argv[++i]);
+		else if (arg == "--enemy-starts") simConfig.playerStarts = false;
+		else if (arg == "--shop" && i + 1 < argc) {
+			string v = argv[++i];
+			botConfig.shop = (v == "none") ? AutoPlayer::SHOP_NONE : (v == "potions") ? AutoPlayer::SHOP_POTIONS :
+			                 (v == "plan") ? AutoPlayer::SHOP_PLAN : AutoPlayer::SHOP_BALANCED;
+		}
+	}
+
+	TraceFile trace(tracePath);
+	if (!replayPath.empty()) {
+		return RunReplay(replayPath, show);
+	}
+	vector<char> saved;
+	if (!loadPath.empty()) {
+		// Check the snapshot once up front so a bad file fails before anything starts
+		ConsoleKeys probeKeys;
+		Session probeSession(probeKeys, seed);
+		Game probe(probeSession);
+		if (!Game::readSnapshotFile(loadPath, saved) || !probe.restore(saved)) {
+			cerr << "Could not load a saved game from " << loadPath << "\n";
+			return 1;
+		}
+	}
+	if (autoplayGames > 0) {
+		return RunAutoplay(autoplayGames, threads, seed, botConfig, saved.empty() ? nullptr : &saved);
+	}
+	if (!rlSocket.empty()) {
+		return RunRlServer(rlSocket, rlEnvs, rlShm, rlMaxSteps);
+	}
+	if (validateLayouts > 0) {
+		return RunValidate(validateLayouts, threads, seed);
+	}
+	if (bench) {
+		return RunBench(baselinePath, saveBaselinePath, benchThreshold);
+	}
+	if (verifyBattles > 0) {
+		return RunCombatVerify(verifyBattles, seed);
+	}
+	if (combatSim) {
+		simConfig.threads = threads;
+		simConfig.seed = seed;
+		simConfig.fight = botConfig.fight;
+		return RunCombatSim(simConfig);
+	}
+
+	ConsoleKeys keys;
+	ReplayLog log;
+	// A resumed run can't be replayed from a seed, so it isn't recorded
+	Session session(keys, seed, saved.empty() ? &log : nullptr);
+	Game game(session);
+	if (!saved.empty()) game.restore(saved);
 	game.Run();
+
+	if (saved.empty()) log.save(recordPath);
 	return 0;
 }
\ No newline at end of file